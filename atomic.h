@@ -0,0 +1,71 @@
+#ifndef __ATOMIC_H__
+#define __ATOMIC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Atomic read-modify-write operations on 32-bit words. All of them are
+// lock-prefixed, which on x86 also makes them full memory barriers.
+
+/**
+ * atomic_xadd:
+ * Adds v to *p and returns the old value of *p.
+ */
+static inline uint32_t atomic_xadd(volatile uint32_t *p, uint32_t v) {
+  asm volatile("lock xaddl %0, %1" : "+r"(v), "+m"(*p) :: "memory");
+  return v;
+}
+
+/**
+ * atomic_cmpxchg:
+ * Stores new in *p if *p equals old. Returns the value *p had, so the
+ * exchange happened if and only if the result equals old.
+ */
+static inline uint32_t atomic_cmpxchg(volatile uint32_t *p, uint32_t old, uint32_t new) {
+  uint32_t prev;
+  asm volatile("lock cmpxchgl %2, %1"
+               : "=a"(prev), "+m"(*p)
+               : "r"(new), "0"(old)
+               : "memory");
+  return prev;
+}
+
+/* Stores v in *p and returns the old value. xchg with memory is always locked. */
+static inline uint32_t atomic_xchg(volatile uint32_t *p, uint32_t v) {
+  asm volatile("xchgl %0, %1" : "+r"(v), "+m"(*p) :: "memory");
+  return v;
+}
+
+static inline void atomic_add(volatile uint32_t *p, uint32_t v) {
+  asm volatile("lock addl %1, %0" : "+m"(*p) : "ir"(v) : "memory");
+}
+
+static inline void atomic_sub(volatile uint32_t *p, uint32_t v) {
+  asm volatile("lock subl %1, %0" : "+m"(*p) : "ir"(v) : "memory");
+}
+
+static inline void atomic_inc(volatile uint32_t *p) {
+  asm volatile("lock incl %0" : "+m"(*p) :: "memory");
+}
+
+/* Decrements *p and returns true if it reached zero. */
+static inline bool atomic_dec_and_test(volatile uint32_t *p) {
+  uint8_t zero;
+  asm volatile("lock decl %0; sete %1" : "+m"(*p), "=qm"(zero) :: "memory");
+  return zero;
+}
+
+static inline void atomic_or(volatile uint32_t *p, uint32_t v) {
+  asm volatile("lock orl %1, %0" : "+m"(*p) : "ir"(v) : "memory");
+}
+
+static inline void atomic_and(volatile uint32_t *p, uint32_t v) {
+  asm volatile("lock andl %1, %0" : "+m"(*p) : "ir"(v) : "memory");
+}
+
+/* Keeps the compiler from moving memory accesses across this point. */
+static inline void barrier() {
+  asm volatile("" ::: "memory");
+}
+
+#endif
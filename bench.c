@@ -0,0 +1,95 @@
+#include <stdint.h>
+
+#include "bench.h"
+#include "cpu.h"
+#include "io.h"
+#include "timer.h"
+#include "serial.h"
+#include "string.h"
+#include "klog.h"
+
+// Set up by link.ld around the .bench section.
+extern const struct bench bench_start[];
+extern const struct bench bench_end[];
+
+static uint32_t samples[BENCH_ITERATIONS];
+
+static void bench_report(const char *format, ...) {
+  char line[96];
+  va_list ap;
+  va_start(ap, format);
+  uint32_t len = vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+  serial_write(line, len < sizeof(line) ? len : sizeof(line) - 1);
+}
+
+static void sort_samples(uint32_t n) {
+  uint32_t i, j;
+  for (i = 1; i < n; i++) {
+    uint32_t v = samples[i];
+    for (j = i; j > 0 && samples[j - 1] > v; j--)
+      samples[j] = samples[j - 1];
+    samples[j] = v;
+  }
+}
+
+// The least it costs to read the TSC twice, to be taken off every sample.
+static uint32_t tsc_overhead() {
+  uint32_t best = (uint32_t)-1;
+  uint32_t i;
+  for (i = 0; i < BENCH_ITERATIONS; i++) {
+    uint64_t start = rdtsc();
+    uint32_t cycles = rdtsc() - start;
+    if (cycles < best)
+      best = cycles;
+  }
+  return best;
+}
+
+static void run_one(const struct bench *b, uint32_t overhead) {
+  uint32_t i;
+  if (b->setup)
+    b->setup();
+
+  uint32_t flags = irq_save();
+  for (i = 0; i < BENCH_WARMUP; i++)
+    b->run(i);
+  for (i = 0; i < BENCH_ITERATIONS; i++) {
+    uint64_t start = rdtsc();
+    b->run(i);
+    uint32_t cycles = rdtsc() - start;
+    samples[i] = cycles > overhead ? cycles - overhead : 0;
+  }
+  irq_restore(flags);
+
+  if (b->teardown)
+    b->teardown();
+
+  sort_samples(BENCH_ITERATIONS);
+  bench_report("bench %s %u %u %u %u %u\n", b->name, BENCH_ITERATIONS, samples[0],
+               samples[BENCH_ITERATIONS / 2], samples[BENCH_ITERATIONS * 99 / 100],
+               samples[BENCH_ITERATIONS - 1]);
+}
+
+void run_benchmarks() {
+  const struct bench *b;
+  uint32_t overhead = tsc_overhead();
+  klog(KLOG_INFO, "bench: running %u benchmarks, TSC overhead %u cycles",
+       (uint32_t)(bench_end - bench_start), overhead);
+  // Everything the log has so far goes out first, so that the results
+  // aren't interleaved with it.
+  klog_flush();
+  bench_report("bench-clock %u\n", timer_tsc_khz());
+  for (b = bench_start; b < bench_end; b++)
+    run_one(b, overhead);
+  bench_report("bench-done %u\n", (uint32_t)(bench_end - bench_start));
+}
+
+void bench_exit(uint8_t code) {
+  klog_flush();
+  serial_flush();
+  outb(BENCH_EXIT_PORT, code);
+  // Not under QEMU, or without isa-debug-exit.
+  for (;;)
+    asm volatile("cli; hlt" ::: "memory");
+}
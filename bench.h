@@ -0,0 +1,59 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+/**
+ * Microbenchmarks. BENCH puts a descriptor into the .bench section, so a
+ * benchmark lives next to the code it measures and needs no list to be
+ * kept anywhere; run_benchmarks finds them all between bench_start and
+ * bench_end (see link.ld).
+ *
+ * Each benchmark runs BENCH_WARMUP times untimed, then BENCH_ITERATIONS
+ * times with every call timed on its own by the TSC, with interrupts off.
+ * The cost of reading the TSC is measured once and taken off. Results go
+ * to COM1 as lines that tools/benchtable.py reads:
+ *
+ *   bench-clock <TSC kHz>
+ *   bench <name> <iterations> <min> <median> <p99> <max>   (cycles)
+ *   bench-done <benchmarks run>
+ *
+ * Everything here is built only with -DBENCHMARK. make bench builds such
+ * a kernel with -DBENCH_EXIT, runs it under QEMU and prints the table.
+ */
+
+#define BENCH_WARMUP      100
+#define BENCH_ITERATIONS  1000
+
+struct bench {
+  const char *name;
+  void (*setup)();            // optional, untimed, before the warmup
+  void (*run)(uint32_t i);    // one timed call; i counts from 0
+  void (*teardown)();         // optional, untimed
+};
+
+#define BENCH_FIXTURE(id, setup_fn, run_fn, teardown_fn) \
+  static const struct bench bench_desc_##id \
+  __attribute__((section(".bench"), used, aligned(4))) = \
+  { .name = #id, .setup = (setup_fn), .run = (run_fn), .teardown = (teardown_fn) }
+
+#define BENCH(id, run_fn) BENCH_FIXTURE(id, 0, run_fn, 0)
+
+/**
+ * run_benchmarks:
+ * Runs every registered benchmark on the calling CPU. Requires init_timer
+ * and the heap.
+ */
+void run_benchmarks();
+
+/**
+ * bench_exit:
+ * Flushes the log and COM1, then ends the QEMU run through its
+ * isa-debug-exit device (make bench), which exits with (code << 1) | 1.
+ */
+void bench_exit(uint8_t code) __attribute__((noreturn));
+
+/* The I/O port make bench gives isa-debug-exit. */
+#define BENCH_EXIT_PORT   0xF4
+
+#endif
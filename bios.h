@@ -0,0 +1,22 @@
+#ifndef __BIOS_H__
+#define __BIOS_H__
+
+#include <stdint.h>
+
+// BIOS data area fields
+#define BDA_EBDA_SEGMENT        0x40E
+#define BDA_BASE_MEMORY_KB      0x413
+
+/**
+ * bda_read16:
+ * Reads a word of the BIOS data area, which is identity mapped. The
+ * address goes through an empty asm, or GCC takes anything in the first
+ * page for a null pointer and warns about the access.
+ */
+static inline uint16_t bda_read16(uint32_t offset) {
+  volatile uint16_t *p = (volatile uint16_t *)offset;
+  asm("" : "+r"(p));
+  return *p;
+}
+
+#endif
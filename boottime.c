@@ -0,0 +1,57 @@
+#include <stdint.h>
+
+#include "boottime.h"
+#include "cpu.h"
+#include "timer.h"
+#include "serial.h"
+#include "string.h"
+#include "compiler.h"
+
+struct boot_mark {
+  const char *phase;
+  uint64_t tsc;
+};
+
+// Set by loader.s before anything else runs.
+extern uint64_t boot_loader_tsc;
+
+// Only kmain and what it calls mark and report, so all of this goes with
+// the rest of boot.
+static struct boot_mark marks[BOOT_MAX_MARKS] __initdata;
+static uint32_t nr_marks __initdata = 0;
+
+void __init boot_mark(const char *phase) {
+  if (nr_marks == BOOT_MAX_MARKS)
+    return;
+  marks[nr_marks].phase = phase;
+  marks[nr_marks].tsc = rdtsc();
+  nr_marks++;
+}
+
+static uint32_t __init cycles_to_us(uint64_t cycles) {
+  return div64_32(timer_cycles_to_ns(cycles), NSEC_PER_USEC, NULL);
+}
+
+static void __init report_line(const char *format, ...) {
+  char line[96];
+  va_list ap;
+  va_start(ap, format);
+  uint32_t len = vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+  serial_write(line, len < sizeof(line) ? len : sizeof(line) - 1);
+}
+
+void __init boot_timeline_report() {
+  uint64_t start = boot_loader_tsc;
+  uint64_t prev = start;
+  uint32_t i;
+
+  report_line("boot timeline (TSC at %u kHz)\n", timer_tsc_khz());
+  report_line("%-24s %10s %10s\n", "phase", "start us", "took us");
+  for (i = 0; i < nr_marks; i++) {
+    report_line("%-24s %10u %10u\n", marks[i].phase,
+                cycles_to_us(prev - start), cycles_to_us(marks[i].tsc - prev));
+    prev = marks[i].tsc;
+  }
+  report_line("%-24s %10s %10u\n", "total", "", cycles_to_us(prev - start));
+}
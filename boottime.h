@@ -0,0 +1,27 @@
+#ifndef __BOOTTIME_H__
+#define __BOOTTIME_H__
+
+#include <stdint.h>
+
+/**
+ * The boot timeline. loader.s reads the TSC first thing; after that,
+ * boot_mark stamps the end of each boot phase. Stamps are raw TSC values,
+ * so marking costs next to nothing and works before the timer is set up.
+ * They are turned into microseconds only when reported. All of it is
+ * boot-only (see compiler.h): nothing may mark once kmain has returned.
+ */
+
+#define BOOT_MAX_MARKS 32
+
+/* Marks the end of the named phase, which began at the previous mark
+ * (or in loader.s). Marks past BOOT_MAX_MARKS are dropped. */
+void boot_mark(const char *phase);
+
+/**
+ * boot_timeline_report:
+ * Writes a table of the phases, with their start times and durations in
+ * microseconds, to COM1. Requires init_timer.
+ */
+void boot_timeline_report();
+
+#endif
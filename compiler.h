@@ -0,0 +1,25 @@
+#ifndef __COMPILER_H__
+#define __COMPILER_H__
+
+/**
+ * Where code goes. link.ld lays .text out as cold code, then the
+ * profile-ordered functions (text_order.ld), then hot code, then the
+ * rest, so that what runs all the time shares as few cache lines and
+ * pages as possible.
+ *
+ * __hot and __cold also tell GCC how hard to optimise; at -O2 it puts
+ * them in .text.hot and .text.unlikely by itself, and moves the unlikely
+ * parts of other functions to .text.unlikely too.
+ *
+ * __init code and __initdata data are used only while booting. They go in
+ * their own page-aligned section, between init_start and init_end, and
+ * must not be used once kmain has returned. kmain is __init itself, so
+ * that what GCC inlines into it stays there too.
+ */
+
+#define __hot       __attribute__((hot))
+#define __cold      __attribute__((cold))
+#define __init      __attribute__((section(".init.text"), cold))
+#define __initdata  __attribute__((section(".init.data")))
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <cpuid.h>
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_FEAT_EDX_TSC      (1 << 4)
+#define CPUID_FEAT_EDX_MSR      (1 << 5)
+#define CPUID_FEAT_EDX_APIC     (1 << 9)
+#define CPUID_FEAT_EDX_FXSR     (1 << 24)
+#define CPUID_FEAT_EDX_SSE      (1 << 25)
+#define CPUID_FEAT_EDX_SSE2     (1 << 26)
+
+// CPUID leaf 7 EBX feature bits
+#define CPUID_FEAT7_EBX_ERMS    (1 << 9)
+
+#define CR0_MP                  (1 << 1)
+#define CR0_EM                  (1 << 2)
+#define CR0_TS                  (1 << 3)
+#define CR0_WP                  (1 << 16)
+#define CR4_OSFXSR              (1 << 9)
+#define CR4_OSXMMEXCPT          (1 << 10)
+
+/**
+ * cpu_has_edx_feature:
+ * Checks a feature bit in EDX of CPUID leaf 1.
+ */
+static inline bool cpu_has_edx_feature(uint32_t feature) {
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (edx & feature) != 0;
+}
+
+/* Checks a feature bit in EBX of CPUID leaf 7, subleaf 0. */
+static inline bool cpu_has_leaf7_ebx_feature(uint32_t feature) {
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & feature) != 0;
+}
+
+static inline uint32_t read_cr0() {
+  uint32_t cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+  asm volatile("mov %0, %%cr0" :: "r"(cr0));
+}
+
+static inline uint32_t read_cr4() {
+  uint32_t cr4;
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+  asm volatile("mov %0, %%cr4" :: "r"(cr4));
+}
+
+/**
+ * cpu_enable_sse:
+ * Turns on the FPU and SSE on this CPU, if it has SSE2 and FXSAVE.
+ * Every CPU has to do this for itself.
+ *
+ * @return false if the CPU lacks them
+ */
+static inline bool cpu_enable_sse() {
+  if (!cpu_has_edx_feature(CPUID_FEAT_EDX_FXSR) ||
+      !cpu_has_edx_feature(CPUID_FEAT_EDX_SSE2))
+    return false;
+  write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+  write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+  asm volatile("fninit");
+  return true;
+}
+
+/**
+ * rdtsc:
+ * Reads the time stamp counter.
+ */
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* Spin-wait hint. */
+static inline void cpu_relax() {
+  asm volatile("pause" ::: "memory");
+}
+
+/**
+ * irq_save/irq_restore:
+ * Disables interrupts, returning the previous EFLAGS so that the
+ * interrupt flag can be put back the way it was.
+ */
+static inline uint32_t irq_save() {
+  uint32_t flags;
+  asm volatile("pushf\n\t"
+               "pop %0\n\t"
+               "cli"
+               : "=r"(flags) :: "memory");
+  return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+  asm volatile("push %0\n\t"
+               "popf"
+               :: "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/**
+ * div64_32:
+ * Divides a 64-bit value by a 32-bit one. We don't link against libgcc,
+ * so plain 64-bit division (which compiles to a __udivdi3 call) is not
+ * available in the kernel. If rem is non-null the remainder is stored there.
+ */
+static inline uint64_t div64_32(uint64_t n, uint32_t base, uint32_t *rem) {
+  uint32_t high = n >> 32;
+  uint32_t low = n;
+  uint32_t q_high = 0;
+  uint32_t r;
+  if (high >= base) {
+    q_high = high / base;
+    high %= base;
+  }
+  asm("divl %4" : "=a"(low), "=d"(r) : "0"(low), "1"(high), "rm"(base));
+  if (rem)
+    *rem = r;
+  return ((uint64_t)q_high << 32) | low;
+}
+
+/**
+ * mul_u64_u32_shr:
+ * Computes (a * mul) >> shift without overflowing 64 bits, as long as
+ * the result itself fits. shift must be at most 32.
+ */
+static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, uint32_t shift) {
+  uint32_t a_lo = a;
+  uint32_t a_hi = a >> 32;
+  uint64_t ret = ((uint64_t)a_lo * mul) >> shift;
+  if (a_hi)
+    ret += ((uint64_t)a_hi * mul) << (32 - shift);
+  return ret;
+}
+
+#endif
@@ -6,37 +6,49 @@
 #include "descriptor_tables.h"
 #include "string.h"
 #include "io.h"
+#include "smp.h"
+#include "compiler.h"
 
 // Internal use only
 extern void gdt_flush(uint32_t);
 extern void idt_flush(idt_ptr_t*);
 static gdt_entry_t construct_null_entry();
 static gdt_entry_t construct_entry(gdt_access_t access);
-static void init_gdt();
-static void init_idt();
+static gdt_entry_t construct_percpu_entry(uint32_t base, uint32_t limit);
+static void __init init_gdt(uint32_t cpu);
+static void __init init_idt();
 static void idt_set_gate(
     uint8_t idx,
     void(*base),
     uint16_t selector,
     idt_flags_t flags);
-static void PIC_remap(uint8_t offset1, uint8_t offset2);
+static void __init PIC_remap(uint8_t offset1, uint8_t offset2);
 
-gdt_entry_t gdt_entries[5];
-gdt_ptr_t   gdt_ptr;
+// Every CPU gets its own GDT, differing only in the per-CPU segment.
+gdt_entry_t gdt_entries[MAX_CPUS][GDT_ENTRIES];
+gdt_ptr_t   gdt_ptrs[MAX_CPUS];
 
 idt_entry_t idt_entries[256]; // 256 possible interrupt numbers
 idt_ptr_t   idt_ptr;
 
 
 // Initializes GDT and IDT.
-void init_descriptor_tables(){
-    init_gdt();
+void __init init_descriptor_tables(){
+    init_gdt(0);
     init_idt();
 }
 
-static void init_gdt() {
-    gdt_ptr.limit = (sizeof(gdt_entry_t) * 5) - 1;
-    gdt_ptr.base  = (uint32_t)&gdt_entries;
+// Loads the GDT and IDT on an application processor.
+void __init init_ap_descriptor_tables(uint32_t cpu){
+    init_gdt(cpu);
+    idt_flush(&idt_ptr);
+}
+
+static void __init init_gdt(uint32_t cpu) {
+    gdt_entry_t *entries = gdt_entries[cpu];
+    gdt_ptr_t *ptr = &gdt_ptrs[cpu];
+    ptr->limit = (sizeof(gdt_entry_t) * GDT_ENTRIES) - 1;
+    ptr->base  = (uint32_t)entries;
 
     gdt_entry_t null_segment = construct_null_entry();
     gdt_entry_t kernel_mode_code_segment = construct_entry(
@@ -72,13 +84,21 @@ static void init_gdt() {
         }
     );
 
-    gdt_entries[0] = null_segment;
-    gdt_entries[1] = kernel_mode_code_segment;
-    gdt_entries[2] = kernel_mode_data_segment;
-    gdt_entries[3] = user_mode_code_segment;
-    gdt_entries[4] = user_mode_data_segment;
+    gdt_entry_t percpu_segment = construct_percpu_entry(
+        (uint32_t)&cpus[cpu], sizeof(struct cpu) - 1);
+
+    entries[0] = null_segment;
+    entries[1] = kernel_mode_code_segment;
+    entries[2] = kernel_mode_data_segment;
+    entries[3] = user_mode_code_segment;
+    entries[4] = user_mode_data_segment;
+    entries[5] = percpu_segment;
 
-    gdt_flush((uint32_t)&gdt_ptr);
+    cpus[cpu].self = &cpus[cpu];
+    cpus[cpu].id = cpu;
+
+    gdt_flush((uint32_t)ptr);
+    asm volatile("mov %0, %%gs" :: "r"(GDT_PERCPU_SELECTOR));
 }
 
 /** The only thing that changes between the non-null GDT
@@ -102,6 +122,31 @@ static gdt_entry_t construct_entry(gdt_access_t access) {
     return entry;
 }
 
+/** A byte-granular ring 0 data segment over one CPU's struct cpu,
+ *  which that CPU keeps loaded in gs.
+ */
+static gdt_entry_t construct_percpu_entry(uint32_t base, uint32_t limit) {
+    gdt_entry_t entry = (struct gdt_entry_struct){
+        .base_low  = base & 0xFFFF,
+        .base_middle = (base >> 16) & 0xFF,
+        .base_high = (base >> 24) & 0xFF,
+        .limit_low = (limit & 0xFFFF),
+        .access = (struct gdt_access){
+            .type = GDT_DATA_TYPE_READ_WRITE,
+            .dt   = GDT_CODE_AND_DATA_DESCRIPTOR,
+            .dpl  = GDT_RING0,
+            .p    = GDT_SEGMENT_PRESENT
+        },
+        .granularity = (struct gdt_granularity){
+            .g = GDT_GRANULARITY_1K,
+            .d = GDT_OPERAND_SIZE_32,
+            .zero = 0,
+            .seglen = (limit >> 16) & 0xF
+        }
+    };
+    return entry;
+}
+
 /* Constructs a null GDT entry. */
 static gdt_entry_t construct_null_entry() {
     gdt_entry_t null_entry = (struct gdt_entry_struct){
@@ -134,7 +179,7 @@ static inline bool are_interrupts_enabled(){
 
 
 
-static void init_idt() {
+static void __init init_idt() {
 
   idt_ptr.limit = sizeof(idt_entry_t) * 256 - 1;
   idt_ptr.base = idt_entries;
@@ -199,9 +244,13 @@ static void init_idt() {
   idt_set_gate(46, irq14, 0x08, flags);
   idt_set_gate(47, irq15, 0x08, flags);
 
+  idt_set_gate(48, irq_lapic_timer, 0x08, flags);
+  idt_set_gate(49, irq_lapic_wake, 0x08, flags);
+  idt_set_gate(63, irq_lapic_spurious, 0x08, flags);
+
   idt_flush(&idt_ptr);
   // enable hardware interrupts
-  asm volatile ("sti");
+  asm volatile ("sti" ::: "memory");
 }
 
 
@@ -211,7 +260,7 @@ static inline void io_wait() {
 }
 
 // from http://wiki.osdev.org/8259_PIC
-static void PIC_remap(uint8_t offset1, uint8_t offset2) {
+static void __init PIC_remap(uint8_t offset1, uint8_t offset2) {
   unsigned char a1, a2;
 
   a1 = inb(PIC1_DATA);                        // save masks
@@ -14,6 +14,10 @@
 #define GDT_BASE                                      0x00000000
 #define GDT_LIMIT                                     0xFFFFFFFF
 
+// null, kernel code, kernel data, user code, user data, per-CPU data
+#define GDT_ENTRIES                                   6
+#define GDT_PERCPU_SELECTOR                           0x28
+
 //GDT granularity
   // SEGLEN field (segment length)
 #define GDT_SEGMENT_LENGTH                            0xF
@@ -144,6 +148,7 @@ struct gdt_ptr {
 typedef struct gdt_ptr gdt_ptr_t;
 
 void init_descriptor_tables();
+void init_ap_descriptor_tables(uint32_t cpu);
 
 
 
@@ -243,4 +248,8 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 
+extern void irq_lapic_timer();
+extern void irq_lapic_wake();
+extern void irq_lapic_spurious();
+
 #endif
@@ -1,10 +1,14 @@
 #include "error.h"
-#include "string.h"
-extern void error(const char *message, const char *file, uint32_t line){
+#include "klog.h"
+#include "compiler.h"
+extern void __cold error(const char *message, const char *file, uint32_t line){
     // We encountered a massive problem and have to stop.
     asm("cli"); // Disable interrupts.
 
-    printf("ERROR( %s ) at %s: %d\n", message, file, line);
+    // This may be a fault in the console, the log or the serial driver,
+    // with their locks held, so get out of their way first.
+    klog_panic();
+    klog(KLOG_EMERG, "ERROR( %s ) at %s: %d", message, file, line);
     // Halt by going into an infinite loop.
     while(1);
 }
@@ -0,0 +1,333 @@
+// A work-stealing task executor with one Chase-Lev deque per CPU
+// ("Dynamic Circular Work-Stealing Deque", Chase and Lev, SPAA 2005, with
+// the memory orderings from Le et al., PPoPP 2013). The owning CPU pushes
+// and pops at the bottom without locks; other CPUs steal from the top with
+// a single compare-and-swap. The deques here are fixed size: a push to a
+// full deque fails, and the caller runs the task itself.
+//
+// Only the owner may push to a deque, so tasks submitted for another CPU
+// go to that CPU's inbox instead, a small ring under a spinlock.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "executor.h"
+#include "smp.h"
+#include "cpu.h"
+#include "isr.h"
+#include "lapic.h"
+#include "timer.h"
+#include "string.h"
+#include "trace.h"
+#include "klog.h"
+#include "spinlock.h"
+#include "compiler.h"
+
+#define TASK_DEQUE_MASK (TASK_DEQUE_SIZE - 1)
+#define TASK_INBOX_MASK (TASK_INBOX_SIZE - 1)
+
+struct worker {
+  // Thieves hammer top, so give it a cache line of its own.
+  volatile int32_t top __attribute__((aligned(64)));
+  volatile int32_t bottom __attribute__((aligned(64)));
+  // Only ever written by the owning CPU.
+  volatile uint32_t submitted;
+  volatile uint32_t completed;
+  struct task tasks[TASK_DEQUE_SIZE];
+  // Written by other CPUs, so kept off the lines above.
+  spinlock_t inbox_lock __attribute__((aligned(64)));
+  uint32_t inbox_head;
+  uint32_t inbox_tail;
+  struct task inbox[TASK_INBOX_SIZE];
+} __attribute__((aligned(64)));
+
+static struct worker workers[MAX_CPUS];
+static volatile uint32_t active_workers = 1;
+// Bit n is set while CPU n is halted waiting for work.
+static volatile uint32_t idle_mask = 0;
+
+// ---------------------------
+// Chase-Lev deque
+// ---------------------------
+
+// Owner only, with interrupts disabled.
+static bool deque_push(struct worker *w, struct task task) {
+  int32_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+  int32_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  if (b - t >= TASK_DEQUE_SIZE)
+    return false;
+  w->tasks[b & TASK_DEQUE_MASK] = task;
+  __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Owner only, with interrupts disabled.
+static bool deque_pop(struct worker *w, struct task *task) {
+  int32_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+  // The store to bottom must be visible before we read top, or a thief
+  // and the owner could both take the last task.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int32_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+  if (b - t < 0) {
+    // Empty.
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  *task = w->tasks[b & TASK_DEQUE_MASK];
+  if (b != t)
+    return true;
+
+  // The last task: race the thieves for it.
+  bool won = __atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+  return won;
+}
+
+static bool deque_steal(struct worker *w, struct task *task) {
+  int32_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int32_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+  if (b - t <= 0)
+    return false;
+
+  // Copy the task out before claiming it: once top moves on, the owner
+  // may reuse the slot.
+  *task = w->tasks[t & TASK_DEQUE_MASK];
+  return __atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// ---------------------------
+// Inboxes
+// ---------------------------
+
+// With interrupts disabled.
+static bool inbox_push(struct worker *w, struct task task) {
+  spin_lock(&w->inbox_lock);
+  bool pushed = w->inbox_tail - w->inbox_head < TASK_INBOX_SIZE;
+  if (pushed)
+    w->inbox[w->inbox_tail++ & TASK_INBOX_MASK] = task;
+  spin_unlock(&w->inbox_lock);
+  return pushed;
+}
+
+// With interrupts disabled. Oldest first. Thieves don't wait for the lock.
+static bool inbox_take(struct worker *w, struct task *task, bool thief) {
+  if (__atomic_load_n(&w->inbox_tail, __ATOMIC_RELAXED) ==
+      __atomic_load_n(&w->inbox_head, __ATOMIC_RELAXED))
+    return false;
+  if (thief) {
+    if (!spin_trylock(&w->inbox_lock))
+      return false;
+  } else {
+    spin_lock(&w->inbox_lock);
+  }
+  bool taken = w->inbox_head != w->inbox_tail;
+  if (taken)
+    *task = w->inbox[w->inbox_head++ & TASK_INBOX_MASK];
+  spin_unlock(&w->inbox_lock);
+  return taken;
+}
+
+// ---------------------------
+// Workers
+// ---------------------------
+
+static uint32_t tasks_pending() {
+  uint32_t submitted = 0, completed = 0, cpu;
+  for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+    submitted += workers[cpu].submitted;
+    completed += workers[cpu].completed;
+  }
+  return submitted - completed;
+}
+
+// Steal from the other active CPUs, nearest CPU number first. Inboxes
+// come last, and include those of CPUs that have stopped being workers
+// since the task was queued.
+static bool steal_any(uint32_t self, struct task *task) {
+  uint32_t n = active_workers;
+  uint32_t i;
+  for (i = 1; i < n; i++) {
+    uint32_t victim = (self + i) % n;
+    if (deque_steal(&workers[victim], task))
+      return true;
+  }
+  n = cpus_online;
+  for (i = 1; i < n; i++) {
+    if (inbox_take(&workers[(self + i) % n], task, true))
+      return true;
+  }
+  return false;
+}
+
+// Runs one task if there is one for us. Call with interrupts disabled;
+// the task itself runs with them enabled.
+static bool run_one(uint32_t self) {
+  struct worker *w = &workers[self];
+  struct task task;
+  if (!deque_pop(w, &task) && !inbox_take(w, &task, false) &&
+      !steal_any(self, &task))
+    return false;
+
+  asm volatile("sti" ::: "memory");
+  trace2(TRACE_TASK_BEGIN, (uint32_t)task.fn, (uint32_t)task.arg);
+  task.fn(task.arg);
+  trace1(TRACE_TASK_END, (uint32_t)task.fn);
+  asm volatile("cli" ::: "memory");
+  w->completed++;
+  return true;
+}
+
+static void wake_idle_workers() {
+  uint32_t mask = __atomic_load_n(&idle_mask, __ATOMIC_SEQ_CST);
+  uint32_t cpu;
+  for (cpu = 0; mask; cpu++, mask >>= 1) {
+    if ((mask & 1) && cpu < active_workers)
+      lapic_send_ipi(cpus[cpu].apic_id, LAPIC_WAKE_VECTOR);
+  }
+}
+
+void executor_worker() {
+  uint32_t self = this_cpu()->id;
+  uint32_t bit = 1 << self;
+
+  asm volatile("cli" ::: "memory");
+  for (;;) {
+    if (self < active_workers && run_one(self))
+      continue;
+
+    // Announce that we're about to sleep, then look again: a submitter
+    // bumps its counter before it reads idle_mask, so one of us sees
+    // the other.
+    __atomic_fetch_or(&idle_mask, bit, __ATOMIC_SEQ_CST);
+    if (self >= active_workers || tasks_pending() == 0) {
+      // sti only takes effect after the next instruction, so a wakeup
+      // IPI can't slip in between it and the hlt.
+      asm volatile("sti\n\thlt\n\tcli" ::: "memory");
+    }
+    __atomic_fetch_and(&idle_mask, ~bit, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void wake_irq(registers_t regs) {
+  // Nothing to do: the interrupt only brings a worker out of hlt.
+  (void)regs;
+}
+
+// ---------------------------
+// Public interface
+// ---------------------------
+
+void __init init_executor() {
+  uint32_t cpu;
+  for (cpu = 0; cpu < MAX_CPUS; cpu++)
+    spin_lock_init(&workers[cpu].inbox_lock, "executor inbox");
+  register_interrupt_handler(LAPIC_WAKE_VECTOR, &wake_irq);
+  executor_set_workers(cpus_online);
+}
+
+void executor_set_workers(uint32_t n) {
+  if (n == 0) n = 1;
+  if (n > cpus_online) n = cpus_online;
+  active_workers = n;
+  wake_idle_workers();
+}
+
+void executor_submit(task_fn_t fn, void *arg) {
+  struct task task = { .fn = fn, .arg = arg };
+
+  // Interrupts stay off so that no other thread on this CPU can get at
+  // the deque while we own it.
+  uint32_t flags = irq_save();
+  struct worker *w = &workers[this_cpu()->id];
+  w->submitted++;
+  bool queued = deque_push(w, task);
+  irq_restore(flags);
+
+  if (!queued) {
+    fn(arg);
+    flags = irq_save();
+    w->completed++;
+    irq_restore(flags);
+    return;
+  }
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (idle_mask)
+    wake_idle_workers();
+}
+
+void executor_submit_on(uint32_t cpu_hint, task_fn_t fn, void *arg) {
+  struct task task = { .fn = fn, .arg = arg };
+
+  uint32_t flags = irq_save();
+  uint32_t self = this_cpu()->id;
+  if (cpu_hint == self || cpu_hint >= active_workers) {
+    irq_restore(flags);
+    executor_submit(fn, arg);
+    return;
+  }
+  // Counted before it is queued, as in executor_submit, so that the
+  // target never sees a task it isn't waiting for.
+  struct worker *w = &workers[self];
+  w->submitted++;
+  bool queued = inbox_push(&workers[cpu_hint], task);
+  if (!queued)
+    w->submitted--;
+  irq_restore(flags);
+
+  if (!queued) {
+    executor_submit(fn, arg);
+    return;
+  }
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&idle_mask, __ATOMIC_SEQ_CST) & (1 << cpu_hint))
+    lapic_send_ipi(cpus[cpu_hint].apic_id, LAPIC_WAKE_VECTOR);
+}
+
+void executor_wait() {
+  uint32_t flags = irq_save();
+  uint32_t self = this_cpu()->id;
+  while (tasks_pending() != 0) {
+    if (!run_one(self))
+      cpu_relax();
+  }
+  irq_restore(flags);
+}
+
+#ifdef BENCHMARK
+
+#define BENCH_TASKS     100000
+#define BENCH_SPIN      200
+
+static void bench_task(void *arg) {
+  volatile uint32_t i;
+  for (i = 0; i < BENCH_SPIN; i++);
+  (void)arg;
+}
+
+void executor_benchmark() {
+  uint32_t n;
+  for (n = 1; n <= cpus_online; n++) {
+    executor_set_workers(n);
+    uint64_t start = timer_now_ns();
+    uint32_t i;
+    for (i = 0; i < BENCH_TASKS; i++)
+      executor_submit(&bench_task, 0);
+    executor_wait();
+    uint32_t us = div64_32(timer_now_ns() - start, NSEC_PER_USEC, NULL);
+    if (us == 0) us = 1;
+    klog(KLOG_INFO, "executor: %u CPUs, %u tasks in %u us, %u tasks/s",
+           n, BENCH_TASKS, us,
+           (uint32_t)div64_32((uint64_t)BENCH_TASKS * 1000000, us, NULL));
+  }
+  executor_set_workers(cpus_online);
+}
+
+#endif
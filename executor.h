@@ -0,0 +1,58 @@
+#ifndef __EXECUTOR_H__
+#define __EXECUTOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Slots in each CPU's deque. Must be a power of two.
+#define TASK_DEQUE_SIZE 1024
+// Slots in each CPU's inbox for tasks from other CPUs. Must be a power of two.
+#define TASK_INBOX_SIZE 64
+
+typedef void (*task_fn_t)(void *arg);
+
+struct task {
+  task_fn_t fn;
+  void *arg;
+};
+
+/**
+ * init_executor:
+ * Lets every online CPU run tasks. The APs run the worker loop from
+ * ap_entry; until there is work they halt, and they are woken with an IPI.
+ */
+void init_executor();
+
+/**
+ * executor_submit:
+ * Queues fn(arg) on the calling CPU's deque. The submitting CPU pops its
+ * own newest tasks first, while cache-warm. Idle CPUs steal the oldest
+ * ones. If the deque is full the task runs right away on the caller.
+ */
+void executor_submit(task_fn_t fn, void *arg);
+
+/**
+ * executor_submit_on:
+ * Queues fn(arg) for the CPU numbered cpu_hint, say the one whose cache
+ * holds the data, and wakes it if it is idle. The CPU takes these before
+ * it steals, but it is only a hint: an idle CPU may still steal the task.
+ * If the hint isn't a worker, or its inbox is full, this is
+ * executor_submit.
+ */
+void executor_submit_on(uint32_t cpu_hint, task_fn_t fn, void *arg);
+
+/* Runs and steals tasks on the calling CPU until every submitted task has finished. */
+void executor_wait();
+
+/* Limits which CPUs run tasks to those numbered below n (for benchmarking). */
+void executor_set_workers(uint32_t n);
+
+/* The AP worker loop. Never returns. */
+void executor_worker() __attribute__((noreturn));
+
+#ifdef BENCHMARK
+/* Reports tasks per second for 1 to cpus_online workers. */
+void executor_benchmark();
+#endif
+
+#endif
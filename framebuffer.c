@@ -1,59 +1,167 @@
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "framebuffer.h"
 #include "string.h"
 #include "io.h"
+#include "spinlock.h"
+#include "compiler.h"
 
 // For internal use only
 
-// A convenient define which gives a char ptr to the frame buffer
-#define FB_CHAR_PTR ((unsigned char *) FB_BASE_ADDRESS)
-
 // A define that gives us uint16 ptr to the frame buffer.
 // Cells are 2 bytes wide (16 bits) so this makes indexing more natural.
-#define FB_UINT16_PTR ((uint16_t *) FB_BASE_ADDRESS)
+#define FB_UINT16_PTR ((volatile uint16_t *) FB_BASE_ADDRESS)
+
+#define FB_CELL(c, fg, bg) ((uint16_t)(unsigned char)(c) | ((((bg) & 0x0f) << 4 | ((fg) & 0x0f)) << 8))
+#define FB_BLANK FB_CELL(' ', FB_WHITE, FB_BLACK)
+#define FB_ALL_ROWS ((1u << FB_HEIGHT) - 1)
+
+// Everything is drawn into the shadow screen in RAM first; fb_flush copies
+// the rows that changed to VRAM and updates the CRTC. The shadow is a ring
+// of rows too, so scrolling it moves no data: screen row r is
+// shadow[(shadow_first + r) % FB_HEIGHT].
+static uint16_t shadow[FB_HEIGHT][FB_WIDTH];
+static unsigned int shadow_first = 0;
+// Bit r is set if screen row r differs from VRAM.
+static uint32_t dirty_rows = 0;
+// Lines scrolled since the last flush.
+static unsigned int pending_scroll = 0;
 
 static unsigned int fb_col = 0;
 static unsigned int fb_row = 0;
 
-void fb_write_cell(short i, char c, unsigned char fg, unsigned char bg) {
-  unsigned char *fb = FB_CHAR_PTR;
-  fb[i*2] = c;
-  fb[i*2 + 1] = ((bg & 0x0f) << 4) | (fg & 0x0f);
+// The VRAM line the screen starts at, as of the last flush.
+static unsigned int fb_top = FB_RING_FIRST_LINE;
+// What the CRTC was last told, so that flushes only touch the ports
+// when something moved.
+static unsigned int hw_start = (unsigned int)-1;
+static unsigned int hw_cursor = (unsigned int)-1;
+
+// Lines that have scrolled off the screen, oldest first from
+// scrollback_first. The ring wraps around FB_SCROLLBACK_LINES.
+static uint16_t scrollback[FB_SCROLLBACK_LINES][FB_WIDTH];
+static unsigned int scrollback_first = 0;
+static unsigned int scrollback_count = 0;
+// How many lines back the view is; 0 shows the live screen.
+static unsigned int fb_view = 0;
+
+static spinlock_t fb_lock = SPINLOCK_INIT("console");
+
+static uint16_t *shadow_line(unsigned int row) {
+  return shadow[(shadow_first + row) % FB_HEIGHT];
 }
 
-void fb_move_cursor(unsigned short pos) {
-  outb(FB_COMMAND_PORT, FB_HIGH_BYTE_COMMAND);
-  outb(FB_DATA_PORT, ((pos >> 8) & 0x00FF));
-  outb(FB_COMMAND_PORT, FB_LOW_BYTE_COMMAND);
-  outb(FB_DATA_PORT, pos & 0x00FF);
+static volatile uint16_t *vram_line(unsigned int line) {
+  return FB_UINT16_PTR + line * FB_WIDTH;
 }
 
-void fb_newline() {
+// Lines are copied a pair of cells at a time.
+static void copy_to_vram(volatile uint16_t *dst, const uint16_t *src) {
+  volatile uint32_t *d = (volatile uint32_t *)dst;
+  const uint32_t *s = (const uint32_t *)src;
+  unsigned int i;
+  for (i = 0; i < FB_WIDTH / 2; i++)
+    d[i] = s[i];
+}
+
+static void copy_line(uint16_t *dst, const uint16_t *src) {
+  unsigned int i;
+  for (i = 0; i < FB_WIDTH; i++)
+    dst[i] = src[i];
+}
+
+static void fill_line(uint16_t *dst, uint16_t cell) {
+  unsigned int i;
+  for (i = 0; i < FB_WIDTH; i++)
+    dst[i] = cell;
+}
+
+static void crtc_write(uint8_t high_command, uint8_t low_command, unsigned short value) {
+  outb(FB_COMMAND_PORT, high_command);
+  outb(FB_DATA_PORT, ((value >> 8) & 0x00FF));
+  outb(FB_COMMAND_PORT, low_command);
+  outb(FB_DATA_PORT, value & 0x00FF);
+}
+
+// Makes the CRTC start displaying at the given VRAM line.
+static void set_start(unsigned int line) {
+  if (line == hw_start)
+    return;
+  hw_start = line;
+  crtc_write(FB_START_HIGH_COMMAND, FB_START_LOW_COMMAND, line * FB_WIDTH);
+}
+
+static void __hot flush() {
+  if (pending_scroll) {
+    // Move the window down by as many lines as the shadow scrolled; the
+    // rows that stay on screen are then already right in VRAM. Out of
+    // VRAM, start the window over and redraw all of it.
+    if (fb_top + pending_scroll + FB_HEIGHT > FB_VRAM_LINES) {
+      fb_top = FB_RING_FIRST_LINE;
+      dirty_rows = FB_ALL_ROWS;
+    } else {
+      fb_top += pending_scroll;
+    }
+    pending_scroll = 0;
+  }
+
+  unsigned int row;
+  for (row = 0; dirty_rows; row++, dirty_rows >>= 1) {
+    if (dirty_rows & 1)
+      copy_to_vram(vram_line(fb_top + row), shadow_line(row));
+  }
+
+  if (fb_view == 0)
+    set_start(fb_top);
+
+  // The cursor location is an offset into VRAM, not into the screen.
+  unsigned int cursor = (fb_top + fb_row) * FB_WIDTH + fb_col;
+  if (cursor != hw_cursor) {
+    hw_cursor = cursor;
+    crtc_write(FB_HIGH_BYTE_COMMAND, FB_LOW_BYTE_COMMAND, cursor);
+  }
+}
+
+static void scrollback_push(const uint16_t *line) {
+  unsigned int slot = (scrollback_first + scrollback_count) % FB_SCROLLBACK_LINES;
+  if (scrollback_count < FB_SCROLLBACK_LINES)
+    scrollback_count++;
+  else
+    scrollback_first = (scrollback_first + 1) % FB_SCROLLBACK_LINES;
+  copy_line(scrollback[slot], line);
+}
+
+static void scroll_down() {
+  scrollback_push(shadow_line(0));
+  shadow_first = (shadow_first + 1) % FB_HEIGHT;
+  fill_line(shadow_line(FB_HEIGHT-1), FB_BLANK);
+  dirty_rows = (dirty_rows >> 1) | (1u << (FB_HEIGHT-1));
+  pending_scroll++;
+}
+
+static void newline() {
   if (fb_row < FB_HEIGHT-1)
   // have room to add new line without scrolling
     fb_row++;
   else
   // must scroll down to add the new line
-    fb_scroll_down();
+    scroll_down();
 
   fb_col = 0;
-  fb_move_cursor(fb_col + (fb_row * FB_WIDTH));
 }
 
 // advances cursor forward one character
-void fb_advance_pos() {
+static void advance_pos() {
   if (fb_col < FB_WIDTH-1)
     // have room to advance cursor in this row
     fb_col++;
   else
     // wrap around cursor to the start of the next line
-    fb_newline();
-
-  fb_move_cursor(fb_col + (fb_row * FB_WIDTH));
+    newline();
 }
 
-void fb_back_pos() {
+static void back_pos() {
     if (fb_col == 0){
         if(fb_row == 0) return;
         // We go up a row if we're in the first column
@@ -64,48 +172,166 @@ void fb_back_pos() {
         //
         fb_col--;
     }
-    fb_move_cursor(fb_col + (fb_row * FB_WIDTH));
 }
 
-void fb_write(char *buf, unsigned int len) {
-  unsigned int i;
-  uint16_t pos;
-  for (i=0; i<len; i++) {
+static void clear_row(unsigned int row) {
+  fill_line(shadow_line(row), FB_BLANK);
+  dirty_rows |= 1u << row;
+}
+
+void fb_write_cell(short i, char c, unsigned char fg, unsigned char bg) {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  shadow_line(i / FB_WIDTH)[i % FB_WIDTH] = FB_CELL(c, fg, bg);
+  dirty_rows |= 1u << (i / FB_WIDTH);
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_move_cursor(unsigned short pos) {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  fb_row = pos / FB_WIDTH;
+  fb_col = pos % FB_WIDTH;
+  flush();
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_newline() {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  newline();
+  flush();
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_advance_pos() {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  advance_pos();
+  flush();
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_back_pos() {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  back_pos();
+  flush();
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+static void __hot write(char *buf, unsigned int len) {
+  unsigned int i = 0;
+  while (i < len) {
     char c = buf[i];
     if (c == '\n' || c == '\r') {
-      fb_newline();
-    } else {
-      pos = fb_col + (fb_row * FB_WIDTH);
-      fb_write_cell(pos, c, FB_WHITE, FB_BLACK);
-      fb_advance_pos();
+      newline();
+      i++;
+      continue;
+    }
+    // Copy the run of ordinary characters that fits on this line.
+    uint16_t *line = shadow_line(fb_row);
+    unsigned int n = 0;
+    while (fb_col + n < FB_WIDTH && i + n < len &&
+           buf[i + n] != '\n' && buf[i + n] != '\r') {
+      line[fb_col + n] = FB_CELL(buf[i + n], FB_WHITE, FB_BLACK);
+      n++;
     }
+    dirty_rows |= 1u << fb_row;
+    i += n;
+    fb_col += n;
+    if (fb_col == FB_WIDTH)
+      newline();
   }
 }
 
+void __hot fb_write(char *buf, unsigned int len) {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  write(buf, len);
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_panic_write(char *buf, unsigned int len) {
+  // Whoever holds the lock, this CPU included, is not going to let go.
+  bool locked = spin_trylock(&fb_lock);
+  write(buf, len);
+  flush();
+  if (locked)
+    spin_unlock(&fb_lock);
+}
+
 void fb_write_str(char *buf) {
   fb_write(buf, strlen(buf));
 }
 
+void fb_flush() {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  flush();
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
 void fb_clear() {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
   fb_col = 0;
   fb_row = 0;
+  fb_top = FB_RING_FIRST_LINE;
+  fb_view = 0;
+  shadow_first = 0;
+  pending_scroll = 0;
 
-  int i;
-  for (i=0; i<FB_WIDTH*FB_HEIGHT; i++) {
-    fb_write_cell(i, ' ', FB_WHITE, FB_BLACK);
+  unsigned int i;
+  for (i=0; i<FB_HEIGHT; i++) {
+    clear_row(i);
   }
-  fb_move_cursor(0);
+  flush();
+  spin_unlock_irqrestore(&fb_lock, flags);
 }
 
 void fb_clear_row(uint8_t row) {
-  size_t i;
-  for (i=0; i<FB_WIDTH; i++) {
-    fb_write_cell((row*FB_WIDTH)+i, ' ', FB_WHITE, FB_BLACK);
-  }
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  clear_row(row);
+  spin_unlock_irqrestore(&fb_lock, flags);
 }
 
 void fb_scroll_down() {
-  uint16_t *fb = FB_UINT16_PTR;
-  memmove(fb, fb+FB_WIDTH, FB_WIDTH*2*(FB_HEIGHT*2-1));
-  fb_clear_row(FB_HEIGHT-1);
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  scroll_down();
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+// Line n of everything we have: the scrollback, followed by the screen.
+static const uint16_t *history_line(unsigned int n) {
+  if (n < scrollback_count)
+    return scrollback[(scrollback_first + n) % FB_SCROLLBACK_LINES];
+  return shadow_line(n - scrollback_count);
+}
+
+static void scroll_view(int lines) {
+  int view = (int)fb_view + lines;
+  if (view < 0)
+    view = 0;
+  if (view > (int)scrollback_count)
+    view = scrollback_count;
+  fb_view = view;
+
+  if (fb_view == 0) {
+    flush();
+    return;
+  }
+
+  // Draw the view into its own part of VRAM, leaving the live screen
+  // as it is.
+  unsigned int first = scrollback_count - fb_view;
+  unsigned int i;
+  for (i = 0; i < FB_HEIGHT; i++)
+    copy_to_vram(vram_line(FB_VIEW_LINE + i), history_line(first + i));
+  set_start(FB_VIEW_LINE);
+}
+
+void fb_scroll_view(int lines) {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  scroll_view(lines);
+  spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_view_live() {
+  uint32_t flags = spin_lock_irqsave(&fb_lock);
+  if (fb_view)
+    scroll_view(-(int)fb_view);
+  spin_unlock_irqrestore(&fb_lock, flags);
 }
@@ -24,15 +24,39 @@
 #define FB_WIDTH 80
 #define FB_HEIGHT 25
 
+/* Text mode VRAM runs from 0xB8000 to 0xBFFFF: 32KB, or 204 full lines */
+#define FB_VRAM_SIZE 0x8000
+#define FB_VRAM_LINES (FB_VRAM_SIZE / (FB_WIDTH * 2))
+
+/* The first screen's worth of VRAM is where scrollback is shown; the
+ * rest is a ring the console scrolls through */
+#define FB_VIEW_LINE 0
+#define FB_RING_FIRST_LINE FB_HEIGHT
+
+/* Lines kept after they scroll off the screen */
+#define FB_SCROLLBACK_SCREENS 8
+#define FB_SCROLLBACK_LINES (FB_SCROLLBACK_SCREENS * FB_HEIGHT)
+
 
 /* The framebuffer I/O ports */
 #define FB_COMMAND_PORT         0x3D4
 #define FB_DATA_PORT            0x3D5
 
 /* The framebuffer I/O port commands */
+#define FB_START_HIGH_COMMAND   12
+#define FB_START_LOW_COMMAND    13
 #define FB_HIGH_BYTE_COMMAND    14
 #define FB_LOW_BYTE_COMMAND     15
 
+/**
+ * The console draws into a shadow copy of the screen in RAM. Nothing
+ * reaches VRAM until fb_flush, which copies only the rows that changed and
+ * writes the cursor and start address registers only if they moved.
+ * Functions that move the cursor on their own (fb_move_cursor,
+ * fb_newline, fb_advance_pos, fb_back_pos) flush; the writing functions
+ * don't, and printf flushes once at the end.
+ */
+
 /**
  * Writes a character with the given foreground and background to position i
  * within the frame buffer.
@@ -46,7 +70,7 @@
 void fb_write_cell(short i, char c, unsigned char fg, unsigned char bg);
 
 /**
- * Moves cursor foward in the framebuffer
+ * Moves the cursor to cell pos of the screen
  */
 void fb_move_cursor(unsigned short pos);
 
@@ -60,15 +84,34 @@ void fb_back_pos();
  */
 void fb_write(char *buf, unsigned int len);
 void fb_write_str(char *buf);
+/* For error(): writes and flushes without waiting for the console lock. */
+void fb_panic_write(char *buf, unsigned int len);
+
+/* Copies what changed in the shadow screen to VRAM */
+void fb_flush();
 
 
 /* clear the screen*/
 void fb_clear();
 void fb_clear_row(uint8_t row);
 
-/* scroll down one row */
+/**
+ * Scrolls down one row. The screen is a window onto VRAM, and scrolling
+ * moves the window by reprogramming the CRTC start address; only when the
+ * window reaches the end of VRAM are its lines copied back to the start.
+ */
 void fb_scroll_down();
 
+/**
+ * Shows older output: moves the view lines further back into the
+ * scrollback (or forward, if negative). Output keeps going to the live
+ * screen, which comes back once the view returns to 0.
+ */
+void fb_scroll_view(int lines);
+
+/* Goes back to the live screen */
+void fb_view_live();
+
 void fb_newline();
 
 #endif
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "initrd.h"
+#include "paging.h"
+#include "string.h"
+#include "klog.h"
+#include "compiler.h"
+
+#define FNV_OFFSET_BASIS    2166136261u
+#define FNV_PRIME           16777619u
+
+// defined in kheap.c and paging.c
+extern uint32_t placement_address;
+extern page_directory_t *kernel_directory;
+
+// The module, as the bootloader reported it.
+static uint32_t module_start = 0;
+static uint32_t module_end = 0;
+
+// Set by init_initrd once the image has checked out.
+static const struct initrd_header *header = 0;
+static const uint32_t *buckets;
+static const struct initrd_entry *entries;
+
+void __init initrd_reserve(multiboot_info_t *info, uint32_t magic) {
+  if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
+    klog(KLOG_WARN, "initrd: not booted by a multiboot loader");
+    return;
+  }
+  if (!(info->flags & MULTIBOOT_INFO_MODS) || info->mods_count == 0)
+    return;
+
+  module_t *mods = (module_t *)info->mods_addr;
+  module_start = mods[0].mod_start;
+  module_end = mods[0].mod_end;
+  // Any further modules are ignored, but must not be allocated over
+  // either.
+  uint32_t i;
+  for (i = 0; i < info->mods_count; i++) {
+    uint32_t end = (mods[i].mod_end + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    if (end > placement_address)
+      placement_address = end;
+  }
+}
+
+static uint32_t initrd_hash(const char *name, uint32_t len) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  uint32_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static bool in_image(uint32_t offset, uint32_t len, uint32_t size) {
+  return offset <= size && len <= size - offset;
+}
+
+// Checks every offset once, so that lookups don't have to.
+static bool __init image_ok(const struct initrd_header *h, uint32_t size) {
+  if (size < sizeof(*h) || h->magic != INITRD_MAGIC || h->size > size)
+    return false;
+  size = h->size;
+  if (h->nbuckets == 0 || (h->nbuckets & (h->nbuckets - 1)) ||
+      h->nbuckets > size / sizeof(uint32_t) ||
+      h->nfiles > size / sizeof(struct initrd_entry))
+    return false;
+  uint32_t tables = sizeof(*h) + h->nbuckets * sizeof(uint32_t);
+  if (!in_image(tables, h->nfiles * sizeof(struct initrd_entry), size))
+    return false;
+
+  const uint32_t *b = (const uint32_t *)(h + 1);
+  const struct initrd_entry *e = (const struct initrd_entry *)(b + h->nbuckets);
+  const char *base = (const char *)h;
+  uint32_t i;
+  for (i = 0; i < h->nbuckets; i++) {
+    if (b[i] > h->nfiles)
+      return false;
+  }
+  for (i = 0; i < h->nfiles; i++) {
+    if (e[i].next > h->nfiles || e[i].name_len >= size ||
+        !in_image(e[i].name_offset, e[i].name_len + 1, size) ||
+        base[e[i].name_offset + e[i].name_len] != 0 ||
+        !in_image(e[i].data_offset, e[i].size, size) ||
+        e[i].hash != initrd_hash(base + e[i].name_offset, e[i].name_len))
+      return false;
+  }
+  return true;
+}
+
+void __init init_initrd() {
+  if (!module_start)
+    return;
+  const struct initrd_header *h = (const struct initrd_header *)module_start;
+  if (!image_ok(h, module_end - module_start)) {
+    klog(KLOG_WARN, "initrd: module at %#x is not an initrd image", module_start);
+    return;
+  }
+
+  // The module is inside the identity map; take write access away.
+  uint32_t addr;
+  for (addr = module_start & ~(FRAME_SIZE - 1); addr < module_end; addr += FRAME_SIZE) {
+    page_t *page = get_page(addr, 0, kernel_directory);
+    if (page)
+      page->rw = PAGE_READ_ONLY;
+    asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+  }
+
+  header = h;
+  buckets = (const uint32_t *)(h + 1);
+  entries = (const struct initrd_entry *)(buckets + h->nbuckets);
+  klog(KLOG_INFO, "initrd: %u files, %u KiB at %#x", h->nfiles, h->size / 1024, module_start);
+}
+
+static void fill_file(const struct initrd_entry *e, struct initrd_file *file) {
+  const char *base = (const char *)header;
+  file->name = base + e->name_offset;
+  file->data = base + e->data_offset;
+  file->size = e->size;
+}
+
+bool initrd_lookup(const char *name, struct initrd_file *file) {
+  if (!header)
+    return false;
+  uint32_t len = strlen(name);
+  uint32_t hash = initrd_hash(name, len);
+  uint32_t i = buckets[hash & (header->nbuckets - 1)];
+  uint32_t steps;
+  // A chain visits each entry at most once, unless the image is broken.
+  for (steps = 0; i && steps < header->nfiles; steps++) {
+    const struct initrd_entry *e = &entries[i - 1];
+    if (e->hash == hash && e->name_len == len &&
+        memcmp((const char *)header + e->name_offset, name, len) == 0) {
+      fill_file(e, file);
+      return true;
+    }
+    i = e->next;
+  }
+  return false;
+}
+
+uint32_t initrd_count() {
+  return header ? header->nfiles : 0;
+}
+
+bool initrd_file_at(uint32_t i, struct initrd_file *file) {
+  if (i >= initrd_count())
+    return false;
+  fill_file(&entries[i], file);
+  return true;
+}
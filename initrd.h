@@ -0,0 +1,75 @@
+#ifndef __INITRD_H__
+#define __INITRD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "multiboot.h"
+
+/**
+ * The initial ramdisk: the first multiboot module (a module line in
+ * menu.lst), in the format tools/mkinitrd.py writes. The module stays
+ * where the bootloader put it, mapped read-only, and lookups hand out
+ * pointers straight into it, so files are never copied.
+ *
+ * Layout, little endian, offsets from the start of the image:
+ *
+ *   struct initrd_header
+ *   uint32_t buckets[nbuckets]     1 + index of the first entry with
+ *                                  hash & (nbuckets - 1), 0 if none
+ *   struct initrd_entry [nfiles]
+ *   names, each followed by a NUL
+ *   file data, each file 16-byte aligned
+ *
+ * Names are hashed with 32-bit FNV-1a, so a lookup reads one bucket and
+ * usually one entry.
+ */
+
+#define INITRD_MAGIC 0x31445249  // "IRD1"
+
+struct initrd_header {
+  uint32_t magic;
+  uint32_t nfiles;
+  uint32_t nbuckets;        // a power of two
+  uint32_t size;            // of the whole image
+};
+
+struct initrd_entry {
+  uint32_t hash;
+  uint32_t next;            // 1 + index of the next entry in the bucket, 0 at the end
+  uint32_t name_offset;
+  uint32_t name_len;        // without the NUL
+  uint32_t data_offset;
+  uint32_t size;
+};
+
+/* A view of a file. Read-only, valid for as long as the kernel runs. */
+struct initrd_file {
+  const char *name;
+  const void *data;
+  uint32_t size;
+};
+
+/**
+ * initrd_reserve:
+ * Takes note of the modules and moves the placement address past them, so
+ * that nothing is allocated on top. Call before anything is kmalloced; the
+ * multiboot information is not looked at again.
+ */
+void initrd_reserve(multiboot_info_t *info, uint32_t magic);
+
+/**
+ * init_initrd:
+ * Checks the image and write-protects its pages. Requires init_paging.
+ * A missing or malformed image leaves the initrd empty.
+ */
+void init_initrd();
+
+/* Finds a file by name. Returns false if there is none. */
+bool initrd_lookup(const char *name, struct initrd_file *file);
+
+/* The number of files, and the file at index i, for listing them. */
+uint32_t initrd_count();
+bool initrd_file_at(uint32_t i, struct initrd_file *file);
+
+#endif
@@ -1,6 +1,9 @@
 extern isr_handler
 extern irq_handler
 
+; Every interrupt goes through here, so it goes with the hot code (link.ld).
+section .text.hot progbits alloc exec nowrite align=16
+
 %macro ISR_NOERRCODE 1
 global isr%1
 isr%1:
@@ -29,17 +32,27 @@ isr%1:
     jmp irq_common_stub
 %endmacro
 
+; This macro creates a stub for an interrupt raised by the local APIC.
+; The first parameter names the source, the second is its vector.
+%macro LAPIC_IRQ 2
+  global irq_lapic_%1
+  irq_lapic_%1:
+    cli
+    push byte 0       ;push dummy error code
+    push byte %2      ;push interrupt number
+    jmp irq_common_stub
+%endmacro
+
 isr_common_stub:
   pusha                 ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+  cld                   ; the C code expects DF clear; iret restores it
 
   mov ax, ds            ; Lower 16-bits of eax = ds.
   push eax              ; save the data segment descriptor
 
   mov ax, 0x10          ; load the kernel data segment descriptor
   mov ds, ax
-  mov es, ax
-  mov fs, ax
-  mov gs, ax
+  mov es, ax            ; (gs is left alone: it holds the per-CPU segment)
 
   call isr_handler
 
@@ -47,8 +60,6 @@ isr_common_stub:
 
   mov ds, ax
   mov es, ax
-  mov fs, ax
-  mov gs, ax
 
   popa                  ; Pops edi,esi,ebp...
   add esp, 8            ; Cleans up the pushed error code and pushed ISR number
@@ -57,6 +68,7 @@ isr_common_stub:
 
 irq_common_stub:
   pusha                 ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+  cld                   ; the C code expects DF clear; iret restores it
 
   mov ax, ds            ; Lower 16-bits of eax = ds.
   push eax              ; save the data segment descriptor
@@ -64,17 +76,13 @@ irq_common_stub:
 
   mov ax, 0x10          ; load the kernel data segment descriptor
   mov ds, ax
-  mov es, ax
-  mov fs, ax
-  mov gs, ax
+  mov es, ax            ; (gs is left alone: it holds the per-CPU segment)
 
   call irq_handler
 
   pop ebx               ; reload the original data segment descriptor
   mov ds, bx
   mov es, bx
-  mov fs, bx
-  mov gs, bx
 
   popa                  ; Pops edi,esi,ebp...
   add esp, 8            ; Cleans up the pushed error code and pushed ISR number
@@ -131,4 +139,8 @@ IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
 
+LAPIC_IRQ timer, 48
+LAPIC_IRQ wake, 49
+LAPIC_IRQ spurious, 63
+
 
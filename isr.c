@@ -1,9 +1,16 @@
 // based loosely on http://www.jamesmolloy.co.uk/tutorial_html/4.-The%20GDT%20and%20IDT.html
 #include <stdint.h>
+#include <stdbool.h>
 #include "isr.h"
 #include "string.h"
 #include "framebuffer.h"
 #include "io.h"
+#include "lapic.h"
+#include "softirq.h"
+#include "thread.h"
+#include "trace.h"
+#include "klog.h"
+#include "compiler.h"
 
 #define PIC1            0x20    /* IO base address for master PIC */
 #define PIC2            0xA0    /* IO base address for slave PIC */
@@ -16,17 +23,23 @@
 
 isr_t interrupt_handlers[256];
 
-void isr_handler(registers_t regs) {
+void __hot isr_handler(registers_t regs) {
   if (interrupt_handlers[regs.int_no] != 0) {
     isr_t handler = interrupt_handlers[regs.int_no];
     handler(regs);
   } else {
-    printf("unhandled s/w interrupt: %i\n", regs.int_no);
-    printf("eip: %x\n", regs.eip);
+    klog(KLOG_WARN, "unhandled s/w interrupt: %i, eip: %#x", regs.int_no, regs.eip);
   }
 }
 
 void ack_irq(int int_no) {
+  if (int_no >= LAPIC_TIMER_VECTOR) {
+    // Came from the local APIC. Spurious interrupts must not be EOI'd.
+    if (int_no != LAPIC_SPURIOUS_VECTOR)
+      lapic_eoi();
+    return;
+  }
+
   // Send an EOI (end of interrupt) signal to the PICs.
   // If this interrupt involved the slave.
   if (int_no >= 40)
@@ -39,7 +52,12 @@ void ack_irq(int int_no) {
 }
 
 // This gets called from our ASM interrupt handler stub.
-void irq_handler(registers_t regs) {
+void __hot irq_handler(registers_t regs) {
+  // COM1 carries the trace stream, so tracing its interrupt would keep
+  // feeding the trace with its own output.
+  bool traced = regs.int_no != IRQ4;
+  if (traced)
+    trace1(TRACE_IRQ_ENTER, regs.int_no);
 
   ack_irq(regs.int_no);
 
@@ -47,8 +65,22 @@ void irq_handler(registers_t regs) {
      isr_t handler = interrupt_handlers[regs.int_no];
      handler(regs);
   }
+
+  if (traced)
+    trace1(TRACE_IRQ_EXIT, regs.int_no);
+
+  do_softirq();
+  thread_preempt();
 }
 
 void register_interrupt_handler(uint8_t n, isr_t handler) {
   interrupt_handlers[n] = handler;
 }
+
+void pic_unmask(uint8_t irq) {
+  if (irq >= 8) {
+    outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+    irq = 2;
+  }
+  outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
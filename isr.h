@@ -21,6 +21,11 @@
 #define IRQ14 46
 #define IRQ15 47
 
+// Vectors delivered by the local APIC rather than the PICs.
+#define LAPIC_TIMER_VECTOR    48
+#define LAPIC_WAKE_VECTOR     49
+#define LAPIC_SPURIOUS_VECTOR 63
+
 typedef struct registers {
   uint32_t ds; // data segment
   uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax; // pushed by pusha
@@ -37,4 +42,8 @@ void ack_irq(int int_no);
 
 void register_interrupt_handler(uint8_t n, isr_t handler);
 
+// Unmasks a PIC interrupt line (0-15), and the cascade for slave lines.
+// The masks otherwise stay however the BIOS left them.
+void pic_unmask(uint8_t irq);
+
 #endif
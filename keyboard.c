@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdbool.h>
 
 #include "keyboard.h"
@@ -5,126 +6,304 @@
 #include "io.h"
 #include "string.h"
 #include "framebuffer.h"
+#include "ring.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "compiler.h"
 #define KBD_DATA_PORT 0x60
 
-int capsLock = 0;
-int shiftDown = 0;
-
-static void keyboard_cb();
-
-int scancodes[]  = {
-    0,  27, '1', '2', '3', '4', '5', '6', '7', '8',	/* 9 */
-  '9', '0', '-', '=', '\b',	/* Backspace */
-  '\t',			/* Tab */
-  'q', 'w', 'e', 'r',	/* 19 */
-  't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',	/* Enter key */
-    0,			/* 29   - Control */
-  'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',	/* 39 */
- '\'', '`',   17,		/* Left shift: Device Control 1 */
- '\\', 'z', 'x', 'c', 'v', 'b', 'n',			/* 49 */
-  'm', ',', '.', '/',   17,				/* Right shift: Device Control 1 */
-  '*',
-    0,	/* Alt */
-  ' ',	/* Space bar */
-    7,	/* Caps lock is a BELL in ASCII. We'll use this to toggle caps.*/
-    0,	/* 59 - F1 key ... > */
-    0,   0,   0,   0,   0,   0,   0,   0,
-    0,	/* < ... F10 */
-    0,	/* 69 - Num lock*/
-    0,	/* Scroll Lock */
-    0,	/* Home key */
-    0,	/* Up Arrow */
-    0,	/* Page Up */
-  '-',
-    174, /* Left Arrow */
-    0,
-    175, /* Right Arrow */
-  '+',
-    0,	/* 79 - End key*/
-    0,	/* Down Arrow */
-    0,	/* Page Down */
-    0,	/* Insert Key */
-    0,	/* Delete Key */
-    0,   0,   0,
-    0,	/* F11 Key */
-    0,	/* F12 Key */
-    0,	/* All other keys are undefined */
-    0,  27, '!', '@', '#', '$', '%', '^', '&', '*',     /* 9 */
-  '(', ')', '_', '+', '\b',     /* Backspace */
-  '\t',                 /* Tab */
-  'Q', 'W', 'E', 'R',   /* 19 */
-  'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', /* Enter key */
-    0,                  /* 29   - Control */
-  'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':',     /* 39 */
- '"', '~',   17,               /* Left shift: Device Control 1 */
- '|', 'Z', 'X', 'C', 'V', 'B', 'N',                    /* 49 */
-  'M', '<', '>', '?',   17,                             /* Right shift: Device Control 1 */
-  '*',
-    0,  /* Alt */
-  ' ',  /* Space bar */
-    7,  /* Caps lock is a BELL in ASCII. We'll use this to toggle caps.*/
-    0,  /* 59 - F1 key ... > */
-    0,   0,   0,   0,   0,   0,   0,   0,
-    0,  /* < ... F10 */
-    0,  /* 69 - Num lock*/
-    0,  /* Scroll Lock */
-    0,  /* Home key */
-    0,  /* Up Arrow */
-    0,  /* Page Up */
-  '-',
-    174,  /* Left Arrow */
-    0,
-    175,  /* Right Arrow */
-  '+',
-    0,  /* 79 - End key*/
-    0,  /* Down Arrow */
-    0,  /* Page Down */
-    0,  /* Insert Key */
-    0,  /* Delete Key */
-    0,   0,   0,
-    0,  /* F11 Key */
-    0,  /* F12 Key */
-    0,  /* All other keys are undefined */
+#define KBD_PREFIX_E0 0xE0
+#define KBD_PREFIX_E1 0xE1
+#define KBD_BREAK 0x80
+// Pause sends E1 1D 45 E1 9D C5 and no break code of its own.
+#define KBD_PAUSE_LENGTH 5
+
+// Scancodes waiting for the keyboard softirq. Must be a power of two.
+#define KBD_RING_SIZE 256
+// How many scancodes the softirq takes off the ring at a time.
+#define KBD_BATCH 16
+
+static struct ring kbd_ring;
+static unsigned char kbd_ring_buf[KBD_RING_SIZE];
+
+// Key events and finished lines, for consumers. kbd_lock covers these and
+// the line being edited.
+static struct ring event_ring;
+static struct kbd_event event_buf[KBD_EVENT_RING_SIZE];
+static struct ring input_ring;
+static char input_buf[KBD_INPUT_SIZE];
+static char line[KBD_LINE_MAX];
+static uint32_t line_len = 0;
+static spinlock_t kbd_lock = SPINLOCK_INIT("keyboard");
+static struct wait_queue kbd_waiters = WAIT_QUEUE_INIT(kbd_waiters);
+
+// Scancode set 1, without and with shift. Keys without a character are
+// KEY_* codes in both columns.
+static const uint16_t keymap[][2] = {
+  [0x01] = { 27, 27 },
+  [0x02] = { '1', '!' }, [0x03] = { '2', '@' }, [0x04] = { '3', '#' },
+  [0x05] = { '4', '$' }, [0x06] = { '5', '%' }, [0x07] = { '6', '^' },
+  [0x08] = { '7', '&' }, [0x09] = { '8', '*' }, [0x0A] = { '9', '(' },
+  [0x0B] = { '0', ')' }, [0x0C] = { '-', '_' }, [0x0D] = { '=', '+' },
+  [0x0E] = { '\b', '\b' }, [0x0F] = { '\t', '\t' },
+  [0x10] = { 'q', 'Q' }, [0x11] = { 'w', 'W' }, [0x12] = { 'e', 'E' },
+  [0x13] = { 'r', 'R' }, [0x14] = { 't', 'T' }, [0x15] = { 'y', 'Y' },
+  [0x16] = { 'u', 'U' }, [0x17] = { 'i', 'I' }, [0x18] = { 'o', 'O' },
+  [0x19] = { 'p', 'P' }, [0x1A] = { '[', '{' }, [0x1B] = { ']', '}' },
+  [0x1C] = { '\n', '\n' }, [0x1D] = { KEY_LCTRL, KEY_LCTRL },
+  [0x1E] = { 'a', 'A' }, [0x1F] = { 's', 'S' }, [0x20] = { 'd', 'D' },
+  [0x21] = { 'f', 'F' }, [0x22] = { 'g', 'G' }, [0x23] = { 'h', 'H' },
+  [0x24] = { 'j', 'J' }, [0x25] = { 'k', 'K' }, [0x26] = { 'l', 'L' },
+  [0x27] = { ';', ':' }, [0x28] = { '\'', '"' }, [0x29] = { '`', '~' },
+  [0x2A] = { KEY_LSHIFT, KEY_LSHIFT }, [0x2B] = { '\\', '|' },
+  [0x2C] = { 'z', 'Z' }, [0x2D] = { 'x', 'X' }, [0x2E] = { 'c', 'C' },
+  [0x2F] = { 'v', 'V' }, [0x30] = { 'b', 'B' }, [0x31] = { 'n', 'N' },
+  [0x32] = { 'm', 'M' }, [0x33] = { ',', '<' }, [0x34] = { '.', '>' },
+  [0x35] = { '/', '?' }, [0x36] = { KEY_RSHIFT, KEY_RSHIFT },
+  [0x37] = { '*', '*' }, [0x38] = { KEY_LALT, KEY_LALT }, [0x39] = { ' ', ' ' },
+  [0x3A] = { KEY_CAPSLOCK, KEY_CAPSLOCK },
+  [0x3B] = { KEY_F1, KEY_F1 }, [0x3C] = { KEY_F2, KEY_F2 }, [0x3D] = { KEY_F3, KEY_F3 },
+  [0x3E] = { KEY_F4, KEY_F4 }, [0x3F] = { KEY_F5, KEY_F5 }, [0x40] = { KEY_F6, KEY_F6 },
+  [0x41] = { KEY_F7, KEY_F7 }, [0x42] = { KEY_F8, KEY_F8 }, [0x43] = { KEY_F9, KEY_F9 },
+  [0x44] = { KEY_F10, KEY_F10 },
+  [0x45] = { KEY_NUMLOCK, KEY_NUMLOCK }, [0x46] = { KEY_SCROLLLOCK, KEY_SCROLLLOCK },
+  // The keypad, as with num lock off.
+  [0x47] = { KEY_HOME, KEY_HOME }, [0x48] = { KEY_UP, KEY_UP }, [0x49] = { KEY_PGUP, KEY_PGUP },
+  [0x4A] = { '-', '-' }, [0x4B] = { KEY_LEFT, KEY_LEFT }, [0x4C] = { KEY_KP5, KEY_KP5 },
+  [0x4D] = { KEY_RIGHT, KEY_RIGHT }, [0x4E] = { '+', '+' }, [0x4F] = { KEY_END, KEY_END },
+  [0x50] = { KEY_DOWN, KEY_DOWN }, [0x51] = { KEY_PGDN, KEY_PGDN },
+  [0x52] = { KEY_INSERT, KEY_INSERT }, [0x53] = { KEY_DELETE, KEY_DELETE },
+  [0x57] = { KEY_F11, KEY_F11 }, [0x58] = { KEY_F12, KEY_F12 },
+};
+
+// Keys sent with an E0 prefix. Missing entries, such as the fake shifts
+// around Print Screen, are ignored.
+static const uint16_t keymap_e0[] = {
+  [0x1C] = '\n', [0x1D] = KEY_RCTRL, [0x35] = '/', [0x37] = KEY_PRINTSCREEN,
+  [0x38] = KEY_RALT, [0x47] = KEY_HOME, [0x48] = KEY_UP, [0x49] = KEY_PGUP,
+  [0x4B] = KEY_LEFT, [0x4D] = KEY_RIGHT, [0x4F] = KEY_END, [0x50] = KEY_DOWN,
+  [0x51] = KEY_PGDN, [0x52] = KEY_INSERT, [0x53] = KEY_DELETE,
+  [0x5B] = KEY_LGUI, [0x5C] = KEY_RGUI, [0x5D] = KEY_MENU,
 };
 
+#define KEYMAP_SIZE (sizeof(keymap) / sizeof(keymap[0]))
+#define KEYMAP_E0_SIZE (sizeof(keymap_e0) / sizeof(keymap_e0[0]))
+
+// Which modifier each modifier key holds down. Left and right are kept
+// apart, so that letting go of one leaves the other in effect.
+static const struct {
+  uint16_t key;
+  uint8_t mod;
+  uint8_t held;
+} modifier_keys[] = {
+  { KEY_LSHIFT, KBD_MOD_SHIFT, 0x01 }, { KEY_RSHIFT, KBD_MOD_SHIFT, 0x02 },
+  { KEY_LCTRL,  KBD_MOD_CTRL,  0x04 }, { KEY_RCTRL,  KBD_MOD_CTRL,  0x08 },
+  { KEY_LALT,   KBD_MOD_ALT,   0x10 }, { KEY_RALT,   KBD_MOD_ALT,   0x20 },
+};
+
+// Decoder state; only the softirq touches it.
+static enum { DECODE_NORMAL, DECODE_E0, DECODE_E1 } decode_state = DECODE_NORMAL;
+static uint32_t pause_left = 0;
+static uint8_t held_keys = 0;
+static bool caps_lock = false;
+
+static uint8_t modifiers() {
+  uint8_t mods = caps_lock ? KBD_MOD_CAPS : 0;
+  uint32_t i;
+  for (i = 0; i < sizeof(modifier_keys) / sizeof(modifier_keys[0]); i++) {
+    if (held_keys & modifier_keys[i].held)
+      mods |= modifier_keys[i].mod;
+  }
+  return mods;
+}
+
+static void track_modifiers(uint16_t key, bool released) {
+  uint32_t i;
+  for (i = 0; i < sizeof(modifier_keys) / sizeof(modifier_keys[0]); i++) {
+    if (modifier_keys[i].key != key)
+      continue;
+    if (released)
+      held_keys &= ~modifier_keys[i].held;
+    else
+      held_keys |= modifier_keys[i].held;
+  }
+  if (key == KEY_CAPSLOCK && !released)
+    caps_lock = !caps_lock;
+}
+
+// The character for a key, given the modifiers.
+static uint8_t translate(uint8_t code, uint16_t key, bool extended, uint8_t mods) {
+  if (key >= 0x100)
+    return 0;
+  if (extended)
+    return key;
+  bool letter = key >= 'a' && key <= 'z';
+  if (letter && (mods & KBD_MOD_CTRL))
+    return key & 0x1F;
+  bool shift = (mods & KBD_MOD_SHIFT) != 0;
+  if (letter && (mods & KBD_MOD_CAPS))
+    shift = !shift;
+  return keymap[code][shift];
+}
+
+// Feeds one scancode to the decoder. Returns true and fills in event when
+// it completes a key press or release.
+static bool decode(unsigned char scan_code, struct kbd_event *event) {
+  if (decode_state == DECODE_E1) {
+    if (--pause_left)
+      return false;
+    decode_state = DECODE_NORMAL;
+    event->key = KEY_PAUSE;
+    event->ascii = 0;
+    event->flags = modifiers();
+    return true;
+  }
+  if (scan_code == KBD_PREFIX_E0) {
+    decode_state = DECODE_E0;
+    return false;
+  }
+  if (scan_code == KBD_PREFIX_E1) {
+    decode_state = DECODE_E1;
+    pause_left = KBD_PAUSE_LENGTH;
+    return false;
+  }
+
+  bool extended = decode_state == DECODE_E0;
+  decode_state = DECODE_NORMAL;
+  bool released = (scan_code & KBD_BREAK) != 0;
+  uint8_t code = scan_code & ~KBD_BREAK;
+  uint16_t key;
+  if (extended)
+    key = code < KEYMAP_E0_SIZE ? keymap_e0[code] : 0;
+  else
+    key = code < KEYMAP_SIZE ? keymap[code][0] : 0;
+  if (!key)
+    return false;
+
+  track_modifiers(key, released);
+  event->key = key;
+  event->flags = modifiers() | (released ? KBD_RELEASED : 0);
+  event->ascii = released ? 0 : translate(code, key, extended, event->flags);
+  return true;
+}
+
+static void echo(const char *s, uint32_t len) {
+  fb_write((char *)s, len);
+  fb_flush();
+}
+
+// Line editing. Call with kbd_lock held.
+static void line_discipline(uint8_t c) {
+  if (c == '\b') {
+    if (line_len) {
+      line_len--;
+      fb_back_pos();
+      echo(" ", 1);
+      fb_back_pos();
+    }
+    return;
+  }
+  if (c == '\n') {
+    line[line_len++] = '\n';
+    // A line that doesn't fit in what the readers have left is lost.
+    ring_enqueue_bulk(&input_ring, line, line_len);
+    line_len = 0;
+    echo("\n", 1);
+    return;
+  }
+  if ((c >= ' ' && c < 0x7F) || c == '\t') {
+    // Keep room for the newline.
+    if (line_len < KBD_LINE_MAX - 1) {
+      line[line_len++] = c;
+      echo((char *)&c, 1);
+    }
+  }
+}
+
+static void handle_scancode(unsigned char scan_code) {
+  struct kbd_event event;
+  if (!decode(scan_code, &event))
+    return;
+
+  uint32_t flags = spin_lock_irqsave(&kbd_lock);
+  // Events nobody reads are lost once the ring is full.
+  ring_enqueue(&event_ring, &event);
+  spin_unlock_irqrestore(&kbd_lock, flags);
+
+  if (event.flags & KBD_RELEASED)
+    return;
+  if (event.key == KEY_PGUP) {
+    fb_scroll_view(FB_HEIGHT / 2);
+    return;
+  } else if (event.key == KEY_PGDN) {
+    fb_scroll_view(-(FB_HEIGHT / 2));
+    return;
+  }
+  if (!event.ascii)
+    return;
+  // Typing takes us back to the live screen.
+  fb_view_live();
+  flags = spin_lock_irqsave(&kbd_lock);
+  line_discipline(event.ascii);
+  spin_unlock_irqrestore(&kbd_lock, flags);
+}
+
+// Runs with interrupts enabled, after the IRQ handler.
+static void keyboard_softirq() {
+  unsigned char batch[KBD_BATCH];
+  uint32_t n, i;
+  while ((n = ring_dequeue_burst(&kbd_ring, batch, KBD_BATCH)) > 0) {
+    for (i = 0; i < n; i++)
+      handle_scancode(batch[i]);
+  }
+  // Whatever the waiters want, it may be here now.
+  wake_up_all(&kbd_waiters);
+}
+
+// The IRQ handler only queues the scancode: the keyboard controller holds
+// a single byte, so it has to be read now, but decoding it can wait.
 static void keyboard_cb() {
   unsigned char scan_code = inb(KBD_DATA_PORT);
-  unsigned char c = scancodes[scan_code];
-  if(scan_code & 0x80){
-      // Key was just released.
-      if(scan_code == 0xAA || scan_code == 0xB6){
-           shiftDown = 0;
-      }
-  }else{
-      if(c == 17) {
-          shiftDown = 1;
-          return;
-      } else if(c == 174) {
-          // Left arrow key
-          fb_back_pos();
-          return;
-      } else if(c == 175) {
-          // Right arrow key
-          fb_advance_pos();
-          return;
-      }
-      /*
-       * An ASCII Latin lowercase letter and its
-       * uppercase counterpart differ in the 5th 
-       * bit. 
-       * Example: A = 01000001
-       *          a = 01100001
-       *
-       * To make uppercase, we simply AND a Latin letter
-       * with 0b1101111, or 0xDF. 
-       * To toggle the case, we can XOR the letter with
-       * 0b00100000, or 0x20, to toggle the 5th bit.
-       */
-      if(shiftDown) c = scancodes[scan_code + 90];
-      printf("%c", c);
+  // If the ring is full the key press is lost, as it would be if we
+  // hadn't read it in time.
+  ring_enqueue(&kbd_ring, &scan_code);
+  raise_softirq(KEYBOARD_SOFTIRQ);
+}
+
+bool kbd_get_event(struct kbd_event *event, bool block) {
+  uint32_t flags = spin_lock_irqsave(&kbd_lock);
+  while (!ring_dequeue(&event_ring, event)) {
+    if (!block) {
+      spin_unlock_irqrestore(&kbd_lock, flags);
+      return false;
+    }
+    // Interrupts stay off until we are on the wait queue, so the softirq
+    // can't wake us before we sleep.
+    spin_unlock(&kbd_lock);
+    thread_wait(&kbd_waiters);
+    spin_lock(&kbd_lock);
+  }
+  spin_unlock_irqrestore(&kbd_lock, flags);
+  return true;
+}
+
+uint32_t kbd_read(char *buf, uint32_t len, bool block) {
+  uint32_t flags = spin_lock_irqsave(&kbd_lock);
+  uint32_t n;
+  while (!(n = ring_dequeue_burst(&input_ring, buf, len)) && block && len) {
+    spin_unlock(&kbd_lock);
+    thread_wait(&kbd_waiters);
+    spin_lock(&kbd_lock);
   }
+  spin_unlock_irqrestore(&kbd_lock, flags);
+  return n;
 }
 
-void init_keyboard() {
+void __init init_keyboard() {
+  ring_init(&kbd_ring, kbd_ring_buf, KBD_RING_SIZE, sizeof(unsigned char));
+  ring_init(&event_ring, event_buf, KBD_EVENT_RING_SIZE, sizeof(struct kbd_event));
+  ring_init(&input_ring, input_buf, KBD_INPUT_SIZE, sizeof(char));
+  open_softirq(KEYBOARD_SOFTIRQ, &keyboard_softirq);
   register_interrupt_handler(IRQ1, &keyboard_cb);
 }
@@ -1,6 +1,67 @@
 #ifndef __KEYBOARD_H__
 #define __KEYBOARD_H__
 
-void init_keyboard(); 
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * The PS/2 keyboard. IRQ1 only queues scancodes; the keyboard softirq
+ * decodes them (scancode set 1, including E0 and E1 sequences) into key
+ * events and feeds the line discipline, which echoes to the console and
+ * hands out whole lines. Consumers either take the raw key events or read
+ * lines, blocking or polling.
+ */
+
+/* Keys that have no character. Keys that do are their unshifted ASCII. */
+enum {
+  KEY_LSHIFT = 0x100, KEY_RSHIFT, KEY_LCTRL, KEY_RCTRL, KEY_LALT, KEY_RALT,
+  KEY_LGUI, KEY_RGUI, KEY_MENU,
+  KEY_CAPSLOCK, KEY_NUMLOCK, KEY_SCROLLLOCK,
+  KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6,
+  KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12,
+  KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT,
+  KEY_HOME, KEY_END, KEY_PGUP, KEY_PGDN, KEY_INSERT, KEY_DELETE,
+  KEY_KP5, KEY_PRINTSCREEN, KEY_PAUSE,
+};
+
+/* Modifier state in struct kbd_event */
+#define KBD_MOD_SHIFT   0x01
+#define KBD_MOD_CTRL    0x02
+#define KBD_MOD_ALT     0x04
+#define KBD_MOD_CAPS    0x08
+#define KBD_RELEASED    0x80
+
+struct kbd_event {
+  uint16_t key;       // KEY_* or a character
+  uint8_t ascii;      // with shift, caps lock and ctrl applied; 0 if none
+  uint8_t flags;      // KBD_MOD_* as of the event, and KBD_RELEASED
+};
+
+/* Key events kept for kbd_get_event. Must be a power of two. */
+#define KBD_EVENT_RING_SIZE 64
+/* Bytes of finished lines kept for kbd_read. Must be a power of two. */
+#define KBD_INPUT_SIZE      256
+/* The longest line that can be typed, newline included. */
+#define KBD_LINE_MAX        128
+
+void init_keyboard();
+
+/**
+ * kbd_get_event:
+ * Takes the oldest key event. If there is none, waits for one if block is
+ * set (threads only) and returns false otherwise.
+ */
+bool kbd_get_event(struct kbd_event *event, bool block);
+
+/**
+ * kbd_read:
+ * Copies up to len bytes of finished lines into buf. A line is finished
+ * by Enter, which adds a '\n'; until then it can be edited with
+ * backspace. If nothing is ready, waits if block is set (threads only)
+ * and returns 0 otherwise.
+ *
+ * @return The number of bytes copied
+ */
+uint32_t kbd_read(char *buf, uint32_t len, bool block);
 
 #endif
@@ -2,16 +2,25 @@
 
 #include "kheap.h"
 #include "paging.h"
+#include "spinlock.h"
+#include "compiler.h"
+#ifdef BENCHMARK
+#include "bench.h"
+#endif
 
 // end is defined in the linker script.
 extern uint32_t end;
 uint32_t placement_address = (uint32_t)&end;
 extern page_directory_t *kernel_directory;
 heap_t *kheap=0;
+// Serialises kmalloc and kfree once the heap is up.
+static spinlock_t kheap_lock = SPINLOCK_INIT("kheap");
 
-uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys) {
+uint32_t __hot kmalloc_int(uint32_t sz, int align, uint32_t *phys) {
     if (kheap != 0) {
+        uint32_t flags = spin_lock_irqsave(&kheap_lock);
         void *addr = alloc(sz, (uint8_t)align, kheap);
+        spin_unlock_irqrestore(&kheap_lock, flags);
         if (phys != 0)
         {
             page_t *page = get_page((uint32_t)addr, 0, kernel_directory);
@@ -34,8 +43,10 @@ uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys) {
     }
 }
 
-void kfree(void *p) {
+void __hot kfree(void *p) {
+    uint32_t flags = spin_lock_irqsave(&kheap_lock);
     free(p, kheap);
+    spin_unlock_irqrestore(&kheap_lock, flags);
 }
 
 uint32_t kmalloc_a(uint32_t sz) {
@@ -54,6 +65,15 @@ uint32_t kmalloc(uint32_t sz) {
     return kmalloc_int(sz, 0, 0);
 }
 
+#ifdef BENCHMARK
+// Sizes from 16 to 1024 bytes, so that the heap index sees holes of
+// several sizes.
+static void bench_kmalloc_kfree(uint32_t i) {
+    kfree((void *)kmalloc(16 << (i % 7)));
+}
+BENCH(kmalloc_kfree, &bench_kmalloc_kfree);
+#endif
+
 static void expand(uint32_t new_size, heap_t *heap) {
     // Get the nearest following page boundary.
     if ((new_size&0xFFFFF000) != 0) {
@@ -96,7 +116,7 @@ static uint32_t contract(uint32_t new_size, heap_t *heap) {
     return new_size;
 }
 
-static uint32_t find_smallest_hole(uint32_t size, uint8_t page_align, heap_t *heap) {
+static uint32_t __hot find_smallest_hole(uint32_t size, uint8_t page_align, heap_t *heap) {
     // Find the smallest hole that will fit.
     uint32_t iterator = 0;
     while (iterator < heap->index.size) {
@@ -161,7 +181,7 @@ heap_t *create_heap(uint32_t start, uint32_t end_addr, uint32_t max, uint8_t sup
     return heap;
 }
 
-void *alloc(uint32_t size, uint8_t page_align, heap_t *heap) {
+void __hot *alloc(uint32_t size, uint8_t page_align, heap_t *heap) {
 
     // Make sure we take the size of header/footer into account.
     uint32_t new_size = size + sizeof(header_t) + sizeof(footer_t);
@@ -280,7 +300,7 @@ void *alloc(uint32_t size, uint8_t page_align, heap_t *heap) {
     return (void *) ( (uint32_t)block_header+sizeof(header_t) );
 }
 
-void free(void *p, heap_t *heap)
+void __hot free(void *p, heap_t *heap)
 {
     // Exit gracefully for null pointers.
     if (p == 0)
@@ -0,0 +1,241 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#include "klog.h"
+#include "string.h"
+#include "spinlock.h"
+#include "ktimer.h"
+#include "timer.h"
+#include "cpu.h"
+#include "framebuffer.h"
+#include "serial.h"
+#include "compiler.h"
+
+// The timestamp and level in front of every line, plus the newline.
+#define KLOG_OUT_MAX (KLOG_LINE_MAX + 32)
+
+struct klog_record {
+  uint64_t ns;            // timer_now_ns() when logged; 0 before init_timer
+  uint32_t level;
+  uint32_t len;
+  char text[KLOG_LINE_MAX];
+};
+
+// Record seq lives in log_ring[seq % KLOG_RECORDS]; log_seq is the next
+// one to be written. Sequence numbers wrap, but only their differences
+// are used.
+static struct klog_record log_ring[KLOG_RECORDS];
+static uint32_t log_seq = 0;
+static spinlock_t log_lock = SPINLOCK_INIT("klog");
+
+// Serialises the consumers: the drain timer and klog_flush callers.
+static spinlock_t drain_lock = SPINLOCK_INIT("klog drain");
+static struct ktimer drain_timer;
+static volatile bool klog_async = false;
+// Set by klog_panic: every lock may be held by a CPU that is gone.
+static volatile bool klog_panicking = false;
+
+static const char *const level_names[] = { "EMERG", "ERR", "WARN", "INFO", "DEBUG" };
+
+static void console_write(const char *line, uint32_t len) {
+  fb_write((char *)line, len);
+  fb_flush();
+}
+
+static void serial_sink_write(const char *line, uint32_t len) {
+  serial_write((char *)line, len);
+}
+
+// The dmesg buffer overwrites its oldest text when full.
+static char dmesg_buf[KLOG_DMESG_SIZE];
+static uint32_t dmesg_end = 0;
+static uint32_t dmesg_len = 0;
+
+static void dmesg_write(const char *line, uint32_t len) {
+  uint32_t i;
+  for (i = 0; i < len; i++) {
+    dmesg_buf[dmesg_end] = line[i];
+    dmesg_end = (dmesg_end + 1) % KLOG_DMESG_SIZE;
+  }
+  dmesg_len = dmesg_len + len < KLOG_DMESG_SIZE ? dmesg_len + len : KLOG_DMESG_SIZE;
+}
+
+// The console draws slowly, so it takes fewer records per drain than
+// the serial port, which only queues them.
+static struct klog_sink dmesg_sink = {
+  .name = "dmesg", .write = &dmesg_write, .level = KLOG_DEBUG, .batch = KLOG_RECORDS,
+};
+static struct klog_sink serial_sink = {
+  .name = "serial", .write = &serial_sink_write, .level = KLOG_DEBUG, .batch = 32,
+  .next = &dmesg_sink,
+};
+static struct klog_sink console_sink = {
+  .name = "console", .write = &console_write, .level = KLOG_INFO, .batch = 8,
+  .next = &serial_sink,
+};
+static struct klog_sink *sinks = &console_sink;
+
+static uint32_t format_record(char *out, const struct klog_record *rec);
+
+// Straight to the console and COM1, taking no locks.
+static void panic_write(const struct klog_record *rec) {
+  char out[KLOG_OUT_MAX];
+  uint32_t len = format_record(out, rec);
+  if (rec->level <= serial_sink.level)
+    serial_write(out, len);
+  if (rec->level <= console_sink.level)
+    fb_panic_write(out, len);
+}
+
+void klog(uint32_t level, const char *format, ...) {
+  char text[KLOG_LINE_MAX];
+  va_list ap;
+  va_start(ap, format);
+  uint32_t len = vsnprintf(text, sizeof(text), format, ap);
+  va_end(ap);
+  if (len > sizeof(text) - 1)
+    len = sizeof(text) - 1;
+  if (len && text[len - 1] == '\n')
+    len--;
+  uint64_t ns = timer_now_ns();
+
+  if (klog_panicking) {
+    struct klog_record rec = { .ns = ns, .level = level, .len = len };
+    memmove(rec.text, text, len);
+    panic_write(&rec);
+    return;
+  }
+
+  uint32_t flags = spin_lock_irqsave(&log_lock);
+  struct klog_record *rec = &log_ring[log_seq % KLOG_RECORDS];
+  rec->ns = ns;
+  rec->level = level;
+  rec->len = len;
+  memmove(rec->text, text, len);
+  log_seq++;
+  spin_unlock_irqrestore(&log_lock, flags);
+
+  if (!klog_async)
+    klog_flush();
+}
+
+// Formats a record as "[seconds.micros] LEVEL: text\n".
+static uint32_t format_record(char *out, const struct klog_record *rec) {
+  uint32_t ns;
+  uint32_t secs = div64_32(rec->ns, NSEC_PER_SEC, &ns);
+  const char *name = rec->level < sizeof(level_names) / sizeof(level_names[0])
+                     ? level_names[rec->level] : "?";
+  uint32_t len = snprintf(out, KLOG_OUT_MAX, "[%5u.%06u] %s: %.*s\n",
+                          secs, ns / NSEC_PER_USEC, name, (int)rec->len, rec->text);
+  return len < KLOG_OUT_MAX ? len : KLOG_OUT_MAX - 1;
+}
+
+// Hands up to max records to the sink. Returns false once it has caught
+// up. Call with drain_lock held.
+static bool drain_sink(struct klog_sink *sink, uint32_t max) {
+  struct klog_record rec;
+  char out[KLOG_OUT_MAX];
+  uint32_t n;
+  for (n = 0; n < max; n++) {
+    // Copy the record out, so that the slow part runs without the lock
+    // and klog never waits for a sink.
+    uint32_t flags = spin_lock_irqsave(&log_lock);
+    if (sink->next_seq == log_seq) {
+      spin_unlock_irqrestore(&log_lock, flags);
+      return false;
+    }
+    uint32_t lost = 0;
+    if (log_seq - sink->next_seq > KLOG_RECORDS) {
+      lost = log_seq - KLOG_RECORDS - sink->next_seq;
+      sink->next_seq = log_seq - KLOG_RECORDS;
+    }
+    rec = log_ring[sink->next_seq % KLOG_RECORDS];
+    sink->next_seq++;
+    spin_unlock_irqrestore(&log_lock, flags);
+
+    if (lost) {
+      sink->dropped += lost;
+      sink->write(out, snprintf(out, sizeof(out), "[klog: %u records dropped]\n", lost));
+    }
+    if (rec.level <= sink->level)
+      sink->write(out, format_record(out, &rec));
+  }
+  return true;
+}
+
+static void drain_all(bool completely) {
+  struct klog_sink *sink;
+  for (sink = sinks; sink; sink = sink->next) {
+    while (drain_sink(sink, sink->batch) && completely)
+      ;
+  }
+}
+
+void klog_flush() {
+  uint32_t flags = spin_lock_irqsave(&drain_lock);
+  drain_all(true);
+  spin_unlock_irqrestore(&drain_lock, flags);
+}
+
+// Sends the sink what it hasn't had yet, reading the ring without
+// log_lock. A record another CPU is writing may come out garbled; that is
+// better than nothing.
+static void panic_catch_up(struct klog_sink *sink, void (*write)(char *, unsigned int)) {
+  char out[KLOG_OUT_MAX];
+  uint32_t seq = sink->next_seq;
+  if (log_seq - seq > KLOG_RECORDS)
+    seq = log_seq - KLOG_RECORDS;
+  for (; seq != log_seq; seq++) {
+    struct klog_record rec = log_ring[seq % KLOG_RECORDS];
+    if (rec.level <= sink->level)
+      write(out, format_record(out, &rec));
+  }
+  sink->next_seq = seq;
+}
+
+void klog_panic() {
+  serial_panic();
+  klog_panicking = true;
+  panic_catch_up(&console_sink, &fb_panic_write);
+  panic_catch_up(&serial_sink, &serial_write);
+}
+
+static void drain_expired(struct ktimer *timer) {
+  // Whoever holds the lock is draining already.
+  if (spin_trylock(&drain_lock)) {
+    drain_all(false);
+    spin_unlock(&drain_lock);
+  }
+  ktimer_add(timer, jiffies + msecs_to_jiffies(KLOG_DRAIN_MS));
+}
+
+void klog_register_sink(struct klog_sink *sink) {
+  uint32_t flags = spin_lock_irqsave(&drain_lock);
+  uint32_t log_flags = spin_lock_irqsave(&log_lock);
+  sink->next_seq = log_seq - KLOG_RECORDS;
+  if (log_seq < KLOG_RECORDS)
+    sink->next_seq = 0;
+  sink->dropped = 0;
+  spin_unlock_irqrestore(&log_lock, log_flags);
+  sink->next = sinks;
+  sinks = sink;
+  spin_unlock_irqrestore(&drain_lock, flags);
+}
+
+uint32_t klog_dmesg(char *buf, uint32_t len) {
+  uint32_t flags = spin_lock_irqsave(&drain_lock);
+  uint32_t n = len < dmesg_len ? len : dmesg_len;
+  uint32_t start = (dmesg_end + KLOG_DMESG_SIZE - dmesg_len) % KLOG_DMESG_SIZE;
+  uint32_t i;
+  for (i = 0; i < n; i++)
+    buf[i] = dmesg_buf[(start + i) % KLOG_DMESG_SIZE];
+  spin_unlock_irqrestore(&drain_lock, flags);
+  return n;
+}
+
+void __init init_klog() {
+  ktimer_init(&drain_timer, &drain_expired);
+  ktimer_add(&drain_timer, jiffies + msecs_to_jiffies(KLOG_DRAIN_MS));
+  klog_async = true;
+}
@@ -0,0 +1,83 @@
+#ifndef __KLOG_H__
+#define __KLOG_H__
+
+#include <stdint.h>
+
+/**
+ * The kernel log. klog formats a line into the log ring, with a level and
+ * a timestamp, and returns: it never waits for a device. Sinks (the VGA
+ * console, COM1 and the dmesg buffer) each keep their own position in the
+ * ring and are drained from a timer at their own pace, so a slow sink
+ * only falls behind itself. A sink that falls a whole ring behind loses
+ * the records it missed, and counts them.
+ *
+ * Until init_klog starts the drain timer, klog drains every sink before
+ * returning, so early boot messages show up straight away.
+ */
+
+#define KLOG_EMERG      0
+#define KLOG_ERR        1
+#define KLOG_WARN       2
+#define KLOG_INFO       3
+#define KLOG_DEBUG      4
+
+/* Records in the log ring. Must be a power of two. */
+#define KLOG_RECORDS    128
+/* Longer lines are cut short. */
+#define KLOG_LINE_MAX   120
+/* Bytes of text the dmesg sink keeps. */
+#define KLOG_DMESG_SIZE 0x4000
+/* How often the sinks are drained. */
+#define KLOG_DRAIN_MS   10
+
+struct klog_sink {
+  const char *name;
+  /* Takes one formatted line, newline included. */
+  void (*write)(const char *line, uint32_t len);
+  uint32_t level;         // records above this level are skipped
+  uint32_t batch;         // records taken per drain
+  uint32_t next_seq;      // the next record this sink reads
+  uint32_t dropped;       // records overwritten before this sink read them
+  struct klog_sink *next;
+};
+
+#define KLOG_SINK_INIT(n, w, l, b) { .name = (n), .write = (w), .level = (l), .batch = (b) }
+
+/**
+ * init_klog:
+ * Starts draining the sinks from a timer instead of from klog itself.
+ * Requires init_ktimers.
+ */
+void init_klog();
+
+/* Adds a sink. It starts with the oldest record still in the ring. */
+void klog_register_sink(struct klog_sink *sink);
+
+/**
+ * klog:
+ * Logs one line, formatted as by printf; a trailing newline is not
+ * needed. Safe from interrupt handlers.
+ */
+void klog(uint32_t level, const char *format, ...);
+
+/* Drains every sink completely. Not from interrupt handlers. */
+void klog_flush();
+
+/**
+ * klog_panic:
+ * For error(), with interrupts off. Catches the console and COM1 up
+ * without taking any lock, as the CPU holding one may be this one. From
+ * then on klog writes straight to both, bypassing the ring.
+ */
+void klog_panic();
+
+/**
+ * klog_dmesg:
+ * Copies up to len bytes of the text the dmesg sink has kept, oldest
+ * first, into buf.
+ *
+ * @return The number of bytes copied
+ */
+uint32_t klog_dmesg(char *buf, uint32_t len);
+
+#endif
@@ -9,39 +9,125 @@
 #include "paging.h"
 #include "isr.h"
 #include "kheap.h"
+#include "timer.h"
+#include "ktimer.h"
+#include "thread.h"
+#include "smp.h"
+#include "executor.h"
+#include "spinlock.h"
+#include "trace.h"
+#include "profile.h"
+#include "klog.h"
+#include "boottime.h"
+#include "compiler.h"
+#include "initrd.h"
+#ifdef BENCHMARK
+#include "bench.h"
+#endif
 
+// Reads what is typed, a line at a time.
+static void console_thread(void *arg) {
+   char buf[KBD_LINE_MAX + 1];
+   (void)arg;
+   for (;;) {
+      uint32_t n = kbd_read(buf, KBD_LINE_MAX, true);
+      buf[n] = 0;
+      klog(KLOG_DEBUG, "kbd: %s", buf);
+   }
+}
+
+static void hello_thread(void *msg) {
+   thread_sleep(500);
+   klog(KLOG_INFO, "%s", (char *)msg);
+}
 
-void kmain(/*multiboot_info_t *info*/) {
+void __init kmain(multiboot_info_t *info, uint32_t magic) {
    fb_clear();
+   boot_mark("console");
+   // Before anything is allocated: the modules follow the kernel, where
+   // the placement allocator would put things.
+   initrd_reserve(info, magic);
+   paging_detect_memory(info, magic);
    
-   printf("Initializing descriptor tables...\n");
+   klog(KLOG_INFO, "Initializing descriptor tables...");
    init_descriptor_tables();
-   printf("Allocate memory for a variable before we initialize paging...");
-   printf("(so it is allocated via placement address)\n");
+   boot_mark("descriptor tables");
+   init_serial();
+   boot_mark("serial");
+   init_memops();
+   boot_mark("memops");
+   klog(KLOG_INFO, "Allocate memory for a variable before we initialize paging "
+        "(so it is allocated via placement address)");
    uint32_t a = kmalloc(8);
-   printf("Initializing paging...\n");
+   klog(KLOG_INFO, "Initializing paging...");
    init_paging();
-   printf("Allocate b and c on the heap...\n");
+   boot_mark("heap");
+   init_initrd();
+   klog(KLOG_INFO, "Allocate b and c on the heap...");
    uint32_t b = kmalloc(8);
    uint32_t c = kmalloc(8);
-   printf("a: ");
-   printf("%x", a);
-   printf(", b: ");
-   printf("%x", b);
-   printf("\nc: ");
-   printf("%x", c);
-   printf("\n");
-   printf("Free a and b\n");
+   klog(KLOG_INFO, "a: %#x, b: %#x, c: %#x", a, b, c);
+   klog(KLOG_INFO, "Free a and b");
    kfree((void *)c);
    kfree((void *)b);
-   printf("Allocate d. ");
-   printf("d is in the same place as b, so b must have been properly freed \n");
    uint32_t d = kmalloc(12);
-   printf("d: ");
-   printf("%x", d);
-   printf("\n");
-   printf("Initializing keyboard...");
+   klog(KLOG_INFO, "Allocate d. d is in the same place as b, so b must have been properly freed");
+   klog(KLOG_INFO, "d: %#x", d);
+   klog(KLOG_INFO, "Initializing timer...");
+   init_timer();
+   boot_mark("timer calibration");
+   klog(KLOG_INFO, "TSC: %u kHz, clock events from %s",
+          timer_tsc_khz(), timer_clock_event()->name);
+   init_ktimers();
+   init_klog();
+   boot_mark("ktimers, klog");
+#ifdef TRACE
+   init_trace();
+   boot_mark("trace");
+#endif
+#ifdef PROFILE
+   init_profiler();
+   profile_start(PROFILE_DEFAULT_HZ);
+#endif
+#ifdef BENCHMARK
+   mem_benchmark();
+   ktimer_benchmark();
+#endif
+   klog(KLOG_INFO, "Initializing threads...");
+   init_threads();
+   boot_mark("threads");
+   thread_create("hello", &hello_thread, "hello from a kernel thread");
+   klog(KLOG_INFO, "Starting application processors...");
+   init_smp();
+   boot_mark("application processors");
+   klog(KLOG_INFO, "%u CPUs online", cpus_online);
+   init_executor();
+   boot_mark("executor");
+#ifdef BENCHMARK
+   executor_benchmark();
+   run_benchmarks();
+#endif
+#ifdef LOCK_STATS
+   lock_stats_dump();
+#endif
+#ifdef PROFILE
+   profile_stop();
+   profile_dump();
+#endif
+   klog(KLOG_INFO, "Initializing keyboard...");
    init_keyboard();
+   thread_create("console", &console_thread, 0);
+   boot_mark("keyboard");
+   // Straight from the initrd's pages, without a copy.
+   struct initrd_file motd;
+   if (initrd_lookup("motd", &motd)) {
+      fb_write((char *)motd.data, motd.size);
+      fb_flush();
+   }
+   boot_timeline_report();
+#ifdef BENCH_EXIT
+   bench_exit(0);
+#endif
 //   uint32_t *ptr = (uint32_t *)0xA0000000;
 //   uint32_t do_page_fault = *ptr;
 
@@ -0,0 +1,191 @@
+// A hierarchical timing wheel, after the one in classic Linux kernels.
+//
+// The first level has one slot per jiffy for the next 256 jiffies. Each of
+// the four levels above it has 64 slots, each covering 64 times the span of
+// a slot one level down. Adding and cancelling are list operations on one
+// slot. Whenever the first level wraps, the next due slot of the level
+// above is cascaded down, so every timer is moved at most once per level.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ktimer.h"
+#include "timer.h"
+#include "softirq.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "string.h"
+#include "trace.h"
+#include "klog.h"
+#include "compiler.h"
+
+#define TVR_BITS    8
+#define TVN_BITS    6
+#define TVR_SIZE    (1 << TVR_BITS)
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TVR_MASK    (TVR_SIZE - 1)
+#define TVN_MASK    (TVN_SIZE - 1)
+#define TVN_LEVELS  4
+
+// Index into level n of the slot due at the given jiffy.
+#define TVN_INDEX(j, n) (((j) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+volatile uint32_t jiffies = 0;
+
+static struct {
+  spinlock_t lock;
+  uint32_t timer_jiffies;   // the next jiffy whose slot hasn't been run
+  struct list_head tv1[TVR_SIZE];
+  struct list_head tvn[TVN_LEVELS][TVN_SIZE];
+} wheel;
+
+// Call with wheel.lock held.
+static void wheel_insert(struct ktimer *timer) {
+  uint32_t expires = timer->expires;
+  uint32_t idx = expires - wheel.timer_jiffies;
+  struct list_head *slot;
+
+  if ((int32_t)idx < 0) {
+    // Already due: run it on the next softirq.
+    slot = &wheel.tv1[wheel.timer_jiffies & TVR_MASK];
+  } else if (idx < TVR_SIZE) {
+    slot = &wheel.tv1[expires & TVR_MASK];
+  } else {
+    uint32_t level;
+    for (level = 0; level < TVN_LEVELS - 1; level++) {
+      if (idx < (1u << (TVR_BITS + (level + 1) * TVN_BITS)))
+        break;
+    }
+    slot = &wheel.tvn[level][TVN_INDEX(expires, level)];
+  }
+  list_add_tail(&timer->entry, slot);
+}
+
+// Re-files every timer in a slot of the given level one level down.
+static uint32_t cascade(uint32_t level, uint32_t index) {
+  struct list_head pending;
+  list_init(&pending);
+  list_splice_tail(&wheel.tvn[level][index], &pending);
+
+  while (!list_empty(&pending)) {
+    struct ktimer *timer = container_of(pending.next, struct ktimer, entry);
+    list_del(&timer->entry);
+    wheel_insert(timer);
+  }
+  return index;
+}
+
+static void run_timers() {
+  uint32_t flags = spin_lock_irqsave(&wheel.lock);
+
+  while (time_after_eq(jiffies, wheel.timer_jiffies)) {
+    uint32_t index = wheel.timer_jiffies & TVR_MASK;
+    if (index == 0) {
+      uint32_t level;
+      for (level = 0; level < TVN_LEVELS; level++) {
+        if (cascade(level, TVN_INDEX(wheel.timer_jiffies, level)) != 0)
+          break;
+      }
+    }
+    wheel.timer_jiffies++;
+
+    struct list_head expired;
+    list_init(&expired);
+    list_splice_tail(&wheel.tv1[index], &expired);
+
+    while (!list_empty(&expired)) {
+      struct ktimer *timer = container_of(expired.next, struct ktimer, entry);
+      list_del(&timer->entry);
+      // The callback may re-arm or cancel any timer, including this one
+      // and the ones still on the expired list.
+      spin_unlock_irqrestore(&wheel.lock, flags);
+      trace2(TRACE_KTIMER_EXPIRE, (uint32_t)timer, (uint32_t)timer->fn);
+      timer->fn(timer);
+      flags = spin_lock_irqsave(&wheel.lock);
+    }
+  }
+
+  spin_unlock_irqrestore(&wheel.lock, flags);
+}
+
+static void __hot ktimer_tick(uint64_t now_ns) {
+  (void)now_ns;
+  jiffies++;
+  raise_softirq(TIMER_SOFTIRQ);
+}
+
+void __init init_ktimers() {
+  uint32_t i, level;
+  spin_lock_init(&wheel.lock, "ktimer wheel");
+  for (i = 0; i < TVR_SIZE; i++)
+    list_init(&wheel.tv1[i]);
+  for (level = 0; level < TVN_LEVELS; level++)
+    for (i = 0; i < TVN_SIZE; i++)
+      list_init(&wheel.tvn[level][i]);
+  wheel.timer_jiffies = jiffies;
+
+  open_softirq(TIMER_SOFTIRQ, &run_timers);
+  timer_set_handler(&ktimer_tick);
+  timer_periodic(HZ);
+}
+
+void ktimer_init(struct ktimer *timer, ktimer_fn_t fn) {
+  list_init(&timer->entry);
+  timer->expires = 0;
+  timer->fn = fn;
+}
+
+void ktimer_add(struct ktimer *timer, uint32_t expires) {
+  uint32_t flags = spin_lock_irqsave(&wheel.lock);
+  if (ktimer_pending(timer))
+    list_del(&timer->entry);
+  timer->expires = expires;
+  wheel_insert(timer);
+  spin_unlock_irqrestore(&wheel.lock, flags);
+}
+
+bool ktimer_cancel(struct ktimer *timer) {
+  uint32_t flags = spin_lock_irqsave(&wheel.lock);
+  bool was_pending = ktimer_pending(timer);
+  if (was_pending)
+    list_del(&timer->entry);
+  spin_unlock_irqrestore(&wheel.lock, flags);
+  return was_pending;
+}
+
+#ifdef BENCHMARK
+
+#define BENCH_TIMERS  1024
+#define BENCH_OPS     1000000
+
+static struct ktimer bench_timers[BENCH_TIMERS];
+
+static void bench_timer_fn(struct ktimer *timer) {
+  (void)timer;
+}
+
+void ktimer_benchmark() {
+  uint32_t i;
+  uint32_t seed = 1;
+  for (i = 0; i < BENCH_TIMERS; i++)
+    ktimer_init(&bench_timers[i], &bench_timer_fn);
+
+  uint64_t start = rdtsc();
+  for (i = 0; i < BENCH_OPS; i++) {
+    struct ktimer *timer = &bench_timers[i % BENCH_TIMERS];
+    ktimer_cancel(timer);
+    // Spread the timeouts over the first four levels of the wheel.
+    seed = seed * 1103515245 + 12345;
+    ktimer_add(timer, jiffies + 1 + ((seed >> 8) & 0x3FFFFF));
+  }
+  for (i = 0; i < BENCH_TIMERS; i++)
+    ktimer_cancel(&bench_timers[i]);
+  uint64_t cycles = rdtsc() - start;
+
+  klog(KLOG_INFO, "ktimer: %u arm/cancel pairs in %u us, %u cycles per pair",
+         BENCH_OPS,
+         (uint32_t)div64_32(timer_cycles_to_ns(cycles), NSEC_PER_USEC, NULL),
+         (uint32_t)div64_32(cycles, BENCH_OPS, NULL));
+}
+
+#endif
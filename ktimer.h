@@ -0,0 +1,58 @@
+#ifndef __KTIMER_H__
+#define __KTIMER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "list.h"
+
+// Frequency of the periodic tick that drives the timer wheel.
+#define HZ 100
+
+/* Ticks since init_ktimers. Wraps; compare with time_after. */
+extern volatile uint32_t jiffies;
+
+#define time_after(a, b)     ((int32_t)((b) - (a)) < 0)
+#define time_after_eq(a, b)  ((int32_t)((a) - (b)) >= 0)
+
+#define msecs_to_jiffies(ms) (((ms) * HZ + 999) / 1000)
+
+struct ktimer;
+typedef void (*ktimer_fn_t)(struct ktimer *timer);
+
+/**
+ * A timeout. Embed one in whatever structure needs it and get back to
+ * that structure from the callback with container_of, so arming a
+ * timeout never needs to allocate.
+ */
+struct ktimer {
+  struct list_head entry;
+  uint32_t expires;       // in jiffies
+  ktimer_fn_t fn;
+};
+
+/**
+ * init_ktimers:
+ * Starts the periodic tick and the timer wheel. Expired timers run from
+ * the timer softirq, with interrupts enabled, not from the tick itself.
+ */
+void init_ktimers();
+
+void ktimer_init(struct ktimer *timer, ktimer_fn_t fn);
+
+/* Arms the timer to fire at the given jiffy. Re-arms it if pending. O(1). */
+void ktimer_add(struct ktimer *timer, uint32_t expires);
+
+/* Disarms the timer. Returns true if it was pending. O(1). */
+bool ktimer_cancel(struct ktimer *timer);
+
+static inline bool ktimer_pending(const struct ktimer *timer) {
+  return !list_empty(&timer->entry);
+}
+
+#ifdef BENCHMARK
+/* Arms and cancels a million timers and prints the cost per operation. */
+void ktimer_benchmark();
+#endif
+
+#endif
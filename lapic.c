@@ -0,0 +1,84 @@
+#include <stdint.h>
+
+#include "lapic.h"
+#include "cpu.h"
+#include "isr.h"
+#include "paging.h"
+#include "compiler.h"
+
+static volatile uint32_t *lapic_base = 0;
+
+bool lapic_present() {
+  return cpu_has_edx_feature(CPUID_FEAT_EDX_APIC) &&
+         cpu_has_edx_feature(CPUID_FEAT_EDX_MSR);
+}
+
+uint32_t lapic_read(uint32_t reg) {
+  return lapic_base[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+  lapic_base[reg / 4] = value;
+  // Read back ID to make sure the write has been posted.
+  (void)lapic_base[LAPIC_ID / 4];
+}
+
+void __init init_lapic() {
+  uint64_t base_msr = rdmsr(IA32_APIC_BASE_MSR);
+  uint32_t base = (uint32_t)base_msr & IA32_APIC_BASE_ADDR_MASK;
+
+  // Make sure the APIC isn't globally disabled.
+  wrmsr(IA32_APIC_BASE_MSR, base_msr | IA32_APIC_BASE_ENABLE);
+
+  map_mmio(base);
+  lapic_base = (volatile uint32_t *)base;
+
+  init_lapic_ap();
+}
+
+void __init init_lapic_ap() {
+  // Accept all priorities and software-enable the APIC.
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+  lapic_write(LAPIC_TIMER_DIVIDE_CONFIG, LAPIC_TIMER_DIVIDE_BY_16);
+  lapic_timer_stop();
+}
+
+uint8_t lapic_id() {
+  return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+  lapic_base[LAPIC_EOI / 4] = 0;
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr) {
+  // An IPI sent from an interrupt handler between the two writes would
+  // leave its own destination in ICR_HIGH for ours.
+  uint32_t flags = irq_save();
+  lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << LAPIC_ICR_DEST_SHIFT);
+  lapic_write(LAPIC_ICR_LOW, icr);
+  while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_DELIVERY_PENDING)
+    cpu_relax();
+  irq_restore(flags);
+}
+
+void lapic_timer_oneshot(uint32_t count) {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INITIAL_COUNT, count);
+}
+
+void lapic_timer_periodic(uint32_t count) {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INITIAL_COUNT, count);
+}
+
+void lapic_timer_stop() {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
+}
+
+uint32_t lapic_timer_current() {
+  return lapic_read(LAPIC_TIMER_CURRENT_COUNT);
+}
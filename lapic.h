@@ -0,0 +1,80 @@
+#ifndef __LAPIC_H__
+#define __LAPIC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IA32_APIC_BASE_MSR          0x1B
+#define IA32_APIC_BASE_ENABLE       0x800
+#define IA32_APIC_BASE_ADDR_MASK    0xFFFFF000
+
+/* Local APIC register offsets (Intel Manual Vol. 3A, Table 10-1) */
+#define LAPIC_ID                    0x020
+#define LAPIC_VERSION               0x030
+#define LAPIC_TPR                   0x080
+#define LAPIC_EOI                   0x0B0
+#define LAPIC_SVR                   0x0F0
+#define LAPIC_ICR_LOW               0x300
+#define LAPIC_ICR_HIGH              0x310
+#define LAPIC_LVT_TIMER             0x320
+#define LAPIC_TIMER_INITIAL_COUNT   0x380
+#define LAPIC_TIMER_CURRENT_COUNT   0x390
+#define LAPIC_TIMER_DIVIDE_CONFIG   0x3E0
+
+#define LAPIC_SVR_ENABLE            0x100
+
+/* Interrupt command register fields */
+#define LAPIC_ICR_INIT              0x00000500
+#define LAPIC_ICR_STARTUP           0x00000600
+#define LAPIC_ICR_DELIVERY_PENDING  0x00001000
+#define LAPIC_ICR_LEVEL_ASSERT      0x00004000
+#define LAPIC_ICR_DEST_SHIFT        24
+
+#define LAPIC_LVT_MASKED            (1 << 16)
+#define LAPIC_TIMER_ONESHOT         (0 << 17)
+#define LAPIC_TIMER_PERIODIC        (1 << 17)
+#define LAPIC_TIMER_DIVIDE_BY_16    0x3
+
+/**
+ * lapic_present:
+ * Checks (via CPUID) whether this processor has a local APIC.
+ */
+bool lapic_present();
+
+/**
+ * init_lapic:
+ * Maps the local APIC registers and software-enables the APIC.
+ * Paging must already be enabled.
+ */
+void init_lapic();
+
+/* Enables the local APIC of an application processor. */
+void init_lapic_ap();
+
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+
+/* The APIC ID of the calling processor. */
+uint8_t lapic_id();
+
+/* Signals end of interrupt for vectors delivered by the local APIC. */
+void lapic_eoi();
+
+/**
+ * lapic_send_ipi:
+ * Sends an inter-processor interrupt to the given APIC ID and waits for
+ * the local APIC to accept it. icr is the low word of the ICR. Safe
+ * with interrupts enabled.
+ */
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+
+/**
+ * Timer control. Counts are in ticks of the APIC timer after the
+ * divide-by-16 applied in init_lapic.
+ */
+void lapic_timer_oneshot(uint32_t count);
+void lapic_timer_periodic(uint32_t count);
+void lapic_timer_stop();
+uint32_t lapic_timer_current();
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __LIST_H__
+#define __LIST_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Intrusive circular doubly-linked list. Embed a struct list_head in the
+ * structure you want to link, and use container_of to get back to it.
+ */
+struct list_head {
+  struct list_head *next;
+  struct list_head *prev;
+};
+
+#define container_of(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+static inline void list_init(struct list_head *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static inline bool list_empty(const struct list_head *head) {
+  return head->next == head;
+}
+
+static inline void __list_add(struct list_head *node,
+                              struct list_head *prev,
+                              struct list_head *next) {
+  next->prev = node;
+  node->next = next;
+  node->prev = prev;
+  prev->next = node;
+}
+
+/* Inserts node right after head (stack order). */
+static inline void list_add(struct list_head *node, struct list_head *head) {
+  __list_add(node, head, head->next);
+}
+
+/* Inserts node right before head (queue order). */
+static inline void list_add_tail(struct list_head *node, struct list_head *head) {
+  __list_add(node, head->prev, head);
+}
+
+/* Unlinks node and leaves it pointing at itself, so list_empty(node)
+ * tells whether it is on a list. */
+static inline void list_del(struct list_head *node) {
+  node->next->prev = node->prev;
+  node->prev->next = node->next;
+  list_init(node);
+}
+
+/* Moves every entry of list onto the tail of head, leaving list empty. */
+static inline void list_splice_tail(struct list_head *list, struct list_head *head) {
+  if (list_empty(list))
+    return;
+  struct list_head *first = list->next;
+  struct list_head *last = list->prev;
+  first->prev = head->prev;
+  head->prev->next = first;
+  last->next = head;
+  head->prev = last;
+  list_init(list);
+}
+
+#endif
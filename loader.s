@@ -1,19 +1,32 @@
 global loader
+global boot_loader_tsc
 extern kmain
+extern thread_exit
+extern free_init_memory
 
 %define debug xchg bx, bx
 
 section .text
 loader:
+  mov ecx, eax                                ; the multiboot magic
+  rdtsc                                       ; the boot timeline starts here
+  mov [boot_loader_tsc], eax
+  mov [boot_loader_tsc + 4], edx
   mov esp, kernel_stack + KERNEL_STACK_SIZE   ; set up stack pointer
+  push ecx                                    ; kmain(info, magic)
   push ebx
   call kmain
+  call free_init_memory ; kmain and everything it alone used is __init
+  call thread_exit    ; kmain is done; let the other threads have the CPU
 .loop:
+  hlt                 ; sleep until the next interrupt
   jmp .loop
 
 KERNEL_STACK_SIZE equ 4096
 
 section .bss
 align 4
+boot_loader_tsc:
+  resd 2
 kernel_stack:
   resb KERNEL_STACK_SIZE
@@ -16,6 +16,9 @@
   along with this program; if not, write to the Free Software
   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
 
+#ifndef __MULTIBOOT_H__
+#define __MULTIBOOT_H__
+
 /* Macros. */
 
 /* The magic number for the Multiboot header. */
@@ -31,6 +34,10 @@
 /* The magic number passed by a Multiboot-compliant boot loader. */
 #define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
 
+/* Bits in the flags of the Multiboot information structure. */
+#define MULTIBOOT_INFO_MEMORY           0x00000001
+#define MULTIBOOT_INFO_MODS             0x00000008
+
 /* The size of our stack (16KB). */
 #define STACK_SIZE                      0x4000
 
@@ -118,3 +125,5 @@ typedef struct memory_map
 } memory_map_t;
 
 #endif /* ! ASM */
+
+#endif
@@ -6,6 +6,15 @@
 #include "string.h"
 #include "kheap.h"
 #include "error.h"
+#include "spinlock.h"
+#include "klog.h"
+#include "boottime.h"
+#include "compiler.h"
+#include "bios.h"
+#include "cpu.h"
+#ifdef BENCHMARK
+#include "bench.h"
+#endif
 
 // defined in kheap.c
 extern uint32_t placement_address;
@@ -15,21 +24,23 @@ void map_heap_pages();
 void set_up_frame_allocations();
 void set_up_page_directory();
 void allocate_heap_pages();
-/* bitset of frames - used or free.
- *  each entry of the frame allocations
- *  bitset represents a section of 32 frame
- *  allocations (since each entry is a uint32_t
- *  integer and each of the 32 bits of the int
- *  represents the allocation-0=free,1=used-
- *  of a frame) */
-uint32_t *frame_allocations;
-#define FRAME_ALLOCATIONS_SECTION_SIZE 32
-#define USED_FRAME_ALLOCATIONS_SECTION 0xFFFFFFFF
-#define FREE_FRAME_ALLOCATIONS_SECTION 0x00000000
+struct frame *frames;
 
 // Number of physical frames
 uint32_t num_of_frames;
 
+// Bytes of memory, as told by the boot loader
+static uint32_t memory_size = SIZE_OF_PHYSICAL_MEMORY;
+
+// Free frames, linked through frame.next from free_head; 0 if there are
+// none. Frames come off and go back on the front, so a frame freed is the
+// next one handed out, while it is still warm in the cache.
+static uint32_t free_head = 0;
+static uint32_t num_free_frames = 0;
+
+// Protects the free list and the next and flags of free frames.
+static spinlock_t frame_lock = SPINLOCK_INIT("frames");
+
 // The kernel's page directory
 page_directory_t *kernel_directory=0;
 
@@ -37,59 +48,58 @@ page_directory_t *kernel_directory=0;
 page_directory_t *current_directory=0;
 
 #define FRAME(addr) (addr/FRAME_SIZE)
-#define FRAME_ALLOCATIONS_SECTION(frame) (frame/FRAME_ALLOCATIONS_SECTION_SIZE)
-#define FRAME_ALLOCATIONS_OFFSET(frame) (frame%FRAME_ALLOCATIONS_SECTION_SIZE)
-
-static void set_frame(uint32_t addr) {
-  uint32_t frame = FRAME(addr);
-  uint32_t frame_alloc_section = FRAME_ALLOCATIONS_SECTION(frame);
-  uint32_t frame_alloc_offset = FRAME_ALLOCATIONS_OFFSET(frame);
-  frame_allocations[frame_alloc_section] |= (1 << frame_alloc_offset);
-}
-
-static void clear_frame(uint32_t addr) {
-  uint32_t frame = FRAME(addr);
-  uint32_t frame_alloc_section = FRAME_ALLOCATIONS_SECTION(frame);
-  uint32_t frame_alloc_offset = FRAME_ALLOCATIONS_OFFSET(frame);
-  frame_allocations[frame_alloc_section] &= ~(1 << frame_alloc_offset);
-}
-
-static uint32_t first_free_frame() {
-  uint32_t num_of_sections = num_of_frames/FRAME_ALLOCATIONS_SECTION_SIZE;
-  uint32_t section, idx;
-  for (section = 0; section < num_of_sections; section++){
-    if (frame_allocations[section] != USED_FRAME_ALLOCATIONS_SECTION) {
-      for (idx = 0; idx < FRAME_ALLOCATIONS_SECTION_SIZE; idx++){
-        if ( !(frame_allocations[section] & (0x1 << idx)) ){
-          return (section*FRAME_ALLOCATIONS_SECTION_SIZE) + idx;
-        }
-      }
-    }
-  }
-  return num_of_sections*FRAME_ALLOCATIONS_SECTION_SIZE;
+
+// Call with frame_lock held.
+static void push_free_frame(uint32_t pfn) {
+  struct frame *f = pfn_to_frame(pfn);
+  f->flags = FRAME_FREE;
+  f->next = free_head;
+  free_head = pfn;
+  num_free_frames++;
+}
+
+static void set_page(page_t *page, uint32_t pfn, int is_supervisor, int is_writeable) {
+  page->present = PAGE_PRESENT;
+  page->rw = (is_writeable)?PAGE_READ_WRITE:PAGE_READ_ONLY;
+  page->us = (is_supervisor)?PAGE_SUPERVISOR:PAGE_USER;
+  page->frame = pfn;
 }
 
 void alloc_frame(page_t *page, int is_supervisor, int is_writeable) {
   if (page->frame != 0) {
     // frame already allocated, return right away
     return;
-  } else {
-    uint32_t free_frame = first_free_frame();
-    if (free_frame == (uint32_t)-1) {
-      ERROR("No free frames!");
-    } else {
-      // assign the free frame to the page
-      page->present = PAGE_PRESENT;
-      page->rw = (is_writeable)?PAGE_READ_WRITE:PAGE_READ_ONLY;
-      page->us = (is_supervisor)?PAGE_SUPERVISOR:PAGE_USER;
-      page->frame = free_frame;
-
-      // mark newly allocated frame as used
-      // in our frame allocations
-      uint32_t physical_address = free_frame*FRAME_SIZE;
-      set_frame(physical_address);
-    }
   }
+  uint32_t flags = spin_lock_irqsave(&frame_lock);
+  uint32_t pfn = free_head;
+  if (!pfn) {
+    spin_unlock_irqrestore(&frame_lock, flags);
+    ERROR("No free frames!");
+    return;
+  }
+  struct frame *f = pfn_to_frame(pfn);
+  free_head = f->next;
+  num_free_frames--;
+  f->next = 0;
+  f->flags = 0;
+  f->refcount = 1;
+  spin_unlock_irqrestore(&frame_lock, flags);
+
+  set_page(page, pfn, is_supervisor, is_writeable);
+}
+
+void share_frame(page_t *page, uint32_t pfn, int is_supervisor, int is_writeable) {
+  frame_get(pfn_to_frame(pfn));
+  set_page(page, pfn, is_supervisor, is_writeable);
+}
+
+bool frame_put(struct frame *f) {
+  if (!atomic_dec_and_test(&f->refcount))
+    return false;
+  uint32_t flags = spin_lock_irqsave(&frame_lock);
+  push_free_frame(frame_to_pfn(f));
+  spin_unlock_irqrestore(&frame_lock, flags);
+  return true;
 }
 
 void free_frame(page_t *page){
@@ -98,13 +108,74 @@ void free_frame(page_t *page){
     // The page didn't have an allocated
     // frame in the first place
     return;
-  } else {
-    clear_frame(frame);
-    page->frame = 0x0;
   }
+  page->frame = 0x0;
+  // Past the end of memory there is nothing to give back.
+  if (frame < num_of_frames)
+    frame_put(pfn_to_frame(frame));
 }
 
-void init_paging() {
+#ifdef BENCHMARK
+// The page entry is a scratch one, so nothing gets mapped; what is timed
+// is taking a frame off the free list and putting it back.
+static void bench_alloc_frame(uint32_t i) {
+  page_t page = { 0 };
+  (void)i;
+  alloc_frame(&page, 0, 1);
+  free_frame(&page);
+}
+BENCH(alloc_frame, &bench_alloc_frame);
+
+// Looks up pages across the first few tables of the kernel heap.
+static void bench_get_page(uint32_t i) {
+  get_page(KHEAP_START + (i % 4096) * FRAME_SIZE, 0, kernel_directory);
+}
+BENCH(get_page, &bench_get_page);
+#endif
+
+// Unmaps [start, end) and gives its frames back. Only this CPU's TLB is
+// flushed: the other CPUs never touch boot-only memory once they are up.
+static uint32_t release_range(uint32_t start, uint32_t end) {
+  uint32_t addr, freed = 0;
+  for (addr = start; addr < end; addr += FRAME_SIZE) {
+    page_t *page = get_page(addr, 0, kernel_directory);
+    if (!page || !page->frame)
+      continue;
+    page->present = 0;
+    free_frame(page);
+    asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+    freed++;
+  }
+  return freed;
+}
+
+// Laid out by link.ld around the __init code and data.
+extern uint8_t init_start[];
+extern uint8_t init_end[];
+
+void free_init_memory() {
+  uint32_t freed = release_range((uint32_t)init_start, (uint32_t)init_end);
+  // identity_map took all of base memory. Past the first page (the real
+  // mode IVT and the BIOS data area, and frame 0 can't be handed out
+  // anyway) and below the EBDA, only booting used it: the bootloader, the
+  // MP table search and the AP trampoline.
+  uint32_t base_top = (uint32_t)bda_read16(BDA_BASE_MEMORY_KB) * 1024;
+  freed += release_range(FRAME_SIZE, base_top & ~(FRAME_SIZE - 1));
+  klog(KLOG_INFO, "Freed %u KiB of boot-only memory", freed * FRAME_SIZE / 1024);
+}
+
+void map_mmio(uint32_t addr) {
+  page_t *page = get_page(addr, 1, kernel_directory);
+  page->present = PAGE_PRESENT;
+  page->rw = PAGE_READ_WRITE;
+  page->us = PAGE_SUPERVISOR;
+  page->pwt = 1;
+  page->pcd = 1;
+  page->frame = FRAME(addr);
+  asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+}
+
+void __init init_paging() {
   // Some necessary set up
   set_up_frame_allocations();
   set_up_page_directory();
@@ -115,49 +186,79 @@ void init_paging() {
 
   register_interrupt_handler(14, page_fault);
   enable_paging(kernel_directory);
+  boot_mark("paging");
   kheap = create_heap(KHEAP_START, KHEAP_START+KHEAP_INITIAL_SIZE, 0xCFFFF000, 0, 0);
 }
 
-void allocate_heap_pages() {
+void __init allocate_heap_pages() {
   uint32_t i;
   for (i = KHEAP_START; i < KHEAP_START+KHEAP_INITIAL_SIZE; i += FRAME_SIZE){
-    alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
+    alloc_frame( get_page(i, 1, kernel_directory), 0, 1);
   }
 }
 
-void map_heap_pages() {
+void __init map_heap_pages() {
   uint32_t i;
   for (i = KHEAP_START; i < KHEAP_START+KHEAP_INITIAL_SIZE; i += FRAME_SIZE) {
     get_page(i, 1, kernel_directory);
   }
 }
 
-void set_up_frame_allocations() {
-  num_of_frames = SIZE_OF_PHYSICAL_MEMORY / FRAME_SIZE;
-  frame_allocations = (uint32_t*)kmalloc(num_of_frames/FRAME_ALLOCATIONS_SECTION_SIZE);
-  memset(frame_allocations, 0, num_of_frames/FRAME_ALLOCATIONS_SECTION_SIZE);
+void __init paging_detect_memory(multiboot_info_t *info, uint32_t magic) {
+  if (magic != MULTIBOOT_BOOTLOADER_MAGIC || !(info->flags & MULTIBOOT_INFO_MEMORY))
+    return;
+  // mem_upper is the KiB of memory from 1 MB up to the first hole. Frame
+  // numbers only have 20 bits, so anything past 4 GB is no use anyway.
+  uint32_t kb = info->mem_upper + 1024;
+  if (kb > 0x400000 - 4)
+    kb = 0x400000 - 4;
+  memory_size = kb * 1024;
+}
+
+void __init set_up_frame_allocations() {
+  num_of_frames = memory_size / FRAME_SIZE;
+  // Page aligned, so that each cache line holds the same 8 frames.
+  uint32_t size = num_of_frames * sizeof(struct frame);
+  frames = (struct frame *)kmalloc_a(size);
+  memset(frames, 0, size);
+  klog(KLOG_INFO, "%u KiB of memory, %u KiB of frame metadata",
+       memory_size / 1024, size / 1024);
 }
 
-void set_up_page_directory() {
+void __init set_up_page_directory() {
   kernel_directory = (page_directory_t*)kmalloc_a(sizeof(page_directory_t));
   memset(kernel_directory, 0, sizeof(page_directory_t));
   current_directory = kernel_directory;
 }
 
-void identity_map() {
+void __init identity_map() {
   uint32_t i;
+  // get_page can move placement_address, so it is read every time round.
   for (i = 0; i < placement_address+FRAME_SIZE; i+=FRAME_SIZE) {
-    alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
+    uint32_t pfn = FRAME(i);
+    if (pfn < num_of_frames) {
+      pfn_to_frame(pfn)->refcount = 1;
+      pfn_to_frame(pfn)->flags = FRAME_KERNEL;
+    }
+    set_page(get_page(i, 1, kernel_directory), pfn, 0, 1);
   }
+
+  // Everything above is free. Pushed from the top down, so that frames
+  // are handed out from the bottom up. No other CPU is up yet to need
+  // frame_lock.
+  uint32_t pfn;
+  for (pfn = num_of_frames; pfn > FRAME(i); pfn--)
+    push_free_frame(pfn - 1);
 }
 
 void enable_paging(page_directory_t *dir) {
   current_directory = dir;
-  asm volatile("mov %0, %%cr3":: "r"(&dir->page_tables_physical));
+  asm volatile("mov %0, %%cr3":: "r"(&dir->page_tables_physical) : "memory");
   uint32_t cr0;
   asm volatile("mov %%cr0, %0": "=r"(cr0));
   cr0 |= 0x80000000; // Enable paging!
-  asm volatile("mov %0, %%cr0":: "r"(cr0));
+  cr0 |= CR0_WP;     // and make read-only pages read-only for the kernel too
+  asm volatile("mov %0, %%cr0":: "r"(cr0) : "memory");
 }
 
 page_t *get_page(uint32_t address, int make, page_directory_t *dir){
@@ -178,18 +279,18 @@ page_t *get_page(uint32_t address, int make, page_directory_t *dir){
   }
 }
 
-void page_fault(registers_t regs){
+void __cold page_fault(registers_t regs){
   // A page fault has occurred.
   // The faulting address is stored in the CR2 register.
   uint32_t faulting_address;
   asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
 
   //Output an error message.
-  printf("Page fault! ( ");
-  if (! (regs.err_code & 0x1) ) { printf("present"); }
-  if (regs.err_code & 0x2) { printf("read-only"); }
-  if (regs.err_code & 0x4) { printf("user-mode"); }
-  if (regs.err_code & 0x8) { printf("reserved"); }
-  printf(") at 0x %x \n", faulting_address);
+  klog(KLOG_EMERG, "Page fault! ( %s%s%s%s) at %#x",
+       !(regs.err_code & 0x1) ? "present " : "",
+       regs.err_code & 0x2 ? "read-only " : "",
+       regs.err_code & 0x4 ? "user-mode " : "",
+       regs.err_code & 0x8 ? "reserved " : "",
+       faulting_address);
   ERROR("Page fault");
 }
@@ -2,7 +2,10 @@
 #define __PAGING_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "isr.h"
+#include "atomic.h"
+#include "multiboot.h"
 
 #define FRAME_SIZE              4096
 
@@ -19,7 +22,7 @@
 #define PAGE_SIZE_4KB           0
 #define PAGE_SIZE_4MB           1
 
-// Assume physical memory is 16 MB 
+// Assumed when the boot loader doesn't say how much memory there is
 #define SIZE_OF_PHYSICAL_MEMORY 0x10000000
 
 struct page {
@@ -59,6 +62,62 @@ typedef struct page_table {
   page_t pages[PAGE_TABLE_SIZE];
 } page_table_t;
 
+/* What is known about each physical frame. The array of these is indexed
+ * by frame number and kept to 8 bytes an entry, so a cache line covers 8
+ * frames and the array costs 0.2% of memory.
+ *  refcount: mappings and other users of the frame; 0 while it is free
+ *  next: frame number of the next frame on whatever list the frame is on
+ *        (the free list, or an LRU list of its owner); 0 ends the list,
+ *        as frame 0 is never handed out
+ *  flags: FRAME_* below
+ * next and flags are only changed with the frame's owner's lock held;
+ * frame_lock for free frames.
+ */
+struct frame {
+  volatile uint32_t refcount;
+  uint32_t next:20;
+  uint32_t flags:12;
+};
+_Static_assert(sizeof(struct frame) == 8, "struct frame must stay 8 bytes");
+
+#define FRAME_FREE      0x001   // on the free list
+#define FRAME_KERNEL    0x002   // kernel image or boot data, see identity_map
+/* Bits 0x010 and up are left to whoever owns the frame. */
+
+/* One per physical frame, num_of_frames in all. */
+extern struct frame *frames;
+extern uint32_t num_of_frames;
+
+static inline struct frame *pfn_to_frame(uint32_t pfn) {
+  return &frames[pfn];
+}
+
+static inline uint32_t frame_to_pfn(const struct frame *f) {
+  return f - frames;
+}
+
+static inline struct frame *phys_to_frame(uint32_t addr) {
+  return &frames[addr / FRAME_SIZE];
+}
+
+static inline uint32_t frame_to_phys(const struct frame *f) {
+  return frame_to_pfn(f) * FRAME_SIZE;
+}
+
+/* Takes another reference to a frame that is in use. */
+static inline void frame_get(struct frame *f) {
+  atomic_inc(&f->refcount);
+}
+
+/**
+ * frame_put:
+ * Drops a reference to a frame, and puts it back on the free list if
+ * that was the last one.
+ *
+ * @return true if the frame was freed
+ */
+bool frame_put(struct frame *f);
+
 /* For every page directory, we keep 2 arrays. One 
  * is holding the physical addresses of its page tables 
  * (for giving to the CPU), and the other holding the virtual
@@ -81,6 +140,14 @@ typedef struct page_directory{
  */
 void init_paging();
 
+/**
+ * paging_detect_memory:
+ * Takes the size of memory from the multiboot information, for sizing the
+ * frame array. Without it, SIZE_OF_PHYSICAL_MEMORY is assumed. Must come
+ * before init_paging.
+ */
+void paging_detect_memory(multiboot_info_t *info, uint32_t magic);
+
 /* Causes the specified page directory to be loaded 
  * into the CR3 register, where the MMU expects it.
  * Enables paging and flushes the page-directory cache.
@@ -101,9 +168,30 @@ page_t *get_page(uint32_t address, int make, page_directory_t *dir);
  */
 void identity_map();
 
+/* Drops the page's reference to its frame and clears page->frame. */
 void free_frame(page_t *page);
 
+/* Gives the page a free frame, unless it has one already. */
 void alloc_frame(page_t *page, int is_supervisor, int is_writeable);
+
+/* Maps the page onto frame pfn, which is in use, and takes a reference to
+ * it, so that the frame is shared until every mapping has let it go.
+ */
+void share_frame(page_t *page, uint32_t pfn, int is_supervisor, int is_writeable);
+
+/* Maps the page holding the physical address addr at the same virtual
+ * address, with caching disabled. The frame is not taken from the frame
+ * allocator, so this is only for device memory such as the local APIC.
+ */
+void map_mmio(uint32_t addr);
+
+/**
+ * free_init_memory:
+ * Unmaps the __init code and data (see compiler.h) and the base memory
+ * below 640K, which only booting uses, and gives their frames back.
+ * Called by loader.s once kmain has returned.
+ */
+void free_init_memory();
 /*
  * Handler for page faults.
  */
@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "profile.h"
+#include "isr.h"
+#include "io.h"
+#include "kheap.h"
+#include "cpu.h"
+#include "trace.h"
+#include "string.h"
+#include "compiler.h"
+
+// CMOS/RTC ports. Setting bit 7 of the index disables NMIs while we
+// touch the RTC.
+#define CMOS_INDEX_PORT         0x70
+#define CMOS_DATA_PORT          0x71
+#define CMOS_NMI_DISABLE        0x80
+
+#define RTC_REG_A               0x0A
+#define RTC_REG_B               0x0B
+#define RTC_REG_C               0x0C
+#define RTC_REG_A_RATE_MASK     0x0F
+#define RTC_REG_B_PERIODIC      0x40
+
+// The periodic rate is 32768 >> (rate - 1) Hz for rate 3 to 15.
+#define RTC_BASE_HZ             32768u
+#define RTC_FASTEST_RATE        3
+#define RTC_SLOWEST_RATE        15
+
+#define RTC_IRQ                 8
+
+// How far up the stack the EBP chain may lead before we call it garbage.
+#define PROFILE_STACK_SPAN      0x4000
+
+// A sample goes out as a single trace record.
+_Static_assert(PROFILE_DEPTH <= TRACE_MAX_ARGS, "profile samples must fit a trace record");
+
+static struct profile_sample *samples = 0;
+static volatile uint32_t nr_samples = 0;
+static volatile uint32_t missed = 0;
+static volatile bool sampling = false;
+static uint32_t sample_hz = 0;
+
+static uint8_t cmos_read(uint8_t reg) {
+  outb(CMOS_INDEX_PORT, CMOS_NMI_DISABLE | reg);
+  return inb(CMOS_DATA_PORT);
+}
+
+static void cmos_write(uint8_t reg, uint8_t value) {
+  outb(CMOS_INDEX_PORT, CMOS_NMI_DISABLE | reg);
+  outb(CMOS_DATA_PORT, value);
+}
+
+// Follows saved EBPs as long as they lead up the same stack.
+static void walk_frames(struct profile_sample *s, uint32_t ebp, uint32_t esp) {
+  uint32_t base = ebp;
+  uint32_t depth;
+  if (ebp <= esp || ebp - esp >= PROFILE_STACK_SPAN)
+    return;
+  for (depth = 1; depth < PROFILE_DEPTH; depth++) {
+    if (ebp & 3 || ebp - base >= PROFILE_STACK_SPAN)
+      break;
+    uint32_t *frame = (uint32_t *)ebp;
+    s->pc[depth] = frame[1];
+    if (frame[0] <= ebp)
+      break;
+    ebp = frame[0];
+  }
+}
+
+static void rtc_irq(registers_t regs) {
+  // Until register C is read, the RTC raises no more interrupts.
+  cmos_read(RTC_REG_C);
+  if (!sampling)
+    return;
+
+  uint32_t n = nr_samples;
+  if (n >= PROFILE_MAX_SAMPLES) {
+    missed++;
+    return;
+  }
+  struct profile_sample *s = &samples[n];
+  memset(s, 0, sizeof(*s));
+  s->pc[0] = regs.eip;
+  walk_frames(s, regs.ebp, regs.esp);
+  nr_samples = n + 1;
+}
+
+void __init init_profiler() {
+  samples = (struct profile_sample *)kmalloc(PROFILE_MAX_SAMPLES * sizeof(struct profile_sample));
+  register_interrupt_handler(IRQ8, &rtc_irq);
+}
+
+uint32_t profile_start(uint32_t hz) {
+  uint32_t rate = RTC_FASTEST_RATE;
+  while (rate < RTC_SLOWEST_RATE && (RTC_BASE_HZ >> (rate - 1)) > hz)
+    rate++;
+
+  uint32_t flags = irq_save();
+  nr_samples = 0;
+  missed = 0;
+  sample_hz = RTC_BASE_HZ >> (rate - 1);
+  cmos_write(RTC_REG_A, (cmos_read(RTC_REG_A) & ~RTC_REG_A_RATE_MASK) | rate);
+  cmos_write(RTC_REG_B, cmos_read(RTC_REG_B) | RTC_REG_B_PERIODIC);
+  cmos_read(RTC_REG_C);
+  sampling = true;
+  pic_unmask(RTC_IRQ);
+  irq_restore(flags);
+  return sample_hz;
+}
+
+void profile_stop() {
+  uint32_t flags = irq_save();
+  sampling = false;
+  cmos_write(RTC_REG_B, cmos_read(RTC_REG_B) & ~RTC_REG_B_PERIODIC);
+  cmos_read(RTC_REG_C);
+  irq_restore(flags);
+}
+
+void __cold profile_dump() {
+  struct trace_record rec = {
+    .tsc = rdtsc(), .event = TRACE_PROFILE_INFO, .nargs = 3,
+    .args = { nr_samples, sample_hz, missed },
+  };
+  trace_emit(&rec);
+
+  uint32_t i, depth;
+  rec.event = TRACE_PROFILE_SAMPLE;
+  rec.nargs = PROFILE_DEPTH;
+  for (i = 0; i < nr_samples; i++) {
+    for (depth = 0; depth < PROFILE_DEPTH; depth++)
+      rec.args[depth] = samples[i].pc[depth];
+    trace_emit(&rec);
+  }
+}
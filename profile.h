@@ -0,0 +1,43 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+
+/**
+ * A statistical profiler. The RTC's periodic interrupt (IRQ8) samples
+ * the interrupted EIP plus the return addresses of the first few frames
+ * on the EBP chain into a buffer allocated up front. The RTC is used so
+ * that sampling doesn't disturb the timer subsystem. It interrupts the
+ * bootstrap processor only, so samples come from CPU 0.
+ */
+
+/* Program counters kept per sample: the interrupted EIP plus callers. */
+#define PROFILE_DEPTH           4
+#define PROFILE_MAX_SAMPLES     8192
+#define PROFILE_DEFAULT_HZ      1024
+
+struct profile_sample {
+  uint32_t pc[PROFILE_DEPTH];     // unused entries are 0
+};
+
+/* Allocates the sample buffer. Requires the kernel heap. */
+void init_profiler();
+
+/**
+ * profile_start:
+ * Clears the buffer and starts sampling at the RTC rate closest to hz
+ * without going over (2 Hz to 8192 Hz, powers of two). Returns that rate.
+ */
+uint32_t profile_start(uint32_t hz);
+
+void profile_stop();
+
+/**
+ * profile_dump:
+ * Streams the samples over COM1 as TRACE_PROFILE_SAMPLE trace records,
+ * after a TRACE_PROFILE_INFO one. tools/profile.py symbolizes them against
+ * kernel.sym into a flat profile or folded stacks for flame graphs.
+ */
+void profile_dump();
+
+#endif
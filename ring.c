@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ring.h"
+#include "string.h"
+#include "error.h"
+
+void ring_init(struct ring *r, void *buf, uint32_t size, uint32_t esize) {
+  if (size == 0 || (size & (size - 1)))
+    ERROR("ring size must be a power of two");
+  r->head = 0;
+  r->cached_tail = 0;
+  r->tail = 0;
+  r->cached_head = 0;
+  r->size = size;
+  r->mask = size - 1;
+  r->esize = esize;
+  r->data = buf;
+}
+
+// Copies n elements between the ring and a flat buffer, starting at ring
+// index idx and wrapping around the end of the storage if need be.
+static void copy_in(struct ring *r, uint32_t idx, const uint8_t *src, uint32_t n) {
+  uint32_t off = idx & r->mask;
+  if (n == 1 && r->esize == 1) {
+    r->data[off] = *src;
+    return;
+  }
+  uint32_t first = r->size - off;
+  if (first > n)
+    first = n;
+  memmove(r->data + off * r->esize, src, first * r->esize);
+  memmove(r->data, src + first * r->esize, (n - first) * r->esize);
+}
+
+static void copy_out(struct ring *r, uint32_t idx, uint8_t *dst, uint32_t n) {
+  uint32_t off = idx & r->mask;
+  if (n == 1 && r->esize == 1) {
+    *dst = r->data[off];
+    return;
+  }
+  uint32_t first = r->size - off;
+  if (first > n)
+    first = n;
+  memmove(dst, r->data + off * r->esize, first * r->esize);
+  memmove(dst + first * r->esize, r->data, (n - first) * r->esize);
+}
+
+// Room for the producer, refreshing its copy of tail only if the cached
+// value says there isn't enough.
+static uint32_t producer_room(struct ring *r, uint32_t head, uint32_t want) {
+  uint32_t room = r->size - (head - r->cached_tail);
+  if (room < want) {
+    // Pairs with the release store in the consumer: the slots it freed
+    // are done being read before we overwrite them.
+    r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    room = r->size - (head - r->cached_tail);
+  }
+  return room;
+}
+
+static uint32_t consumer_avail(struct ring *r, uint32_t tail, uint32_t want) {
+  uint32_t avail = r->cached_head - tail;
+  if (avail < want) {
+    // Pairs with the release store in the producer: the elements are
+    // written before we see head move past them.
+    r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    avail = r->cached_head - tail;
+  }
+  return avail;
+}
+
+uint32_t ring_enqueue_burst(struct ring *r, const void *src, uint32_t n) {
+  uint32_t head = r->head;
+  uint32_t room = producer_room(r, head, n);
+  if (n > room)
+    n = room;
+  if (n == 0)
+    return 0;
+  copy_in(r, head, src, n);
+  __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+uint32_t ring_dequeue_burst(struct ring *r, void *dst, uint32_t n) {
+  uint32_t tail = r->tail;
+  uint32_t avail = consumer_avail(r, tail, n);
+  if (n > avail)
+    n = avail;
+  if (n == 0)
+    return 0;
+  copy_out(r, tail, dst, n);
+  __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+bool ring_enqueue_bulk(struct ring *r, const void *src, uint32_t n) {
+  uint32_t head = r->head;
+  if (producer_room(r, head, n) < n)
+    return false;
+  copy_in(r, head, src, n);
+  __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool ring_dequeue_bulk(struct ring *r, void *dst, uint32_t n) {
+  uint32_t tail = r->tail;
+  if (consumer_avail(r, tail, n) < n)
+    return false;
+  copy_out(r, tail, dst, n);
+  __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+  return true;
+}
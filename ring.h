@@ -0,0 +1,94 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * A lock-free single-producer, single-consumer ring buffer of fixed-size
+ * elements. One side (say, an interrupt handler) enqueues and one other
+ * side dequeues, concurrently, without locks and without disabling
+ * interrupts. With more than one producer or consumer, each side needs a
+ * lock of its own.
+ *
+ * head and tail run freely and are masked on access, so all size slots
+ * are usable. Each side keeps its own copy of the other side's index and
+ * only reads the shared one when that copy says the ring is full (or
+ * empty), so the two sides rarely touch each other's cache lines.
+ */
+struct ring {
+  // Producer side.
+  volatile uint32_t head __attribute__((aligned(64)));
+  uint32_t cached_tail;
+  // Consumer side.
+  volatile uint32_t tail __attribute__((aligned(64)));
+  uint32_t cached_head;
+  // Fixed at ring_init.
+  uint32_t size __attribute__((aligned(64)));
+  uint32_t mask;
+  uint32_t esize;
+  uint8_t *data;
+} __attribute__((aligned(64)));
+
+/**
+ * ring_init:
+ * Sets up a ring of size elements of esize bytes each, stored in buf
+ * (which must hold size * esize bytes). size must be a power of two.
+ */
+void ring_init(struct ring *r, void *buf, uint32_t size, uint32_t esize);
+
+/* Enqueues as many of the n elements at src as fit. Returns how many did. Producer only. */
+uint32_t ring_enqueue_burst(struct ring *r, const void *src, uint32_t n);
+
+/* Dequeues up to n elements into dst. Returns how many it got. Consumer only. */
+uint32_t ring_dequeue_burst(struct ring *r, void *dst, uint32_t n);
+
+/* Enqueues all n elements, or none if they don't all fit. Producer only. */
+bool ring_enqueue_bulk(struct ring *r, const void *src, uint32_t n);
+
+/* Dequeues exactly n elements, or none if there are fewer. Consumer only. */
+bool ring_dequeue_bulk(struct ring *r, void *dst, uint32_t n);
+
+static inline bool ring_enqueue(struct ring *r, const void *e) {
+  return ring_enqueue_burst(r, e, 1) == 1;
+}
+
+static inline bool ring_dequeue(struct ring *r, void *e) {
+  return ring_dequeue_burst(r, e, 1) == 1;
+}
+
+/**
+ * ring_reserve/ring_commit:
+ * Zero-copy enqueue of one element: ring_reserve returns the next free
+ * slot (or 0 if the ring is full) for the producer to fill in place, and
+ * ring_commit publishes it. Producer only.
+ */
+static inline void *ring_reserve(struct ring *r) {
+  uint32_t head = r->head;
+  if (head - r->cached_tail >= r->size) {
+    r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - r->cached_tail >= r->size)
+      return 0;
+  }
+  return r->data + (head & r->mask) * r->esize;
+}
+
+static inline void ring_commit(struct ring *r) {
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Elements queued. Only a snapshot if the other side is running. */
+static inline uint32_t ring_count(struct ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t ring_free_count(struct ring *r) {
+  return r->size - ring_count(r);
+}
+
+static inline bool ring_empty(struct ring *r) {
+  return ring_count(r) == 0;
+}
+
+#endif
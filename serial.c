@@ -1,10 +1,37 @@
+#include <stdint.h>
+#include <stdbool.h>
+
 #include "io.h"
 #include "serial.h"
+#include "isr.h"
+#include "ring.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "compiler.h"
+
+/* COM1's line on the master PIC, which the BIOS may leave masked */
+#define SERIAL_COM1_IRQ     4
+
+/* Ring sizes, in bytes. Must be powers of two. */
+#define SERIAL_TX_RING_SIZE 4096
+#define SERIAL_RX_RING_SIZE 1024
+
+static struct ring tx_ring;
+static char tx_ring_buf[SERIAL_TX_RING_SIZE];
+static struct ring rx_ring;
+static char rx_ring_buf[SERIAL_RX_RING_SIZE];
+
+/* Any CPU can write, and the IRQ handler drains the ring on its own, so
+ * everything on the transmit side happens under tx_lock. */
+static spinlock_t tx_lock = SPINLOCK_INIT("serial tx");
+/* Whether the transmitter empty interrupt is enabled. */
+static bool tx_active = false;
+static bool initialized = false;
 
 void serial_configure_baud_rate(unsigned short com, unsigned short divisor) {
     outb(SERIAL_LINE_COMMAND_PORT(com), SERIAL_LINE_ENABLE_DLAB);
-    outb(SERIAL_DATA_PORT(com), (divisor >> 8) & 0x00ff);
-    outb(SERIAL_DATA_PORT(com), divisor & 0x00ff);
+    outb(SERIAL_DIVISOR_LOW_PORT(com), divisor & 0x00ff);
+    outb(SERIAL_DIVISOR_HIGH_PORT(com), (divisor >> 8) & 0x00ff);
 }
 
 void serial_configure_line(unsigned short com){
@@ -25,17 +52,149 @@ void serial_configure_line(unsigned short com){
  */
 int serial_is_transmit_fifo_empty(unsigned int com) {
     //empty if bit 5 of line status IO port is equal to 1
-    return inb(SERIAL_LINE_STATUS_PORT(com)) & 0x20;
+    return inb(SERIAL_LINE_STATUS_PORT(com)) & SERIAL_LSR_TX_EMPTY;
+}
+
+static void set_tx_interrupt(bool on) {
+    tx_active = on;
+    outb(SERIAL_INTERRUPT_ENABLE_PORT(SERIAL_COM1_BASE),
+         SERIAL_IER_RX_AVAILABLE | SERIAL_IER_LINE_STATUS |
+         (on ? SERIAL_IER_TX_EMPTY : 0));
+}
+
+/* Moves up to a FIFO's worth of bytes from the ring to the UART. Call
+ * with tx_lock held, once the transmit FIFO is empty. */
+static unsigned int tx_fill_fifo() {
+    char chunk[SERIAL_TX_FIFO_SIZE];
+    unsigned int n = ring_dequeue_burst(&tx_ring, chunk, SERIAL_TX_FIFO_SIZE);
+    unsigned int i;
+    for (i = 0; i < n; i++)
+        outb(SERIAL_DATA_PORT(SERIAL_COM1_BASE), chunk[i]);
+    return n;
+}
+
+static void serial_tx_irq() {
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    if (tx_fill_fifo() == 0)
+        set_tx_interrupt(false);
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+/* The IRQ handler is the only producer for rx_ring. */
+static void serial_rx_irq() {
+    char chunk[SERIAL_TX_FIFO_SIZE];
+    unsigned int n;
+    do {
+        n = 0;
+        while (n < sizeof(chunk) &&
+               (inb(SERIAL_LINE_STATUS_PORT(SERIAL_COM1_BASE)) & SERIAL_LSR_DATA_READY))
+            chunk[n++] = inb(SERIAL_DATA_PORT(SERIAL_COM1_BASE));
+        // Whatever doesn't fit is dropped.
+        ring_enqueue_burst(&rx_ring, chunk, n);
+    } while (n == sizeof(chunk));
+}
+
+static void serial_irq(registers_t regs) {
+    (void)regs;
+    uint8_t iir;
+    while (!((iir = inb(SERIAL_INTERRUPT_ID_PORT(SERIAL_COM1_BASE))) & SERIAL_IIR_NONE_PENDING)) {
+        switch (iir & SERIAL_IIR_ID_MASK) {
+            case SERIAL_IIR_RX_AVAILABLE:
+            case SERIAL_IIR_RX_TIMEOUT:
+                serial_rx_irq();
+                break;
+            case SERIAL_IIR_TX_EMPTY:
+                serial_tx_irq();
+                break;
+            case SERIAL_IIR_LINE_STATUS:
+                inb(SERIAL_LINE_STATUS_PORT(SERIAL_COM1_BASE));
+                break;
+            case SERIAL_IIR_MODEM_STATUS:
+                inb(SERIAL_MODEM_STATUS_PORT(SERIAL_COM1_BASE));
+                break;
+        }
+    }
+}
+
+void __init init_serial() {
+    unsigned short com = SERIAL_COM1_BASE;
+    outb(SERIAL_INTERRUPT_ENABLE_PORT(com), 0);
+    serial_configure_baud_rate(com, SERIAL_DEFAULT_DIVISOR);
+    serial_configure_line(com);
+    outb(SERIAL_FIFO_COMMAND_PORT(com), SERIAL_FIFO_ENABLE | SERIAL_FIFO_CLEAR_RX |
+                                        SERIAL_FIFO_CLEAR_TX | SERIAL_FIFO_TRIGGER_14);
+    outb(SERIAL_MODEM_COMMAND_PORT(com), SERIAL_MCR_DTR_RTS_OUT2);
+
+    ring_init(&tx_ring, tx_ring_buf, SERIAL_TX_RING_SIZE, 1);
+    ring_init(&rx_ring, rx_ring_buf, SERIAL_RX_RING_SIZE, 1);
+    register_interrupt_handler(IRQ4, &serial_irq);
+    pic_unmask(SERIAL_COM1_IRQ);
+    set_tx_interrupt(false);
+    initialized = true;
 }
 
 void serial_write(char *buf, unsigned int len) {
-    serial_configure_baud_rate(SERIAL_COM1_BASE, 3);
-    serial_configure_line(SERIAL_COM1_BASE);
+    unsigned int i;
+    if (!initialized) {
+        for (i = 0; i < len; i++) {
+            while (!serial_is_transmit_fifo_empty(SERIAL_COM1_BASE));
+            outb(SERIAL_DATA_PORT(SERIAL_COM1_BASE), buf[i]);
+        }
+        return;
+    }
 
-    unsigned int i; 
-    for (i=0; i<len; i++) {
-        while (!serial_is_transmit_fifo_empty(SERIAL_COM1_BASE));
-        outb(SERIAL_DATA_PORT(SERIAL_COM1_BASE), buf[i]);
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    while (len) {
+        unsigned int n = ring_enqueue_burst(&tx_ring, buf, len);
+        buf += n;
+        len -= n;
+        if (len) {
+            // Full. Make room by doing the interrupt handler's job.
+            while (!serial_is_transmit_fifo_empty(SERIAL_COM1_BASE))
+                cpu_relax();
+            tx_fill_fifo();
+        }
     }
+    // With the transmitter idle, enabling its interrupt raises one right
+    // away, and the handler starts draining.
+    if (!tx_active)
+        set_tx_interrupt(true);
+    spin_unlock_irqrestore(&tx_lock, flags);
 }
 
+void serial_flush() {
+    if (!initialized)
+        return;
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    while (!ring_empty(&tx_ring)) {
+        while (!serial_is_transmit_fifo_empty(SERIAL_COM1_BASE))
+            cpu_relax();
+        tx_fill_fifo();
+    }
+    while (!serial_is_transmit_fifo_empty(SERIAL_COM1_BASE))
+        cpu_relax();
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+void serial_panic() {
+    if (!initialized)
+        return;
+    // What is queued goes out first, unless the lock is taken: whoever
+    // has it, this CPU included, is not going to let go.
+    if (spin_trylock(&tx_lock)) {
+        while (!ring_empty(&tx_ring)) {
+            while (!serial_is_transmit_fifo_empty(SERIAL_COM1_BASE))
+                cpu_relax();
+            tx_fill_fifo();
+        }
+        spin_unlock(&tx_lock);
+    }
+    // serial_write now polls, as it did before init_serial.
+    initialized = false;
+}
+
+unsigned int serial_read(char *buf, unsigned int len) {
+    if (!initialized)
+        return 0;
+    return ring_dequeue_burst(&rx_ring, buf, len);
+}
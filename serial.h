@@ -1,16 +1,61 @@
 #ifndef _SERIAL_H_
 #define _SERIAL_H_
 
+#include <stdint.h>
+
 #define SERIAL_COM1_BASE                0x3F8
 
 #define SERIAL_DATA_PORT(base)          (base)
-#define SERIAL_FIFO_COMMAND_PORT(base)  (base + 2)
+#define SERIAL_INTERRUPT_ENABLE_PORT(base) (base + 1)
+#define SERIAL_FIFO_COMMAND_PORT(base)  (base + 2)   /* write */
+#define SERIAL_INTERRUPT_ID_PORT(base)  (base + 2)   /* read */
 #define SERIAL_LINE_COMMAND_PORT(base)  (base + 3)
 #define SERIAL_MODEM_COMMAND_PORT(base) (base + 4)
 #define SERIAL_LINE_STATUS_PORT(base)   (base + 5)
+#define SERIAL_MODEM_STATUS_PORT(base)  (base + 6)
+
+/* With DLAB set, the data and interrupt enable ports hold the divisor */
+#define SERIAL_DIVISOR_LOW_PORT(base)   (base)
+#define SERIAL_DIVISOR_HIGH_PORT(base)  (base + 1)
 
 #define SERIAL_LINE_ENABLE_DLAB         0x80
 
+/* Interrupt enable register */
+#define SERIAL_IER_RX_AVAILABLE         0x01
+#define SERIAL_IER_TX_EMPTY             0x02
+#define SERIAL_IER_LINE_STATUS          0x04
+
+/* FIFO control register: enable, clear both FIFOs, interrupt when the
+ * receive FIFO holds 14 bytes */
+#define SERIAL_FIFO_ENABLE              0x01
+#define SERIAL_FIFO_CLEAR_RX            0x02
+#define SERIAL_FIFO_CLEAR_TX            0x04
+#define SERIAL_FIFO_TRIGGER_14          0xC0
+
+/* Interrupt identification register */
+#define SERIAL_IIR_NONE_PENDING         0x01
+#define SERIAL_IIR_ID_MASK              0x0E
+#define SERIAL_IIR_MODEM_STATUS         0x00
+#define SERIAL_IIR_TX_EMPTY             0x02
+#define SERIAL_IIR_RX_AVAILABLE         0x04
+#define SERIAL_IIR_LINE_STATUS          0x06
+#define SERIAL_IIR_RX_TIMEOUT           0x0C
+
+/* Modem control: DTR and RTS, plus OUT2, which gates the UART's
+ * interrupt line on PC hardware */
+#define SERIAL_MCR_DTR_RTS_OUT2         0x0B
+
+/* Line status register */
+#define SERIAL_LSR_DATA_READY           0x01
+#define SERIAL_LSR_TX_EMPTY             0x20
+
+/* Bytes the transmit FIFO takes at once */
+#define SERIAL_TX_FIFO_SIZE             16
+
+/* Divisor of the 115200 baud base clock: run at the full rate, the trace
+ * stream needs it */
+#define SERIAL_DEFAULT_DIVISOR          1
+
 void serial_configure_baud_rate(unsigned short com, unsigned short divisor);
 void serial_configure_line(unsigned short com);
 
@@ -24,6 +69,39 @@ void serial_configure_line(unsigned short com);
   */
 int serial_is_transmit_fifo_empty(unsigned int com);
 
+/** init_serial:
+ *  Configures COM1 once: baud rate, 8N1, FIFOs on with a 14 byte receive
+ *  trigger, and interrupts on IRQ4 for received data and an empty
+ *  transmitter.
+ */
+void init_serial();
+
+/** serial_write:
+ *  Queues len bytes for COM1 and returns without waiting for them to be
+ *  sent; the IRQ4 handler feeds them to the FIFO 16 at a time. Only if the
+ *  queue is full does the caller wait, moving bytes to the FIFO itself.
+ *  Before init_serial, writes directly.
+ */
 void serial_write(char *buf, unsigned int len);
 
+/** serial_flush:
+ *  Waits until everything queued has been sent, polling the UART. Works
+ *  with interrupts disabled.
+ */
+void serial_flush();
+
+/** serial_panic:
+ *  For error(): sends what is queued, if no one holds the queue, then
+ *  makes serial_write write directly, without the queue or its lock.
+ */
+void serial_panic();
+
+/** serial_read:
+ *  Copies up to len received bytes into buf without waiting. Only one
+ *  reader at a time.
+ *
+ *  @return The number of bytes copied
+ */
+unsigned int serial_read(char *buf, unsigned int len);
+
 #endif
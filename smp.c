@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "smp.h"
+#include "descriptor_tables.h"
+#include "lapic.h"
+#include "timer.h"
+#include "paging.h"
+#include "kheap.h"
+#include "string.h"
+#include "cpu.h"
+#include "atomic.h"
+#include "executor.h"
+#include "klog.h"
+#include "compiler.h"
+#include "bios.h"
+
+// MP floating pointer structure (MultiProcessor Specification 1.4, 4.1)
+struct mp_floating_pointer {
+  char signature[4];          // "_MP_"
+  uint32_t config_table;      // physical address of the configuration table
+  uint8_t length;             // in 16 byte units
+  uint8_t spec_rev;
+  uint8_t checksum;
+  uint8_t features[5];
+} __attribute__((packed));
+
+// MP configuration table header (4.2)
+struct mp_config_table {
+  char signature[4];          // "PCMP"
+  uint16_t base_length;
+  uint8_t spec_rev;
+  uint8_t checksum;
+  char oem_id[8];
+  char product_id[12];
+  uint32_t oem_table;
+  uint16_t oem_table_size;
+  uint16_t entry_count;
+  uint32_t lapic_address;
+  uint16_t extended_length;
+  uint8_t extended_checksum;
+  uint8_t reserved;
+} __attribute__((packed));
+
+// Processor entry (4.3.1). Every other entry type is 8 bytes long.
+struct mp_processor_entry {
+  uint8_t type;
+  uint8_t lapic_id;
+  uint8_t lapic_version;
+  uint8_t flags;
+  uint32_t signature;
+  uint32_t features;
+  uint32_t reserved[2];
+} __attribute__((packed));
+
+#define MP_ENTRY_PROCESSOR      0
+#define MP_ENTRY_OTHER_SIZE     8
+#define MP_PROCESSOR_ENABLED    0x1
+#define MP_PROCESSOR_BSP        0x2
+
+// How long to wait for an AP to show up after the startup IPIs.
+#define AP_STARTUP_TIMEOUT_US   100000
+
+// Defined in trampoline.s
+extern uint8_t trampoline_start[];
+extern uint8_t trampoline_end[];
+extern uint8_t trampoline_cr3[];
+extern uint8_t trampoline_stacks[];
+extern uint8_t trampoline_next_cpu[];
+extern uint8_t trampoline_max_cpus[];
+
+// Where a trampoline data field ends up once copied to TRAMPOLINE_BASE.
+#define TRAMPOLINE_FIELD(sym) \
+  ((volatile uint32_t *)(TRAMPOLINE_BASE + ((uint32_t)(sym) - (uint32_t)trampoline_start)))
+
+extern page_directory_t *kernel_directory;
+
+struct cpu cpus[MAX_CPUS];
+volatile uint32_t cpus_online = 1;
+
+// Indexed by CPU number; read by the trampoline.
+static uint32_t ap_stack_tops[MAX_CPUS];
+
+// Settles, for the AP being started, whether it came up in time: the AP
+// moves it from AP_WAITING to AP_ARRIVED in ap_entry, or start_ap moves
+// it to AP_ABANDONED when it gives up. Whoever gets there first wins.
+#define AP_WAITING    0
+#define AP_ARRIVED    1
+#define AP_ABANDONED  2
+static volatile uint32_t ap_state;
+
+static bool has_signature(const char *p, const char *sig) {
+  return p[0] == sig[0] && p[1] == sig[1] && p[2] == sig[2] && p[3] == sig[3];
+}
+
+static uint8_t checksum(const uint8_t *p, uint32_t len) {
+  uint8_t sum = 0;
+  while (len--)
+    sum += *p++;
+  return sum;
+}
+
+static struct mp_floating_pointer * __init mp_scan(uint32_t start, uint32_t length) {
+  uint32_t addr;
+  for (addr = start; addr < start + length; addr += 16) {
+    struct mp_floating_pointer *mp = (struct mp_floating_pointer *)addr;
+    if (has_signature(mp->signature, "_MP_") &&
+        checksum((uint8_t *)mp, mp->length * 16) == 0)
+      return mp;
+  }
+  return 0;
+}
+
+// The floating pointer lives in the first KB of the EBDA, the last KB of
+// base memory, or the BIOS ROM.
+static struct mp_floating_pointer * __init mp_find() {
+  struct mp_floating_pointer *mp;
+  uint32_t ebda = (uint32_t)bda_read16(BDA_EBDA_SEGMENT) << 4;
+  if (ebda && (mp = mp_scan(ebda, 1024)))
+    return mp;
+  uint32_t base_top = (uint32_t)bda_read16(BDA_BASE_MEMORY_KB) * 1024;
+  if (base_top && (mp = mp_scan(base_top - 1024, 1024)))
+    return mp;
+  return mp_scan(0xF0000, 0x10000);
+}
+
+// Called by trampoline.s, on the stack from ap_stack_tops[cpu].
+void ap_entry(uint32_t cpu) {
+  // Too late: start_ap is about to park this CPU with an INIT, and the
+  // __init code below may be gone by then.
+  if (atomic_cmpxchg(&ap_state, AP_WAITING, AP_ARRIVED) != AP_WAITING) {
+    for (;;)
+      asm volatile("cli; hlt" ::: "memory");
+  }
+
+  init_ap_descriptor_tables(cpu);
+  init_lapic_ap();
+  // memcpy and friends may use SSE on every CPU if the BSP has it.
+  cpu_enable_sse();
+
+  struct cpu *self = this_cpu();
+  self->apic_id = lapic_id();
+  self->stack_top = ap_stack_tops[cpu];
+  self->online = true;
+  atomic_inc(&cpus_online);
+
+  // Sleeps until there are tasks to run.
+  executor_worker();
+}
+
+// INIT-SIPI-SIPI (Intel Manual Vol. 3A, 8.4.4.1)
+static bool __init start_ap(uint8_t apic_id) {
+  uint32_t expected = cpus_online + 1;
+  ap_state = AP_WAITING;
+
+  lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL_ASSERT);
+  timer_udelay(10000);
+
+  int i;
+  for (i = 0; i < 2 && cpus_online < expected; i++) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+    timer_udelay(200);
+  }
+
+  uint32_t waited;
+  for (waited = 0; waited < AP_STARTUP_TIMEOUT_US && cpus_online < expected; waited += 100)
+    timer_udelay(100);
+  if (cpus_online >= expected)
+    return true;
+
+  // Once kmain returns, free_init_memory takes away the trampoline and the
+  // __init code, so an AP that is still on its way must not get any
+  // further. INIT stops it wherever it is and leaves it waiting for a
+  // SIPI, which only ever comes to the APIC ID it is sent to.
+  if (atomic_cmpxchg(&ap_state, AP_WAITING, AP_ABANDONED) == AP_WAITING) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL_ASSERT);
+    timer_udelay(10000);
+    // It may have taken a CPU number in the trampoline already. Hand that
+    // out again, so that CPU numbers stay 0 to cpus_online - 1, which the
+    // executor and the trace rings count on.
+    *TRAMPOLINE_FIELD(trampoline_next_cpu) = cpus_online;
+    return false;
+  }
+  // It got to ap_entry just now, and has the rest of the way to go.
+  while (cpus_online < expected)
+    cpu_relax();
+  return true;
+}
+
+void __init init_smp() {
+  if (!lapic_present())
+    return;
+
+  cpus[0].apic_id = lapic_id();
+  cpus[0].online = true;
+
+  struct mp_floating_pointer *mp = mp_find();
+  if (!mp || !mp->config_table)
+    return;
+  struct mp_config_table *table = (struct mp_config_table *)mp->config_table;
+  if (!has_signature(table->signature, "PCMP"))
+    return;
+
+  // Allocate every AP stack up front: the trampoline hands out CPU numbers
+  // itself.
+  uint32_t cpu;
+  for (cpu = 1; cpu < MAX_CPUS; cpu++)
+    ap_stack_tops[cpu] = kmalloc_a(AP_STACK_SIZE) + AP_STACK_SIZE;
+
+  memmove((void *)TRAMPOLINE_BASE, trampoline_start, trampoline_end - trampoline_start);
+  *TRAMPOLINE_FIELD(trampoline_cr3) = (uint32_t)&kernel_directory->page_tables_physical;
+  *TRAMPOLINE_FIELD(trampoline_stacks) = (uint32_t)ap_stack_tops;
+  *TRAMPOLINE_FIELD(trampoline_next_cpu) = 1;
+  *TRAMPOLINE_FIELD(trampoline_max_cpus) = MAX_CPUS;
+
+  uint8_t *entry = (uint8_t *)(table + 1);
+  uint32_t i;
+  for (i = 0; i < table->entry_count; i++) {
+    if (*entry != MP_ENTRY_PROCESSOR) {
+      entry += MP_ENTRY_OTHER_SIZE;
+      continue;
+    }
+    struct mp_processor_entry *proc = (struct mp_processor_entry *)entry;
+    entry += sizeof(struct mp_processor_entry);
+
+    if (!(proc->flags & MP_PROCESSOR_ENABLED) || (proc->flags & MP_PROCESSOR_BSP))
+      continue;
+    if (proc->lapic_id == cpus[0].apic_id || cpus_online >= MAX_CPUS)
+      continue;
+    if (!start_ap(proc->lapic_id))
+      klog(KLOG_WARN, "SMP: CPU with APIC ID %d did not start in time", proc->lapic_id);
+  }
+}
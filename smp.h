@@ -0,0 +1,57 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_CPUS              8
+
+// Where the AP startup code is copied. Must be page aligned and below 1MB;
+// the startup IPI passes it as a page number. GRUB legacy loads stage2
+// here, so anything the bootloader left in low memory is gone after
+// init_smp.
+#define TRAMPOLINE_BASE       0x8000
+
+#define AP_STACK_SIZE         0x2000
+
+struct thread;
+
+/**
+ * Per-CPU data. Each CPU's GDT has a segment covering its own struct cpu,
+ * and gs holds its selector, so this_cpu() is a single gs-relative load.
+ * Aligned to a cache line so that CPUs don't false-share.
+ */
+struct cpu {
+  struct cpu *self;             // must stay first (see this_cpu)
+  uint32_t id;                  // 0 is the bootstrap processor
+  uint8_t apic_id;
+  volatile bool online;
+  uint32_t stack_top;
+  struct thread *current;       // the running thread (see thread.c)
+  volatile uint32_t softirq_pending;
+  volatile bool in_softirq;
+} __attribute__((aligned(64)));
+
+extern struct cpu cpus[MAX_CPUS];
+
+/* The number of CPUs running, including the BSP. */
+extern volatile uint32_t cpus_online;
+
+static inline struct cpu *this_cpu() {
+  struct cpu *cpu;
+  asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+/**
+ * init_smp:
+ * Finds the application processors in the MP configuration table and
+ * starts them one at a time with INIT-SIPI-SIPI. Each AP sets up its own
+ * GDT, per-CPU segment and local APIC, then idles in the task executor's
+ * worker loop. An AP that hasn't checked in after 100 ms is sent an INIT
+ * and left waiting, as the trampoline and the AP setup code are freed
+ * along with the rest of boot. Requires init_timer.
+ */
+void init_smp();
+
+#endif
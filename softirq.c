@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "softirq.h"
+#include "smp.h"
+#include "atomic.h"
+#include "trace.h"
+#include "compiler.h"
+
+// Give up after this many rounds, so a softirq that keeps raising
+// itself can't starve the interrupted code forever.
+#define MAX_SOFTIRQ_RESTART 10
+
+static softirq_handler_t softirq_handlers[NR_SOFTIRQS];
+
+void open_softirq(uint32_t nr, softirq_handler_t handler) {
+  softirq_handlers[nr] = handler;
+}
+
+// Softirqs are per CPU: they run on the CPU that raised them.
+void raise_softirq(uint32_t nr) {
+  atomic_or(&this_cpu()->softirq_pending, 1 << nr);
+}
+
+bool softirq_active() {
+  return this_cpu()->in_softirq;
+}
+
+void __hot do_softirq() {
+  struct cpu *cpu = this_cpu();
+  if (cpu->in_softirq || !cpu->softirq_pending)
+    return;
+  cpu->in_softirq = true;
+
+  int restart = MAX_SOFTIRQ_RESTART;
+  uint32_t pending;
+  while ((pending = cpu->softirq_pending) && restart--) {
+    cpu->softirq_pending = 0;
+    trace1(TRACE_SOFTIRQ_ENTER, pending);
+    asm volatile("sti" ::: "memory");
+    uint32_t nr;
+    for (nr = 0; nr < NR_SOFTIRQS; nr++) {
+      if ((pending & (1 << nr)) && softirq_handlers[nr])
+        softirq_handlers[nr]();
+    }
+    asm volatile("cli" ::: "memory");
+    trace1(TRACE_SOFTIRQ_EXIT, pending);
+  }
+
+  cpu->in_softirq = false;
+}
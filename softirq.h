@@ -0,0 +1,35 @@
+#ifndef __SOFTIRQ_H__
+#define __SOFTIRQ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Softirqs are the bottom halves of interrupt handlers. A hard IRQ handler
+ * raises one, and it runs once the handler is done, with interrupts enabled
+ * again, before we return to the interrupted code.
+ */
+enum {
+  TIMER_SOFTIRQ,
+  KEYBOARD_SOFTIRQ,
+  NR_SOFTIRQS
+};
+
+typedef void (*softirq_handler_t)();
+
+void open_softirq(uint32_t nr, softirq_handler_t handler);
+
+/* Marks a softirq pending. Safe to call from any context. */
+void raise_softirq(uint32_t nr);
+
+/**
+ * do_softirq:
+ * Runs pending softirqs. Called with interrupts disabled on the way out of
+ * irq_handler; does nothing if we interrupted a softirq already running.
+ */
+void do_softirq();
+
+/* True while softirqs are running (possibly interrupted by a hard IRQ). */
+bool softirq_active();
+
+#endif
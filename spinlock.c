@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spinlock.h"
+#include "atomic.h"
+#include "cpu.h"
+#include "string.h"
+#include "klog.h"
+#include "compiler.h"
+
+#define TICKET_NEXT_SHIFT 16
+
+#ifdef LOCK_STATS
+
+// Every lock that has been taken at least once, newest first.
+static struct lock_stats *volatile registered_locks = 0;
+
+static void stats_register(struct lock_stats *stats, const char *name) {
+  if (stats->registered || atomic_xchg(&stats->registered, 1))
+    return;
+  stats->name = name;
+  struct lock_stats *head;
+  do {
+    head = registered_locks;
+    stats->next = head;
+  } while (atomic_cmpxchg((volatile uint32_t *)&registered_locks,
+                          (uint32_t)head, (uint32_t)stats) != (uint32_t)head);
+}
+
+// Called with the lock held, so the counters need no atomics.
+static void stats_acquired(struct lock_stats *stats, const char *name,
+                           uint64_t wait_start) {
+  uint64_t now = rdtsc();
+  stats_register(stats, name);
+  stats->acquisitions++;
+  if (wait_start) {
+    stats->contended++;
+    stats->wait_cycles += now - wait_start;
+  }
+  stats->acquired_at = now;
+}
+
+static void stats_released(struct lock_stats *stats) {
+  uint64_t held = rdtsc() - stats->acquired_at;
+  stats->hold_cycles += held;
+  if (held > stats->max_hold_cycles)
+    stats->max_hold_cycles = held;
+}
+
+#define STATS_WAIT_START(wait_start) ((wait_start) ? (wait_start) : rdtsc())
+#define STATS_ACQUIRED(lock, wait_start) stats_acquired(&(lock)->stats, (lock)->name, wait_start)
+#define STATS_RELEASED(lock) stats_released(&(lock)->stats)
+
+#else
+
+#define STATS_WAIT_START(wait_start) 1
+#define STATS_ACQUIRED(lock, wait_start) ((void)(wait_start))
+#define STATS_RELEASED(lock)
+
+#endif
+
+// ---------------------------
+// Ticket spinlocks
+// ---------------------------
+
+void spin_lock_init(spinlock_t *lock, const char *name) {
+  spinlock_t init = SPINLOCK_INIT(name);
+  *lock = init;
+}
+
+void __hot spin_lock(spinlock_t *lock) {
+  uint32_t tickets = atomic_xadd(&lock->tickets, 1 << TICKET_NEXT_SHIFT);
+  uint16_t ticket = tickets >> TICKET_NEXT_SHIFT;
+  uint64_t wait_start = 0;
+
+  if ((uint16_t)tickets != ticket) {
+    wait_start = STATS_WAIT_START(wait_start);
+    while (lock->owner != ticket)
+      cpu_relax();
+  }
+  barrier();
+  STATS_ACQUIRED(lock, wait_start);
+}
+
+void __hot spin_unlock(spinlock_t *lock) {
+  STATS_RELEASED(lock);
+  barrier();
+  // Only the holder writes owner, and a locked xadd on the whole word
+  // can't change it, so a plain increment is enough.
+  lock->owner++;
+}
+
+bool spin_trylock(spinlock_t *lock) {
+  uint32_t tickets = lock->tickets;
+  uint16_t owner = tickets;
+  if (owner != (uint16_t)(tickets >> TICKET_NEXT_SHIFT))
+    return false;
+  uint32_t taken = tickets + (1 << TICKET_NEXT_SHIFT);
+  if (atomic_cmpxchg(&lock->tickets, tickets, taken) != tickets)
+    return false;
+  STATS_ACQUIRED(lock, 0);
+  return true;
+}
+
+bool spin_is_locked(spinlock_t *lock) {
+  uint32_t tickets = lock->tickets;
+  return (uint16_t)tickets != (uint16_t)(tickets >> TICKET_NEXT_SHIFT);
+}
+
+uint32_t __hot spin_lock_irqsave(spinlock_t *lock) {
+  uint32_t flags = irq_save();
+  spin_lock(lock);
+  return flags;
+}
+
+void __hot spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+  spin_unlock(lock);
+  irq_restore(flags);
+}
+
+// ---------------------------
+// Reader-writer spinlocks
+// ---------------------------
+
+void rwlock_init(rwlock_t *lock, const char *name) {
+  rwlock_t init = RWLOCK_INIT(name);
+  *lock = init;
+}
+
+void read_lock(rwlock_t *lock) {
+  uint64_t wait_start = 0;
+  // Take a reader slot; if a writer holds the bias, give it back and
+  // wait for the writer to leave before trying again.
+  while ((int32_t)atomic_xadd(&lock->count, -1) <= 0) {
+    atomic_inc(&lock->count);
+    wait_start = STATS_WAIT_START(wait_start);
+    while ((int32_t)lock->count <= 0)
+      cpu_relax();
+  }
+#ifdef LOCK_STATS
+  // Readers share the lock, so only count them; hold times are tracked
+  // for writers.
+  stats_register(&lock->stats, lock->name);
+  atomic_inc(&lock->stats.acquisitions);
+  if (wait_start)
+    atomic_inc(&lock->stats.contended);
+#else
+  (void)wait_start;
+#endif
+}
+
+void read_unlock(rwlock_t *lock) {
+  atomic_inc(&lock->count);
+}
+
+void write_lock(rwlock_t *lock) {
+  uint64_t wait_start = 0;
+  while (atomic_xadd(&lock->count, -RW_LOCK_BIAS) != RW_LOCK_BIAS) {
+    atomic_add(&lock->count, RW_LOCK_BIAS);
+    wait_start = STATS_WAIT_START(wait_start);
+    while (lock->count != RW_LOCK_BIAS)
+      cpu_relax();
+  }
+  STATS_ACQUIRED(lock, wait_start);
+}
+
+void write_unlock(rwlock_t *lock) {
+  STATS_RELEASED(lock);
+  atomic_add(&lock->count, RW_LOCK_BIAS);
+}
+
+uint32_t read_lock_irqsave(rwlock_t *lock) {
+  uint32_t flags = irq_save();
+  read_lock(lock);
+  return flags;
+}
+
+void read_unlock_irqrestore(rwlock_t *lock, uint32_t flags) {
+  read_unlock(lock);
+  irq_restore(flags);
+}
+
+uint32_t write_lock_irqsave(rwlock_t *lock) {
+  uint32_t flags = irq_save();
+  write_lock(lock);
+  return flags;
+}
+
+void write_unlock_irqrestore(rwlock_t *lock, uint32_t flags) {
+  write_unlock(lock);
+  irq_restore(flags);
+}
+
+#ifdef LOCK_STATS
+
+static uint32_t average(uint64_t total, uint32_t count) {
+  return count ? (uint32_t)div64_32(total, count, NULL) : 0;
+}
+
+void __cold lock_stats_dump() {
+  klog(KLOG_INFO, "lock              acquired  contended  avg wait  avg hold  max hold (cycles)");
+
+  // Selection by total wait time, without sorting the list itself. last
+  // bounds each pass so every lock is printed once.
+  uint64_t last = (uint64_t)-1;
+  struct lock_stats *last_printed = 0;
+  for (;;) {
+    struct lock_stats *best = 0;
+    struct lock_stats *s;
+    bool seen_last = false;
+    for (s = registered_locks; s; s = s->next) {
+      if (s == last_printed) {
+        seen_last = true;
+        continue;
+      }
+      // Locks with the same wait time as the last one printed come
+      // after it in the list, so ties are broken by list position.
+      if (s->wait_cycles > last || (s->wait_cycles == last && !seen_last))
+        continue;
+      if (!best || s->wait_cycles > best->wait_cycles)
+        best = s;
+    }
+    if (!best)
+      break;
+
+    klog(KLOG_INFO, "%-16s%10u%11u%10u%10u%10u", best->name ? best->name : "?",
+           best->acquisitions, best->contended,
+           average(best->wait_cycles, best->contended),
+           average(best->hold_cycles, best->acquisitions),
+           (uint32_t)best->max_hold_cycles);
+    last = best->wait_cycles;
+    last_printed = best;
+  }
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef LOCK_STATS
+/**
+ * Per-lock profiling counters, compiled in with make DEFINES=-DLOCK_STATS.
+ * Times are in TSC cycles. A lock joins the list lock_stats_dump walks
+ * the first time it is taken.
+ */
+struct lock_stats {
+  struct lock_stats *next;
+  const char *name;
+  volatile uint32_t registered;
+  uint32_t acquisitions;
+  uint32_t contended;           // acquisitions that had to wait
+  uint64_t wait_cycles;
+  uint64_t hold_cycles;
+  uint64_t max_hold_cycles;
+  uint64_t acquired_at;
+};
+#define LOCK_STATS_INIT , .stats = { 0 }
+#else
+#define LOCK_STATS_INIT
+#endif
+
+/**
+ * A ticket spinlock. Each CPU takes the next ticket and waits for owner
+ * to reach it, so CPUs get the lock in the order they asked for it.
+ * Holding a spinlock does not disable interrupts: anything an interrupt
+ * handler also takes must be locked with spin_lock_irqsave.
+ */
+typedef struct spinlock {
+  union {
+    volatile uint32_t tickets;
+    struct {
+      volatile uint16_t owner;  // the ticket being served
+      volatile uint16_t next;   // the next ticket to hand out
+    };
+  };
+  const char *name;
+#ifdef LOCK_STATS
+  struct lock_stats stats;
+#endif
+} spinlock_t;
+
+#define SPINLOCK_INIT(lock_name) { .tickets = 0, .name = (lock_name) LOCK_STATS_INIT }
+
+void spin_lock_init(spinlock_t *lock, const char *name);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+
+/* Takes the lock only if nobody holds it or waits for it. */
+bool spin_trylock(spinlock_t *lock);
+
+/* True if the lock is held. Only useful for assertions. */
+bool spin_is_locked(spinlock_t *lock);
+
+/**
+ * spin_lock_irqsave/spin_unlock_irqrestore:
+ * Disables interrupts on this CPU, then takes the lock, so an interrupt
+ * handler on the same CPU can't deadlock against the holder.
+ */
+uint32_t spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags);
+
+// Readers add one to count, a writer takes the whole bias.
+#define RW_LOCK_BIAS 0x01000000
+
+/**
+ * A reader-writer spinlock. Any number of readers can hold it at once, or
+ * a single writer. Readers are favoured: a steady stream of them will
+ * keep a writer waiting.
+ */
+typedef struct rwlock {
+  volatile uint32_t count;      // RW_LOCK_BIAS minus the number of readers
+  const char *name;
+#ifdef LOCK_STATS
+  struct lock_stats stats;
+#endif
+} rwlock_t;
+
+#define RWLOCK_INIT(lock_name) { .count = RW_LOCK_BIAS, .name = (lock_name) LOCK_STATS_INIT }
+
+void rwlock_init(rwlock_t *lock, const char *name);
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+
+uint32_t read_lock_irqsave(rwlock_t *lock);
+void read_unlock_irqrestore(rwlock_t *lock, uint32_t flags);
+uint32_t write_lock_irqsave(rwlock_t *lock);
+void write_unlock_irqrestore(rwlock_t *lock, uint32_t flags);
+
+#ifdef LOCK_STATS
+/**
+ * lock_stats_dump:
+ * Prints the counters of every lock taken so far, the locks CPUs spent
+ * the longest waiting for first.
+ */
+void lock_stats_dump();
+#endif
+
+#endif
@@ -1,103 +1,658 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include "string.h"
 #include "framebuffer.h"
+#include "cpu.h"
+#include "klog.h"
+#include "compiler.h"
+#ifdef BENCHMARK
+#include "kheap.h"
+#include "bench.h"
+#endif
+
+// "00" to "99", so that decimal conversion takes two digits per division.
+static const char digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+static const uint32_t powers_of_10[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+static uint32_t count_digits10(uint32_t v) {
+  uint32_t n = 1;
+  while (n < 10 && v >= powers_of_10[n])
+    n++;
+  return n;
+}
+
+// Writes the last n decimal digits of v, padded with zeroes, so that they
+// end at end.
+static void put_digits10(char *end, uint32_t v, uint32_t n) {
+  while (n >= 2) {
+    uint32_t pair = v % 100;
+    v /= 100;
+    end -= 2;
+    end[0] = digit_pairs[pair * 2];
+    end[1] = digit_pairs[pair * 2 + 1];
+    n -= 2;
+  }
+  if (n)
+    *--end = '0' + v % 10;
+}
+
+uint32_t utoa10(uint64_t val, char *buf) {
+  uint32_t len;
+  if (!(val >> 32)) {
+    len = count_digits10(val);
+    put_digits10(buf + len, val, len);
+  } else {
+    // Split into 9 digit parts, so that the rest is 32-bit arithmetic:
+    // 2^64 has 20 digits, so there are at most three parts.
+    uint32_t low, mid;
+    uint64_t high = div64_32(val, powers_of_10[9], &low);
+    if (high >> 32) {
+      uint32_t top = div64_32(high, powers_of_10[9], &mid);
+      len = count_digits10(top);
+      put_digits10(buf + len, top, len);
+      put_digits10(buf + len + 9, mid, 9);
+      len += 9;
+    } else {
+      len = count_digits10(high);
+      put_digits10(buf + len, high, len);
+    }
+    put_digits10(buf + len + 9, low, 9);
+    len += 9;
+  }
+  buf[len] = 0;
+  return len;
+}
+
+uint32_t utoa16(uint64_t val, char *buf, bool upper) {
+  const char *digits = upper ? hex_upper : hex_lower;
+  uint32_t high = val >> 32;
+  uint32_t bits = high ? 64 - __builtin_clz(high) : 32 - __builtin_clz((uint32_t)val | 1);
+  uint32_t len = (bits + 3) / 4;
+  uint32_t low = val;
+  char *p = buf + len;
+  uint32_t i;
+  for (i = 0; i < len && i < 8; i++) {
+    *--p = digits[low & 0xF];
+    low >>= 4;
+  }
+  for (; i < len; i++) {
+    *--p = digits[high & 0xF];
+    high >>= 4;
+  }
+  buf[len] = 0;
+  return len;
+}
+
+// Any other radix, one division per digit.
+static uint32_t utoa_radix(uint32_t val, char *buf, uint32_t radix) {
+  char tmp[32];
+  char *p = tmp + sizeof(tmp);
+  do {
+    *--p = hex_lower[val % radix];
+  } while (val /= radix);
+  uint32_t len = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, len);
+  buf[len] = 0;
+  return len;
+}
+
+char *uitoa(uint32_t val, char *buf, int radix) {
+  if (radix == 10) {
+    utoa10(val, buf);
+  } else if (radix == 16) {
+    buf[0] = '0';
+    buf[1] = 'x';
+    utoa16(val, buf + 2, false);
+  } else {
+    utoa_radix(val, buf, radix);
+  }
+  return buf;
+}
 
 char *itoa(int val, char *buf, int radix) {
-  uint32_t i = 0;
-  uint32_t start = i;
   if (val < 0 && radix == 10) {
-    buf[i++] = '-';
-    start = i;
+    // Negating in unsigned arithmetic works for INT_MIN too.
+    buf[0] = '-';
+    utoa10(-(uint32_t)val, buf + 1);
+    return buf;
+  }
+  // Other radices show the two's complement bits.
+  return uitoa(val, buf, radix);
+}
+
+// memcpy, memmove and memset pick an implementation once, in
+// init_memops: rep movsd/stosd works everywhere, SSE2 moves 64 bytes a
+// loop iteration, and on CPUs with ERMS (enhanced rep movsb/stosb) the
+// microcode does better than either. The kernel doesn't save SSE state
+// on interrupts or thread switches, so the SSE2 loops run with
+// interrupts disabled, a block at a time.
+struct mem_ops {
+  const char *name;
+  void (*copy)(void *dst, const void *src, size_t n);     // forwards
+  void (*set)(void *s, uint32_t pattern, size_t n);       // pattern is 4 copies of the byte
+};
+
+// Below this, the SSE2 variants use rep instead.
+#define MEM_SSE_MIN 128
+// Bytes copied or set per interrupts-off stretch.
+#define MEM_SSE_BLOCK 4096
+
+// The asm operands are pointer sized, so that tools/memtest.c can build
+// this file for the host too.
+static void copy_rep(void *dst, const void *src, size_t n) {
+  size_t d0;
+  void *d1;
+  const void *d2;
+  asm volatile("rep movsl\n\t"
+               "mov %4, %0\n\t"
+               "rep movsb"
+               : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+               : "0"(n / 4), "g"(n & 3), "1"(dst), "2"(src)
+               : "memory");
+}
+
+static void set_rep(void *s, uint32_t pattern, size_t n) {
+  size_t d0;
+  void *d1;
+  asm volatile("rep stosl\n\t"
+               "mov %3, %0\n\t"
+               "rep stosb"
+               : "=&c"(d0), "=&D"(d1)
+               : "a"(pattern), "g"(n & 3), "0"(n / 4), "1"(s)
+               : "memory");
+}
+
+static void copy_erms(void *dst, const void *src, size_t n) {
+  asm volatile("rep movsb"
+               : "+c"(n), "+D"(dst), "+S"(src)
+               :: "memory");
+}
+
+static void set_erms(void *s, uint32_t pattern, size_t n) {
+  asm volatile("rep stosb"
+               : "+c"(n), "+D"(s)
+               : "a"(pattern)
+               : "memory");
+}
+
+// The SSE2 loops themselves. Only these are built for SSE2, so the
+// compiler can't put xmm registers to use anywhere else, and they are
+// only called with interrupts off.
+
+// Copies bytes (a multiple of 64) to a 16 byte aligned d.
+__attribute__((target("sse2")))
+static void copy64_sse2(char *d, const char *s, size_t bytes) {
+  asm volatile("1:\n\t"
+               "movdqu (%1), %%xmm0\n\t"
+               "movdqu 16(%1), %%xmm1\n\t"
+               "movdqu 32(%1), %%xmm2\n\t"
+               "movdqu 48(%1), %%xmm3\n\t"
+               "movdqa %%xmm0, (%0)\n\t"
+               "movdqa %%xmm1, 16(%0)\n\t"
+               "movdqa %%xmm2, 32(%0)\n\t"
+               "movdqa %%xmm3, 48(%0)\n\t"
+               "add $64, %1\n\t"
+               "add $64, %0\n\t"
+               "sub $64, %2\n\t"
+               "jnz 1b"
+               : "+r"(d), "+r"(s), "+r"(bytes)
+               :: "memory", "cc", "xmm0", "xmm1", "xmm2", "xmm3");
+}
+
+// Fills bytes (a multiple of 64) at a 16 byte aligned d.
+__attribute__((target("sse2")))
+static void set64_sse2(char *d, uint32_t pattern, size_t bytes) {
+  asm volatile("movd %2, %%xmm0\n\t"
+               "pshufd $0, %%xmm0, %%xmm0\n\t"
+               "1:\n\t"
+               "movdqa %%xmm0, (%0)\n\t"
+               "movdqa %%xmm0, 16(%0)\n\t"
+               "movdqa %%xmm0, 32(%0)\n\t"
+               "movdqa %%xmm0, 48(%0)\n\t"
+               "add $64, %0\n\t"
+               "sub $64, %1\n\t"
+               "jnz 1b"
+               : "+r"(d), "+r"(bytes)
+               : "r"(pattern)
+               : "memory", "cc", "xmm0");
+}
+
+// Looks for the low byte of pattern in up to blocks 16 byte blocks from a
+// 16 byte aligned *p. Leaves *p at the block it stopped in and returns the
+// match bitmask for it, 0 if there was no match.
+__attribute__((target("sse2")))
+static uint32_t find16_sse2(const char **p, uint32_t pattern, size_t blocks) {
+  uint32_t mask;
+  asm volatile("movd %3, %%xmm0\n\t"
+               "pshufd $0, %%xmm0, %%xmm0\n\t"
+               "1:\n\t"
+               "movdqa (%0), %%xmm1\n\t"
+               "pcmpeqb %%xmm0, %%xmm1\n\t"
+               "pmovmskb %%xmm1, %2\n\t"
+               "test %2, %2\n\t"
+               "jnz 2f\n\t"
+               "add $16, %0\n\t"
+               "sub $1, %1\n\t"
+               "jnz 1b\n"
+               "2:"
+               : "+r"(*p), "+r"(blocks), "=&r"(mask)
+               : "r"(pattern)
+               : "cc", "memory", "xmm0", "xmm1");
+  return mask;
+}
+
+// Compares up to blocks 16 byte blocks. Leaves *a and *b at the block
+// they stopped in and returns a bitmask of the bytes that differ there.
+__attribute__((target("sse2")))
+static uint32_t cmp16_sse2(const unsigned char **a, const unsigned char **b, size_t blocks) {
+  uint32_t mask;
+  asm volatile("1:\n\t"
+               "movdqu (%0), %%xmm0\n\t"
+               "movdqu (%1), %%xmm1\n\t"
+               "pcmpeqb %%xmm1, %%xmm0\n\t"
+               "pmovmskb %%xmm0, %3\n\t"
+               "xor $0xffff, %3\n\t"
+               "jnz 2f\n\t"
+               "add $16, %0\n\t"
+               "add $16, %1\n\t"
+               "sub $1, %2\n\t"
+               "jnz 1b\n"
+               "2:"
+               : "+r"(*a), "+r"(*b), "+r"(blocks), "=&r"(mask)
+               :: "cc", "memory", "xmm0", "xmm1");
+  return mask;
+}
+
+static void copy_sse2(void *dst, const void *src, size_t n) {
+  if (n < MEM_SSE_MIN) {
+    copy_rep(dst, src, n);
+    return;
   }
+  // Line the destination up so the stores can be aligned ones.
+  size_t head = -(uintptr_t)dst & 15;
+  copy_rep(dst, src, head);
+  char *d = (char *)dst + head;
+  const char *s = (const char *)src + head;
+  n -= head;
 
-  if (radix == 16) {
-    buf[i++] = '0';
-    buf[i++] = 'x';
-    start = i;
+  while (n >= 64) {
+    size_t block = n < MEM_SSE_BLOCK ? (n & ~(size_t)63) : MEM_SSE_BLOCK;
+    uint32_t flags = irq_save();
+    copy64_sse2(d, s, block);
+    irq_restore(flags);
+    d += block;
+    s += block;
+    n -= block;
   }
+  copy_rep(d, s, n);
+}
 
-  int x = val;
-  do {
-    int a = x % radix;
-    if (a < 10) buf[i++] = a + '0';
-    else buf[i++] = a + 'a' - 10;
-  } while (x /= radix);
+static void set_sse2(void *dst, uint32_t pattern, size_t n) {
+  if (n < MEM_SSE_MIN) {
+    set_rep(dst, pattern, n);
+    return;
+  }
+  size_t head = -(uintptr_t)dst & 15;
+  set_rep(dst, pattern, head);
+  char *d = (char *)dst + head;
+  n -= head;
+
+  while (n >= 64) {
+    size_t block = n < MEM_SSE_BLOCK ? (n & ~(size_t)63) : MEM_SSE_BLOCK;
+    uint32_t flags = irq_save();
+    set64_sse2(d, pattern, block);
+    irq_restore(flags);
+    d += block;
+    n -= block;
+  }
+  set_rep(d, pattern, n);
+}
 
-  char *s = buf+start;
-  char *e = buf+(i-1);
+static const struct mem_ops mem_ops_rep = { "rep movsd", &copy_rep, &set_rep };
+static const struct mem_ops mem_ops_sse2 = { "sse2", &copy_sse2, &set_sse2 };
+static const struct mem_ops mem_ops_erms = { "erms", &copy_erms, &set_erms };
 
-  while(s < e) {
-    char t = *s;
-    *s = *e;
-    *e = t;
-    s++; e--;
+// Until init_memops, the variant every CPU has.
+static const struct mem_ops *mem_ops = &mem_ops_rep;
+
+// Copies from the end down, for moves to a higher address that overlap.
+static void copy_backward(void *dst, const void *src, size_t n) {
+  size_t d0;
+  void *d1;
+  const void *d2;
+  if (n < 4) {
+    while (n--)
+      ((char *)dst)[n] = ((const char *)src)[n];
+    return;
   }
+  // The dwords go from the top down; the n & 3 bytes left over are then
+  // the lowest ones, just below where esi and edi point. An interrupt in
+  // the middle is fine: the interrupt stubs clear DF for their handlers.
+  asm volatile("std\n\t"
+               "rep movsl\n\t"
+               "mov %4, %0\n\t"
+               "add $3, %2\n\t"
+               "add $3, %1\n\t"
+               "rep movsb\n\t"
+               "cld"
+               : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+               : "0"(n / 4), "g"(n & 3),
+                 "1"((char *)dst + n - 4), "2"((const char *)src + n - 4)
+               : "memory");
+}
 
-  buf[i] = 0;
-  return buf;
+void __hot *memcpy(void *dst, const void *src, size_t n) {
+  mem_ops->copy(dst, src, n);
+  return dst;
 }
 
-char *uitoa(uint32_t val, char *buf, int radix) {
-  uint32_t i = 0;
-  uint32_t start = i;
+void __hot *memmove(void *dst, const void *src, size_t n) {
+  // A forward copy is only wrong if it would overwrite source bytes
+  // before reading them.
+  if ((uintptr_t)dst - (uintptr_t)src >= n)
+    mem_ops->copy(dst, src, n);
+  else
+    copy_backward(dst, src, n);
+  return dst;
+}
+
+void __hot *memset(void *s, int c, size_t n) {
+  mem_ops->set(s, (uint8_t)c * 0x01010101u, n);
+  return s;
+}
+
+// The string and compare routines read a 32-bit word at a time. A word
+// has a zero byte iff has_zero(word) is non-zero, and XORing with a
+// repeated byte turns matches for that byte into zero bytes. Scans that
+// don't know where the string ends only read aligned words (or, for
+// SSE2, aligned 16 byte blocks), which never cross into a page the
+// string doesn't touch.
+typedef uint32_t __attribute__((may_alias)) word_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) uword_t;
+
+#define WORD_ONES 0x01010101u
+#define WORD_HIGHS 0x80808080u
+#define has_zero(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+struct str_ops {
+  const char *name;
+  size_t (*strlen)(const char *s);
+  void *(*memchr)(const void *s, int c, size_t n);
+  int (*memcmp)(const void *a, const void *b, size_t n);
+};
 
-  if (radix == 16) {
-    buf[i++] = '0';
-    buf[i++] = 'x';
-    start = i;
+static void *memchr_word(const void *s, int c, size_t n) {
+  const unsigned char *p = s;
+  uint8_t byte = c;
+  for (; n && ((uintptr_t)p & 3); n--, p++) {
+    if (*p == byte)
+      return (void *)p;
   }
+  uint32_t pattern = byte * WORD_ONES;
+  for (; n >= 4; n -= 4, p += 4) {
+    uint32_t w = *(const word_t *)p ^ pattern;
+    if (has_zero(w))
+      break;
+  }
+  for (; n; n--, p++) {
+    if (*p == byte)
+      return (void *)p;
+  }
+  return 0;
+}
 
-  uint32_t x = val;
-  do {
-    uint32_t a = x % radix;
-    if (a < 10) buf[i++] = a + '0';
-    else buf[i++] = a + 'a' - 10;
-  } while (x /= radix);
+static size_t strlen_word(const char *s) {
+  const char *p = s;
+  for (; (uintptr_t)p & 3; p++) {
+    if (!*p)
+      return p - s;
+  }
+  while (!has_zero(*(const word_t *)p))
+    p += 4;
+  while (*p)
+    p++;
+  return p - s;
+}
 
-  char *s = buf+start;
-  char *e = buf+(i-1);
+static int memcmp_word(const void *a, const void *b, size_t n) {
+  const unsigned char *pa = a, *pb = b;
+  // Unaligned loads are fine here: n bounds how far we read.
+  for (; n >= 4; n -= 4, pa += 4, pb += 4) {
+    if (*(const uword_t *)pa != *(const uword_t *)pb)
+      break;
+  }
+  for (; n; n--, pa++, pb++) {
+    if (*pa != *pb)
+      return *pa - *pb;
+  }
+  return 0;
+}
 
-  while(s < e) {
-    char t = *s;
-    *s = *e;
-    *e = t;
-    s++; e--;
+// Returns the first byte equal to the low byte of pattern, looking at
+// most blocks 16 byte blocks from p, which must be 16 byte aligned.
+static const char *find_sse2(const char *p, uint32_t pattern, size_t blocks) {
+  while (blocks) {
+    size_t chunk = blocks < MEM_SSE_BLOCK / 16 ? blocks : MEM_SSE_BLOCK / 16;
+    blocks -= chunk;
+    uint32_t flags = irq_save();
+    uint32_t mask = find16_sse2(&p, pattern, chunk);
+    irq_restore(flags);
+    if (mask)
+      return p + __builtin_ctz(mask);
   }
+  return 0;
+}
 
-  buf[i] = 0;
-  return buf;
+static size_t strlen_sse2(const char *s) {
+  // Short strings don't pay for turning interrupts off.
+  const char *end = memchr_word(s, 0, MEM_SSE_MIN);
+  if (end)
+    return end - s;
+  // The bytes before s + MEM_SSE_MIN are known not to be zero, so
+  // starting at the aligned block below it is fine.
+  const char *p = (const char *)((uintptr_t)(s + MEM_SSE_MIN) & ~(uintptr_t)15);
+  while (!(end = find_sse2(p, 0, MEM_SSE_BLOCK / 16)))
+    p += MEM_SSE_BLOCK;
+  return end - s;
 }
 
-size_t strlen(const char *buf) {
-  unsigned int i=0;
-  while(buf[i] != 0) i++;
-  return i;
+static void *memchr_sse2(const void *s, int c, size_t n) {
+  if (n < MEM_SSE_MIN)
+    return memchr_word(s, c, n);
+  const char *p = s;
+  size_t head = -(uintptr_t)p & 15;
+  void *found = memchr_word(p, c, head);
+  if (found)
+    return found;
+  p += head;
+  n -= head;
+  const char *match = find_sse2(p, (uint8_t)c * WORD_ONES, n / 16);
+  if (match)
+    return (void *)match;
+  return memchr_word(p + (n & ~(size_t)15), c, n & 15);
 }
 
-// Terribly naive implementation of memset to get things compiling
-// See http://www.xs-labs.com/en/blog/2013/08/06/optimising-memset/
-// for more details
-void *memset(void *s, int c, size_t n) {
-  char *mem = (char*)s;
-  size_t i;
-  for (i=0; i<n; i++) {
-    mem[i] = (uint8_t)c;
+static int memcmp_sse2(const void *a, const void *b, size_t n) {
+  if (n < MEM_SSE_MIN)
+    return memcmp_word(a, b, n);
+  const unsigned char *pa = a, *pb = b;
+  size_t blocks = n / 16;
+  while (blocks) {
+    size_t chunk = blocks < MEM_SSE_BLOCK / 16 ? blocks : MEM_SSE_BLOCK / 16;
+    blocks -= chunk;
+    uint32_t flags = irq_save();
+    uint32_t mask = cmp16_sse2(&pa, &pb, chunk);
+    irq_restore(flags);
+    if (mask) {
+      uint32_t i = __builtin_ctz(mask);
+      return pa[i] - pb[i];
+    }
   }
-  return s;
+  return memcmp_word(pa, pb, n & 15);
 }
 
-void *memmove(void *dst, const void *src, size_t len) {
-  char *dstmem = (char*)dst;
-  char *srcmem = (char*)src;
-  size_t i;
-  for (i=0; i<len; i++) {
-    dstmem[i] = srcmem[i];
+static const struct str_ops str_ops_word = { "word", &strlen_word, &memchr_word, &memcmp_word };
+static const struct str_ops str_ops_sse2 = { "sse2", &strlen_sse2, &memchr_sse2, &memcmp_sse2 };
+
+static const struct str_ops *str_ops = &str_ops_word;
+
+size_t strlen(const char *s) {
+  return str_ops->strlen(s);
+}
+
+size_t strnlen(const char *s, size_t max) {
+  const char *end = str_ops->memchr(s, 0, max);
+  return end ? (size_t)(end - s) : max;
+}
+
+void *memchr(const void *s, int c, size_t n) {
+  return str_ops->memchr(s, c, n);
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+  return str_ops->memcmp(a, b, n);
+}
+
+int strcmp(const char *a, const char *b) {
+  const unsigned char *pa = (const unsigned char *)a;
+  const unsigned char *pb = (const unsigned char *)b;
+  for (; (uintptr_t)pa & 3; pa++, pb++) {
+    if (*pa != *pb || !*pa)
+      return *pa - *pb;
+  }
+  // Word at a time only if b lines up too; otherwise one of the loads
+  // could run past the end of its string into an unmapped page.
+  if (!((uintptr_t)pb & 3)) {
+    while (*(const word_t *)pa == *(const word_t *)pb &&
+           !has_zero(*(const word_t *)pa)) {
+      pa += 4;
+      pb += 4;
+    }
+  }
+  for (; *pa == *pb && *pa; pa++, pb++)
+    ;
+  return *pa - *pb;
+}
+
+char *strncpy(char *dst, const char *src, size_t n) {
+  size_t len = strnlen(src, n);
+  memcpy(dst, src, len);
+  memset(dst + len, 0, n - len);
+  return dst;
+}
+
+void __init init_memops() {
+  bool sse2 = cpu_enable_sse();
+  if (cpu_has_leaf7_ebx_feature(CPUID_FEAT7_EBX_ERMS))
+    mem_ops = &mem_ops_erms;
+  else if (sse2)
+    mem_ops = &mem_ops_sse2;
+  if (sse2)
+    str_ops = &str_ops_sse2;
+  klog(KLOG_INFO, "memops: using %s, string scans %s", mem_ops->name, str_ops->name);
+}
+
+#ifdef BENCHMARK
+
+#define MEM_BENCH_MAX 0x10000
+// Bytes moved per size and variant, so that each measurement takes about
+// as long as the others.
+#define MEM_BENCH_BYTES 0x400000
+
+enum { BENCH_MEMCPY, BENCH_MEMSET, BENCH_STRLEN, BENCH_MEMCHR, BENCH_MEMCMP };
+static const char *const bench_names[] = { "memcpy", "memset", "strlen", "memchr", "memcmp" };
+
+// Times one operation at each size. For the scans, nothing matches before
+// the end, so they look at every byte.
+static void mem_bench_one(uint32_t op, const char *variant, const struct mem_ops *mops,
+                          const struct str_ops *sops, char *dst, char *src) {
+  static const uint32_t sizes[] = { 64, 512, 4096, MEM_BENCH_MAX };
+  uint32_t cycles[4];
+  uint32_t i, j;
+  for (i = 0; i < 4; i++) {
+    uint32_t size = sizes[i];
+    uint32_t reps = MEM_BENCH_BYTES / size;
+    memset(src, 'a', size);
+    memset(dst, 'a', size);
+    src[size - 1] = 0;
+    uint64_t start = rdtsc();
+    for (j = 0; j < reps; j++) {
+      switch (op) {
+        case BENCH_MEMCPY: mops->copy(dst, src, size); break;
+        case BENCH_MEMSET: mops->set(dst, 0x61616161, size); break;
+        case BENCH_STRLEN: sops->strlen(src); break;
+        case BENCH_MEMCHR: sops->memchr(dst, 'b', size); break;
+        case BENCH_MEMCMP: sops->memcmp(dst, dst + 1, size - 1); break;
+      }
+    }
+    cycles[i] = div64_32(rdtsc() - start, reps, NULL);
   }
-  return dstmem;
+  klog(KLOG_INFO, "%s %-9s 64B %6u  512B %6u  4K %6u  64K %6u cycles",
+       bench_names[op], variant, cycles[0], cycles[1], cycles[2], cycles[3]);
 }
 
+void mem_benchmark() {
+  const struct mem_ops *variants[3];
+  uint32_t n = 0, i;
+  bool sse2 = cpu_has_edx_feature(CPUID_FEAT_EDX_SSE2);
+  variants[n++] = &mem_ops_rep;
+  if (sse2)
+    variants[n++] = &mem_ops_sse2;
+  if (cpu_has_leaf7_ebx_feature(CPUID_FEAT7_EBX_ERMS))
+    variants[n++] = &mem_ops_erms;
+
+  char *src = (char *)kmalloc(MEM_BENCH_MAX);
+  char *dst = (char *)kmalloc(MEM_BENCH_MAX);
+  for (i = 0; i < n; i++) {
+    mem_bench_one(BENCH_MEMCPY, variants[i]->name, variants[i], 0, dst, src);
+    mem_bench_one(BENCH_MEMSET, variants[i]->name, variants[i], 0, dst, src);
+  }
+  uint32_t op;
+  for (op = BENCH_STRLEN; op <= BENCH_MEMCMP; op++) {
+    mem_bench_one(op, str_ops_word.name, 0, &str_ops_word, dst, src);
+    if (sse2)
+      mem_bench_one(op, str_ops_sse2.name, 0, &str_ops_sse2, dst, src);
+  }
+  kfree((void *)dst);
+  kfree((void *)src);
+}
+
+static char *bench_buf;
+
+static void bench_buf_alloc() {
+  bench_buf = (char *)kmalloc(0x1000);
+}
+
+static void bench_buf_free() {
+  kfree(bench_buf);
+}
+
+static void bench_memset(uint32_t i) {
+  memset(bench_buf, i, 0x1000);
+}
+BENCH_FIXTURE(memset_4k, &bench_buf_alloc, &bench_memset, &bench_buf_free);
+
+// printf itself ends at the console, which costs far more than the
+// formatting and would scroll the results away; this is what it runs.
+static void bench_snprintf(uint32_t i) {
+  snprintf(bench_buf, 0x1000, "%s %5u %#010x %-8d|", "bench", i, i * 2654435761u, -(int)i);
+}
+BENCH_FIXTURE(printf_format, &bench_buf_alloc, &bench_snprintf, &bench_buf_free);
+
+#endif
+
 void strupper(char *str){
     int i;
     int length = strlen(str);
@@ -114,62 +669,247 @@ void strlower(char *str){
     }
 }
 
+// Where vsnprintf's output goes. Characters past the end of buf are
+// counted but dropped, so the caller learns how long the output would be.
+struct fmt_out {
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+static void out_run(struct fmt_out *out, const char *s, size_t n) {
+  if (out->len < out->size) {
+    size_t room = out->size - out->len;
+    memmove(out->buf + out->len, s, n < room ? n : room);
+  }
+  out->len += n;
+}
+
+static void out_pad(struct fmt_out *out, char c, size_t n) {
+  if (out->len < out->size) {
+    size_t room = out->size - out->len;
+    memset(out->buf + out->len, c, n < room ? n : room);
+  }
+  out->len += n;
+}
+
+#define FMT_LEFT    0x01    // '-': pad on the right
+#define FMT_ZERO    0x02    // '0': pad numbers with zeroes
+#define FMT_ALT     0x04    // '#': 0x prefix for hex
+#define FMT_PLUS    0x08    // '+': sign on non-negative numbers
+#define FMT_SPACE   0x10    // ' ': space on non-negative numbers
+#define FMT_UPPER   0x20    // upper case hex digits
+#define FMT_PREC    0x40    // a precision was given
+
+static uint32_t fmt_octal(uint64_t val, char *buf) {
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  do {
+    *--p = '0' + (val & 7);
+  } while (val >>= 3);
+  uint32_t len = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
+
+static void fmt_number(struct fmt_out *out, uint64_t val, bool negative,
+                       uint32_t radix, int flags, int width, int prec) {
+  char digits[24];  // 2^64 - 1 has 22 octal digits
+  int ndigits = 0;
+  if (!(flags & FMT_PREC) || prec > 0 || val) {
+    if (radix == 10)
+      ndigits = utoa10(val, digits);
+    else if (radix == 16)
+      ndigits = utoa16(val, digits, flags & FMT_UPPER);
+    else
+      ndigits = fmt_octal(val, digits);
+  }
+
+  const char *prefix = "";
+  if (negative)
+    prefix = "-";
+  else if (flags & FMT_PLUS)
+    prefix = "+";
+  else if (flags & FMT_SPACE)
+    prefix = " ";
+  else if ((flags & FMT_ALT) && radix == 16 && val)
+    prefix = (flags & FMT_UPPER) ? "0X" : "0x";
+  int nprefix = strlen(prefix);
+
+  // With a precision, '0' is ignored, as in C.
+  int zeroes = prec > ndigits ? prec - ndigits : 0;
+  if ((flags & (FMT_ZERO | FMT_LEFT | FMT_PREC)) == FMT_ZERO &&
+      width > nprefix + ndigits)
+    zeroes = width - nprefix - ndigits;
+  int pad = width - nprefix - zeroes - ndigits;
+
+  if (pad > 0 && !(flags & FMT_LEFT))
+    out_pad(out, ' ', pad);
+  out_run(out, prefix, nprefix);
+  out_pad(out, '0', zeroes);
+  out_run(out, digits, ndigits);
+  if (pad > 0 && (flags & FMT_LEFT))
+    out_pad(out, ' ', pad);
+}
+
+int vsnprintf(char *buf, size_t size, const char *format, va_list ap) {
+  struct fmt_out out = { buf, size ? size - 1 : 0, 0 };
+  const char *p = format;
+
+  while (*p) {
+    // Copy everything up to the next conversion in one go.
+    const char *run = p;
+    while (*p && *p != '%')
+      p++;
+    if (p != run)
+      out_run(&out, run, p - run);
+    if (!*p)
+      break;
+    p++;
+
+    int flags = 0;
+    for (;; p++) {
+      if (*p == '-') flags |= FMT_LEFT;
+      else if (*p == '0') flags |= FMT_ZERO;
+      else if (*p == '#') flags |= FMT_ALT;
+      else if (*p == '+') flags |= FMT_PLUS;
+      else if (*p == ' ') flags |= FMT_SPACE;
+      else break;
+    }
+
+    int width = 0;
+    if (*p == '*') {
+      width = va_arg(ap, int);
+      if (width < 0) {
+        flags |= FMT_LEFT;
+        width = -width;
+      }
+      p++;
+    } else {
+      while (*p >= '0' && *p <= '9')
+        width = width * 10 + (*p++ - '0');
+    }
+
+    int prec = 0;
+    if (*p == '.') {
+      flags |= FMT_PREC;
+      p++;
+      if (*p == '*') {
+        prec = va_arg(ap, int);
+        if (prec < 0)
+          flags &= ~FMT_PREC;
+        p++;
+      } else {
+        while (*p >= '0' && *p <= '9')
+          prec = prec * 10 + (*p++ - '0');
+      }
+    }
+
+    // int, long and size_t are all 32 bits here; only ll is wider.
+    int longs = 0;
+    for (;; p++) {
+      if (*p == 'l') longs++;
+      else if (*p != 'h' && *p != 'z') break;
+    }
+
+    uint64_t uval;
+    int64_t sval;
+    const char *s;
+    char c;
+    switch (*p) {
+      case 'd':
+      case 'i':
+        sval = longs > 1 ? va_arg(ap, int64_t) : va_arg(ap, int32_t);
+        uval = sval < 0 ? -(uint64_t)sval : (uint64_t)sval;
+        fmt_number(&out, uval, sval < 0, 10, flags, width, prec);
+        break;
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+        uval = longs > 1 ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t);
+        if (*p == 'X')
+          flags |= FMT_UPPER;
+        flags &= ~(FMT_PLUS | FMT_SPACE);
+        fmt_number(&out, uval, false, *p == 'u' ? 10 : *p == 'o' ? 8 : 16,
+                   flags, width, prec);
+        break;
+      case 'p':
+        uval = (uintptr_t)va_arg(ap, void *);
+        flags = (flags & FMT_LEFT) | FMT_ALT | FMT_ZERO | FMT_PREC;
+        fmt_number(&out, uval, false, 16, flags, width, 8);
+        break;
+      case 'c':
+        c = (char)va_arg(ap, int);
+        if (width > 1 && !(flags & FMT_LEFT))
+          out_pad(&out, ' ', width - 1);
+        out_run(&out, &c, 1);
+        if (width > 1 && (flags & FMT_LEFT))
+          out_pad(&out, ' ', width - 1);
+        break;
+      case 's': {
+        s = va_arg(ap, const char *);
+        if (!s)
+          s = "(null)";
+        int len = 0;
+        while (s[len] && (!(flags & FMT_PREC) || len < prec))
+          len++;
+        if (width > len && !(flags & FMT_LEFT))
+          out_pad(&out, ' ', width - len);
+        out_run(&out, s, len);
+        if (width > len && (flags & FMT_LEFT))
+          out_pad(&out, ' ', width - len);
+        break;
+      }
+      case '%':
+        out_run(&out, "%", 1);
+        break;
+      case '\0':
+        // A lone '%' at the end of the format.
+        p--;
+        break;
+      default:
+        // Unknown conversions are printed as they are.
+        out_run(&out, p, 1);
+    }
+    p++;
+  }
+
+  if (size)
+    buf[out.len < out.size ? out.len : out.size] = 0;
+  return out.len;
+}
+
+int snprintf(char *buf, size_t size, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  int n = vsnprintf(buf, size, format, ap);
+  va_end(ap);
+  return n;
+}
+
 #ifdef DEBUG
 static uint32_t line_count = 0;
 #endif
 
 int printf(const char *format, ...) {
+  char buf[PRINTF_BUF_SIZE];
+  size_t len = 0;
   va_list ap;
-  va_start(ap, format);
 
 #ifdef DEBUG
-  char line_count_str[20];
-  fb_write_str(uitoa(line_count++, line_count_str, 10));
-  fb_write_str(": ");
+  len = snprintf(buf, sizeof(buf), "%u: ", line_count++);
 #endif
 
-  size_t i;
-  char buf[20];
-  int val;
-  int32_t uval;
-  char c, *s;
-  for (i=0; i<strlen(format); i++) {
-    if (format[i] == '%') {
-      i++;
-      while (format[i] == ' ') i++;
-
-      switch(format[i]) {
-        case 'i':
-          val = va_arg(ap, int);
-          itoa(val, buf, 10);
-          fb_write_str(buf);
-          break;
-        case 'x':
-          uval = va_arg(ap, uint32_t);
-          uitoa(uval, buf, 16);
-          fb_write_str(buf);
-          break;
-        case 'd':
-          uval = va_arg(ap, uint32_t);
-          uitoa(uval, buf, 10);
-          fb_write_str(buf);
-          break;
-        case 'c':
-          c = (char)va_arg(ap, int);
-          fb_write(&c, 1);
-          break;
-        case 's':
-          s = va_arg(ap, char*);
-          fb_write_str(s);
-          break;
-        default:
-          fb_write((char*)format+i, 1);
-      }
-    } else {
-      fb_write((char*)format+i, 1);
-    }
-  }
-
+  va_start(ap, format);
+  int n = vsnprintf(buf + len, sizeof(buf) - len, format, ap);
   va_end(ap);
-  return 0;
+
+  // Output that doesn't fit the buffer is cut short.
+  len += n;
+  if (len > sizeof(buf) - 1)
+    len = sizeof(buf) - 1;
+  fb_write(buf, len);
+  fb_flush();
+  return n;
 }
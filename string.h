@@ -3,11 +3,60 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
 
+// printf formats into a buffer of this size on the stack; longer output
+// is cut short.
+#define PRINTF_BUF_SIZE 256
+
+/* Radix 16 output starts with 0x. */
 char *itoa(int val, char *buf, int radix);
 char *uitoa(uint32_t val, char *buf, int radix);
-size_t strlen(const char *buf);
+
+/**
+ * utoa10/utoa16:
+ * Write val in decimal or hex, without a prefix, and a terminating NUL.
+ * buf needs room for 21 or 17 bytes.
+ *
+ * @return The number of digits written
+ */
+uint32_t utoa10(uint64_t val, char *buf);
+uint32_t utoa16(uint64_t val, char *buf, bool upper);
+size_t strlen(const char *s);
+size_t strnlen(const char *s, size_t max);
+int strcmp(const char *a, const char *b);
+char *strncpy(char *dst, const char *src, size_t n);
+void *memchr(const void *s, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
 void *memset(void *s, int c, size_t n);
-void *memmove(void *dst, const void *src, size_t len);
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+
+/**
+ * init_memops:
+ * Enables SSE on the bootstrap processor and picks the fastest memcpy,
+ * memmove and memset it supports, and SSE2 strlen, memchr and memcmp if
+ * it has SSE2. Until then they use rep movsd/stosd and word-at-a-time
+ * loops.
+ */
+void init_memops();
+
+#ifdef BENCHMARK
+/* Times each memory and string routine variant the CPU supports across
+ * sizes. */
+void mem_benchmark();
+#endif
+
+/**
+ * vsnprintf:
+ * Formats into buf, writing at most size bytes including the terminating
+ * NUL. Returns the length the output would have had with room for all of
+ * it. Supports %d %i %u %x %X %o %p %c %s and %%, the flags - 0 # + and
+ * space, width and precision (either may be *), and the h, l, ll and z
+ * length modifiers; ll is the only one that makes a difference.
+ */
+int vsnprintf(char *buf, size_t size, const char *format, va_list ap);
+int snprintf(char *buf, size_t size, const char *format, ...);
 int printf(const char *format, ...);
 #endif /* _STRING_H_ */
\ No newline at end of file
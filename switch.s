@@ -0,0 +1,25 @@
+global switch_context
+
+; Runs on every thread switch, so it goes with the hot code (link.ld).
+section .text.hot progbits alloc exec nowrite align=16
+; void switch_context(uint32_t *old_esp, uint32_t new_esp)
+;
+; Saves the callee-saved registers on the current stack, stores the stack
+; pointer in *old_esp, then switches to new_esp and pops the registers
+; that were saved there. The caller-saved ones (eax, ecx, edx) have
+; already been saved by the C caller if it needed them.
+switch_context:
+  mov eax, [esp+4]  ; where to save the old stack pointer
+  mov edx, [esp+8]  ; the stack to switch to
+  push ebp
+  push ebx
+  push esi
+  push edi
+  mov [eax], esp
+  mov esp, edx
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ret               ; into the new thread's caller of switch_context
+                    ; (or thread_start, for a thread that never ran)
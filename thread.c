@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "thread.h"
+#include "cpu.h"
+#include "kheap.h"
+#include "softirq.h"
+#include "smp.h"
+#include "error.h"
+#include "trace.h"
+#include "compiler.h"
+
+extern void switch_context(uint32_t *old_esp, uint32_t new_esp);
+
+// The boot context. Its stack is loader.s's kernel_stack, not a pool stack.
+static thread_t main_thread;
+static thread_t *idle_thread;
+
+// The running thread is per CPU. Only the BSP schedules threads for now;
+// on the other CPUs this stays null.
+#define current (this_cpu()->current)
+
+static struct list_head run_queue = LIST_HEAD_INIT(run_queue);
+// Threads that have exited but are still on their own stack.
+static struct list_head zombies = LIST_HEAD_INIT(zombies);
+// Stacks (with their thread_t) of reaped threads, ready for reuse.
+static struct list_head stack_pool = LIST_HEAD_INIT(stack_pool);
+
+static volatile bool need_resched = false;
+static struct ktimer slice_timer;
+static uint32_t next_thread_id = 0;
+
+static void schedule();
+
+// ---------------------------
+// Stack pool
+// ---------------------------
+
+static thread_t *stack_alloc() {
+  if (!list_empty(&stack_pool)) {
+    thread_t *thread = container_of(stack_pool.next, thread_t, entry);
+    list_del(&thread->entry);
+    return thread;
+  }
+  return (thread_t *)kmalloc_a(THREAD_STACK_SIZE);
+}
+
+// Call with interrupts disabled, from a different stack.
+static void reap_zombies() {
+  while (!list_empty(&zombies)) {
+    thread_t *thread = container_of(zombies.next, thread_t, entry);
+    list_del(&thread->entry);
+    if (thread != &main_thread)
+      list_add(&thread->entry, &stack_pool);
+  }
+}
+
+// ---------------------------
+// Scheduling
+// ---------------------------
+
+// Entry point of every new thread; switch_context "returns" here.
+static void thread_start() {
+  reap_zombies();
+  asm volatile("sti" ::: "memory");
+  current->fn(current->arg);
+  thread_exit();
+}
+
+// Call with interrupts disabled.
+static void __hot schedule() {
+  thread_t *prev = current;
+  need_resched = false;
+
+  if (prev->magic != THREAD_MAGIC) {
+    ERROR("Thread stack overflow");
+  }
+
+  if (prev->state == THREAD_RUNNING && prev != idle_thread) {
+    prev->state = THREAD_READY;
+    list_add_tail(&prev->entry, &run_queue);
+  }
+
+  thread_t *next = idle_thread;
+  if (!list_empty(&run_queue)) {
+    next = container_of(run_queue.next, thread_t, entry);
+    list_del(&next->entry);
+  }
+
+  next->state = THREAD_RUNNING;
+  if (next == prev)
+    return;
+
+  current = next;
+  trace2(TRACE_SCHED_SWITCH, prev->id, next->id);
+  switch_context(&prev->esp, next->esp);
+
+  // We're back on prev's stack.
+  reap_zombies();
+}
+
+static void slice_expired(struct ktimer *timer) {
+  need_resched = true;
+  ktimer_add(timer, jiffies + THREAD_SLICE);
+}
+
+static void idle(void *arg) {
+  (void)arg;
+  for (;;) {
+    asm volatile("hlt" ::: "memory");
+  }
+}
+
+// ---------------------------
+// Public interface
+// ---------------------------
+
+void __init init_threads() {
+  main_thread.id = next_thread_id++;
+  main_thread.name = "main";
+  main_thread.state = THREAD_RUNNING;
+  main_thread.magic = THREAD_MAGIC;
+  list_init(&main_thread.entry);
+  ktimer_init(&main_thread.sleep_timer, 0);
+  current = &main_thread;
+
+  idle_thread = thread_create("idle", &idle, 0);
+  // The idle thread only runs when nothing else can.
+  uint32_t flags = irq_save();
+  list_del(&idle_thread->entry);
+  irq_restore(flags);
+
+  ktimer_init(&slice_timer, &slice_expired);
+  ktimer_add(&slice_timer, jiffies + THREAD_SLICE);
+}
+
+thread_t *thread_create(const char *name, thread_fn_t fn, void *arg) {
+  uint32_t flags = irq_save();
+  thread_t *thread = stack_alloc();
+  thread->id = next_thread_id++;
+  irq_restore(flags);
+
+  thread->name = name;
+  thread->fn = fn;
+  thread->arg = arg;
+  thread->magic = THREAD_MAGIC;
+  list_init(&thread->entry);
+  ktimer_init(&thread->sleep_timer, 0);
+
+  // Build the frame switch_context expects to pop: edi, esi, ebx, ebp,
+  // then the return address.
+  uint32_t *stack = (uint32_t *)((uint32_t)thread + THREAD_STACK_SIZE);
+  *--stack = 0;                       // thread_start's return address
+  *--stack = (uint32_t)&thread_start;
+  *--stack = 0;                       // ebp
+  *--stack = 0;                       // ebx
+  *--stack = 0;                       // esi
+  *--stack = 0;                       // edi
+  thread->esp = (uint32_t)stack;
+
+  flags = irq_save();
+  thread->state = THREAD_READY;
+  list_add_tail(&thread->entry, &run_queue);
+  irq_restore(flags);
+  return thread;
+}
+
+thread_t *thread_current() {
+  return current;
+}
+
+void thread_yield() {
+  uint32_t flags = irq_save();
+  schedule();
+  irq_restore(flags);
+}
+
+void thread_block() {
+  current->state = THREAD_BLOCKED;
+  schedule();
+}
+
+void thread_unblock(thread_t *thread) {
+  uint32_t flags = irq_save();
+  if (thread->state == THREAD_BLOCKED) {
+    thread->state = THREAD_READY;
+    list_add_tail(&thread->entry, &run_queue);
+  }
+  irq_restore(flags);
+}
+
+void thread_wait(struct wait_queue *wq) {
+  list_add_tail(&current->entry, &wq->waiters);
+  thread_block();
+}
+
+void wake_up_all(struct wait_queue *wq) {
+  uint32_t flags = irq_save();
+  while (!list_empty(&wq->waiters)) {
+    thread_t *thread = container_of(wq->waiters.next, thread_t, entry);
+    list_del(&thread->entry);
+    thread_unblock(thread);
+  }
+  irq_restore(flags);
+}
+
+static void sleep_expired(struct ktimer *timer) {
+  thread_unblock(container_of(timer, thread_t, sleep_timer));
+}
+
+void thread_sleep(uint32_t ms) {
+  uint32_t flags = irq_save();
+  current->sleep_timer.fn = &sleep_expired;
+  ktimer_add(&current->sleep_timer, jiffies + msecs_to_jiffies(ms));
+  thread_block();
+  irq_restore(flags);
+}
+
+void thread_exit() {
+  asm volatile("cli" ::: "memory");
+  current->state = THREAD_DEAD;
+  list_add_tail(&current->entry, &zombies);
+  schedule();
+  // Never reached: nothing switches back to a dead thread.
+  for (;;);
+}
+
+void thread_preempt() {
+  if (need_resched && current && !softirq_active())
+    schedule();
+}
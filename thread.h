@@ -0,0 +1,100 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "list.h"
+#include "ktimer.h"
+
+// Each thread gets a stack of this size. The thread_t lives at its base.
+#define THREAD_STACK_SIZE   0x2000
+#define THREAD_MAGIC        0x7EAD5AFE
+
+// How many jiffies a thread may run before it is preempted.
+#define THREAD_SLICE        2
+
+enum thread_state {
+  THREAD_RUNNING,
+  THREAD_READY,
+  THREAD_BLOCKED,
+  THREAD_DEAD
+};
+
+typedef void (*thread_fn_t)(void *arg);
+
+typedef struct thread {
+  uint32_t esp;             // saved stack pointer, must stay first (see switch.s)
+  uint32_t id;
+  const char *name;
+  enum thread_state state;
+  struct list_head entry;   // on the run queue, a wait list, the zombie list or the stack pool
+  struct ktimer sleep_timer;
+  thread_fn_t fn;
+  void *arg;
+  uint32_t magic;           // overwritten if the stack overflows
+} thread_t;
+
+/**
+ * init_threads:
+ * Turns the boot context into the "main" thread, creates the idle thread
+ * and starts time slicing. Requires the heap and init_ktimers.
+ */
+void init_threads();
+
+/* Creates a thread that runs fn(arg) and puts it on the run queue. */
+thread_t *thread_create(const char *name, thread_fn_t fn, void *arg);
+
+thread_t *thread_current();
+
+/* Gives up the CPU to the next ready thread. */
+void thread_yield();
+
+/* Blocks the calling thread for at least ms milliseconds. */
+void thread_sleep(uint32_t ms);
+
+/* Ends the calling thread. Returning from a thread function does the same. */
+void thread_exit() __attribute__((noreturn));
+
+/**
+ * thread_block/thread_unblock:
+ * thread_block puts the caller to sleep until someone passes it to
+ * thread_unblock. Call thread_block with interrupts disabled, after
+ * making the thread findable by whoever will wake it.
+ */
+void thread_block();
+void thread_unblock(thread_t *thread);
+
+/**
+ * A list of threads waiting for something. The waker calls wake_up_all
+ * after making the condition true; waiters re-check it when they run.
+ */
+struct wait_queue {
+  struct list_head waiters;
+};
+
+#define WAIT_QUEUE_INIT(name) { LIST_HEAD_INIT((name).waiters) }
+
+static inline void wait_queue_init(struct wait_queue *wq) {
+  list_init(&wq->waiters);
+}
+
+/**
+ * thread_wait:
+ * Blocks the caller on wq until wake_up_all. Call with interrupts
+ * disabled, after checking the condition, so that a wakeup can't slip in
+ * between the check and going to sleep.
+ */
+void thread_wait(struct wait_queue *wq);
+
+/* Makes every thread waiting on wq ready to run. Safe from softirqs. */
+void wake_up_all(struct wait_queue *wq);
+
+/**
+ * thread_preempt:
+ * Called on the way out of irq_handler; switches threads if the current
+ * one has used up its time slice.
+ */
+void thread_preempt();
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "timer.h"
+#include "cpu.h"
+#include "io.h"
+#include "isr.h"
+#include "lapic.h"
+#include "error.h"
+#include "compiler.h"
+
+// How long we let PIT channel 2 count while calibrating.
+#define CALIBRATE_MS            10
+#define CALIBRATE_LATCH         (PIT_FREQUENCY / (1000 / CALIBRATE_MS))
+
+// The PIT counter is 16 bits wide, so a one-shot can be at most ~54.9ms away.
+#define PIT_MAX_DELTA_NS        54900000
+// PIT ticks per nanosecond, as a 32.32 fixed point fraction.
+#define PIT_NS_MULT             ((uint32_t)(((uint64_t)PIT_FREQUENCY << 32) / NSEC_PER_SEC))
+
+#define LAPIC_MAX_DELTA_NS      NSEC_PER_SEC
+
+// Deadlines closer than this are rounded up so that the interrupt
+// can't race the programming of the device.
+#define TIMER_MIN_DELTA_NS      2000
+
+enum timer_mode {
+  TIMER_STOPPED,
+  TIMER_PERIODIC,
+  TIMER_ONESHOT
+};
+
+// TSC clocksource: ns = (cycles * tsc_mult) >> tsc_shift
+static uint32_t tsc_khz;
+static uint32_t tsc_mult;
+static uint32_t tsc_shift;
+static uint64_t tsc_base;
+
+// Local APIC timer ticks per nanosecond, as a 32.32 fixed point fraction.
+static uint32_t lapic_khz;
+static uint32_t lapic_mult;
+
+static const struct clock_event_device *clock_event;
+static timer_handler_t timer_handler;
+static volatile enum timer_mode timer_mode = TIMER_STOPPED;
+static volatile uint64_t timer_deadline_ns;
+
+// ---------------------------
+// PIT clock event device
+// ---------------------------
+
+static void pit_set_periodic(uint32_t hz) {
+  uint32_t divisor = PIT_FREQUENCY / hz;
+  if (divisor > 0xFFFF) divisor = 0xFFFF;
+  if (divisor == 0) divisor = 1;
+  outb(PIT_COMMAND_PORT, PIT_SELECT_CHANNEL0 | PIT_ACCESS_LOHI | PIT_MODE_RATE_GENERATOR);
+  outb(PIT_CHANNEL0_PORT, divisor & 0xFF);
+  outb(PIT_CHANNEL0_PORT, (divisor >> 8) & 0xFF);
+}
+
+static void pit_set_oneshot(uint32_t delta_ns) {
+  uint32_t count = ((uint64_t)delta_ns * PIT_NS_MULT) >> 32;
+  if (count > 0xFFFF) count = 0xFFFF;
+  if (count == 0) count = 1;
+  outb(PIT_COMMAND_PORT, PIT_SELECT_CHANNEL0 | PIT_ACCESS_LOHI | PIT_MODE_TERMINAL_COUNT);
+  outb(PIT_CHANNEL0_PORT, count & 0xFF);
+  outb(PIT_CHANNEL0_PORT, (count >> 8) & 0xFF);
+}
+
+static void pit_stop() {
+  // In mode 0 the counter doesn't start until a count is written.
+  outb(PIT_COMMAND_PORT, PIT_SELECT_CHANNEL0 | PIT_ACCESS_LOHI | PIT_MODE_TERMINAL_COUNT);
+}
+
+static const struct clock_event_device pit_clock_event = {
+  .name = "pit",
+  .max_delta_ns = PIT_MAX_DELTA_NS,
+  .set_periodic = pit_set_periodic,
+  .set_oneshot = pit_set_oneshot,
+  .stop = pit_stop
+};
+
+// ---------------------------
+// Local APIC clock event device
+// ---------------------------
+
+static void lapic_set_periodic(uint32_t hz) {
+  lapic_timer_periodic(div64_32((uint64_t)lapic_khz * 1000, hz, NULL));
+}
+
+static void lapic_set_oneshot(uint32_t delta_ns) {
+  uint32_t count = ((uint64_t)delta_ns * lapic_mult) >> 32;
+  if (count == 0) count = 1;
+  lapic_timer_oneshot(count);
+}
+
+static const struct clock_event_device lapic_clock_event = {
+  .name = "lapic",
+  .max_delta_ns = LAPIC_MAX_DELTA_NS,
+  .set_periodic = lapic_set_periodic,
+  .set_oneshot = lapic_set_oneshot,
+  .stop = lapic_timer_stop
+};
+
+// ---------------------------
+// Calibration
+// ---------------------------
+
+/* Counts TSC cycles (and, if asked, local APIC timer ticks) while PIT
+ * channel 2 counts down CALIBRATE_MS milliseconds. */
+static uint64_t __init calibrate(uint32_t *lapic_ticks) {
+  uint32_t flags = irq_save();
+
+  // Enable the channel 2 gate, but keep the speaker off.
+  uint8_t gate = inb(PIT_GATE_PORT);
+  outb(PIT_GATE_PORT, (gate & ~PIT_GATE_SPEAKER) | PIT_GATE_ENABLE);
+
+  outb(PIT_COMMAND_PORT, PIT_SELECT_CHANNEL2 | PIT_ACCESS_LOHI | PIT_MODE_TERMINAL_COUNT);
+  outb(PIT_CHANNEL2_PORT, CALIBRATE_LATCH & 0xFF);
+  outb(PIT_CHANNEL2_PORT, (CALIBRATE_LATCH >> 8) & 0xFF);
+
+  if (lapic_ticks)
+    lapic_timer_oneshot(0xFFFFFFFF);
+  uint64_t start = rdtsc();
+
+  while (!(inb(PIT_GATE_PORT) & PIT_GATE_OUTPUT));
+
+  uint64_t end = rdtsc();
+  if (lapic_ticks) {
+    *lapic_ticks = 0xFFFFFFFF - lapic_timer_current();
+    lapic_timer_stop();
+  }
+
+  outb(PIT_GATE_PORT, gate);
+  irq_restore(flags);
+  return end - start;
+}
+
+static void set_tsc_conversion(uint32_t khz) {
+  // Use the largest shift (best precision) for which the multiplier still
+  // fits in 32 bits: ns = cycles * NSEC_PER_MSEC / khz.
+  uint32_t shift = 32;
+  uint64_t mult;
+  for (;;) {
+    mult = div64_32((uint64_t)NSEC_PER_MSEC << shift, khz, NULL);
+    if ((mult >> 32) == 0 || shift == 0)
+      break;
+    shift--;
+  }
+  tsc_khz = khz;
+  tsc_mult = mult;
+  tsc_shift = shift;
+}
+
+// ---------------------------
+// Interrupt handling
+// ---------------------------
+
+static void timer_program_next(uint64_t now) {
+  uint64_t delta = (timer_deadline_ns > now) ? timer_deadline_ns - now : 0;
+  if (delta > clock_event->max_delta_ns)
+    delta = clock_event->max_delta_ns;
+  if (delta < TIMER_MIN_DELTA_NS)
+    delta = TIMER_MIN_DELTA_NS;
+  clock_event->set_oneshot((uint32_t)delta);
+}
+
+static void timer_interrupt() {
+  uint64_t now = timer_now_ns();
+
+  if (timer_mode == TIMER_PERIODIC) {
+    if (timer_handler) timer_handler(now);
+  } else if (timer_mode == TIMER_ONESHOT) {
+    if (now >= timer_deadline_ns) {
+      // The handler may well set the next deadline itself.
+      timer_mode = TIMER_STOPPED;
+      if (timer_handler) timer_handler(now);
+    } else {
+      // We were woken early because the deadline was out of the
+      // device's range. Keep going.
+      timer_program_next(now);
+    }
+  }
+}
+
+static void pit_irq(registers_t regs) {
+  (void)regs;
+  if (clock_event == &pit_clock_event)
+    timer_interrupt();
+}
+
+static void lapic_timer_irq(registers_t regs) {
+  (void)regs;
+  if (clock_event == &lapic_clock_event)
+    timer_interrupt();
+}
+
+// ---------------------------
+// Public interface
+// ---------------------------
+
+void __init init_timer() {
+  if (!cpu_has_edx_feature(CPUID_FEAT_EDX_TSC)) {
+    ERROR("No TSC!");
+  }
+
+  bool use_lapic = lapic_present();
+  if (use_lapic)
+    init_lapic();
+
+  uint32_t lapic_ticks = 0;
+  uint64_t cycles = calibrate(use_lapic ? &lapic_ticks : NULL);
+  set_tsc_conversion(div64_32(cycles, CALIBRATE_MS, NULL));
+
+  register_interrupt_handler(IRQ0, &pit_irq);
+  register_interrupt_handler(LAPIC_TIMER_VECTOR, &lapic_timer_irq);
+
+  // The BIOS leaves the PIT ticking at 18.2Hz; silence it.
+  pit_stop();
+
+  if (use_lapic && lapic_ticks != 0) {
+    lapic_khz = lapic_ticks / CALIBRATE_MS;
+    lapic_mult = div64_32((uint64_t)lapic_khz << 32, NSEC_PER_MSEC, NULL);
+    clock_event = &lapic_clock_event;
+  } else {
+    clock_event = &pit_clock_event;
+  }
+
+  tsc_base = rdtsc();
+}
+
+uint64_t timer_cycles_to_ns(uint64_t cycles) {
+  return mul_u64_u32_shr(cycles, tsc_mult, tsc_shift);
+}
+
+uint64_t timer_now_ns() {
+  return timer_cycles_to_ns(rdtsc() - tsc_base);
+}
+
+uint32_t timer_tsc_khz() {
+  return tsc_khz;
+}
+
+void timer_udelay(uint32_t usecs) {
+  uint64_t cycles = div64_32((uint64_t)usecs * tsc_khz, 1000, NULL);
+  uint64_t start = rdtsc();
+  while (rdtsc() - start < cycles)
+    cpu_relax();
+}
+
+void timer_set_handler(timer_handler_t handler) {
+  timer_handler = handler;
+}
+
+void timer_periodic(uint32_t hz) {
+  uint32_t flags = irq_save();
+  timer_mode = TIMER_PERIODIC;
+  clock_event->set_periodic(hz);
+  irq_restore(flags);
+}
+
+void timer_set_deadline(uint64_t deadline_ns) {
+  uint32_t flags = irq_save();
+  timer_mode = TIMER_ONESHOT;
+  timer_deadline_ns = deadline_ns;
+  timer_program_next(timer_now_ns());
+  irq_restore(flags);
+}
+
+void timer_stop() {
+  uint32_t flags = irq_save();
+  timer_mode = TIMER_STOPPED;
+  clock_event->stop();
+  irq_restore(flags);
+}
+
+const struct clock_event_device *timer_clock_event() {
+  return clock_event;
+}
@@ -0,0 +1,87 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/* The 8254 programmable interval timer */
+#define PIT_FREQUENCY           1193182
+#define PIT_CHANNEL0_PORT       0x40
+#define PIT_CHANNEL2_PORT       0x42
+#define PIT_COMMAND_PORT        0x43
+/* Port B of the keyboard controller gates PIT channel 2 */
+#define PIT_GATE_PORT           0x61
+
+/* PIT command byte fields */
+#define PIT_SELECT_CHANNEL0     0x00
+#define PIT_SELECT_CHANNEL2     0x80
+#define PIT_ACCESS_LOHI         0x30
+#define PIT_MODE_TERMINAL_COUNT 0x00 /* mode 0, used for one-shots */
+#define PIT_MODE_RATE_GENERATOR 0x04 /* mode 2, used for periodic ticks */
+
+#define PIT_GATE_ENABLE         0x01
+#define PIT_GATE_SPEAKER        0x02
+#define PIT_GATE_OUTPUT         0x20
+
+#define NSEC_PER_USEC           1000
+#define NSEC_PER_MSEC           1000000
+#define NSEC_PER_SEC            1000000000
+
+/**
+ * Called from interrupt context whenever the timer fires: once per tick
+ * in periodic mode, or when the programmed deadline passes in one-shot mode.
+ */
+typedef void (*timer_handler_t)(uint64_t now_ns);
+
+/**
+ * A device that can raise timer interrupts (PIT or local APIC timer).
+ * set_oneshot is given a delta no larger than max_delta_ns.
+ */
+struct clock_event_device {
+  const char *name;
+  uint32_t max_delta_ns;
+  void (*set_periodic)(uint32_t hz);
+  void (*set_oneshot)(uint32_t delta_ns);
+  void (*stop)();
+};
+
+/**
+ * init_timer:
+ * Calibrates the TSC against PIT channel 2, picks the local APIC timer as
+ * the clock event device if present (falling back to the PIT on IRQ0),
+ * and leaves it stopped: the kernel is tickless until something asks for
+ * a tick or a deadline.
+ */
+void init_timer();
+
+/* Monotonic nanoseconds since init_timer. */
+uint64_t timer_now_ns();
+
+/* Converts a TSC delta to nanoseconds. */
+uint64_t timer_cycles_to_ns(uint64_t cycles);
+
+/* Calibrated TSC frequency in kHz. */
+uint32_t timer_tsc_khz();
+
+/* Busy-waits for the given number of microseconds. */
+void timer_udelay(uint32_t usecs);
+
+void timer_set_handler(timer_handler_t handler);
+
+/* Takes a periodic interrupt hz times a second. */
+void timer_periodic(uint32_t hz);
+
+/**
+ * timer_set_deadline:
+ * Switches to one-shot mode and arranges for the handler to run once
+ * timer_now_ns() >= deadline_ns. Deadlines beyond the device's range are
+ * reached by re-arming silently from the interrupt, so the handler
+ * only ever sees the real expiry.
+ */
+void timer_set_deadline(uint64_t deadline_ns);
+
+/* Cancels any pending deadline or periodic tick. */
+void timer_stop();
+
+const struct clock_event_device *timer_clock_event();
+
+#endif
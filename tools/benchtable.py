@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Tabulates the benchmark results run_benchmarks() writes to COM1 (see bench.h).
+
+    make bench                         # build, run under QEMU, tabulate
+    tools/benchtable.py bench.out
+    tools/benchtable.py --csv bench.out > results.csv
+
+Exits with status 1 if the capture has no bench-done line, that is if the
+kernel did not get through all of its benchmarks.
+"""
+
+import argparse
+import sys
+
+
+def results(data):
+    """Yields the words of each bench line. The rest of the capture (log
+    text, binary trace frames) is skipped."""
+    for raw in data.split(b"\n"):
+        start = raw.find(b"bench")
+        if start < 0:
+            continue
+        words = raw[start:].decode("ascii", "replace").split()
+        if words and words[0] in ("bench", "bench-clock", "bench-done"):
+            yield words
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("capture", nargs="?", default="bench.out")
+    parser.add_argument("--csv", action="store_true", help="emit CSV instead of a table")
+    args = parser.parse_args()
+
+    with open(args.capture, "rb") as f:
+        data = f.read()
+
+    khz = 0
+    done = None
+    rows = []
+    for words in results(data):
+        try:
+            if words[0] == "bench-clock":
+                khz = int(words[1])
+            elif words[0] == "bench-done":
+                done = int(words[1])
+            elif len(words) == 7:
+                rows.append((words[1],) + tuple(int(w) for w in words[2:]))
+        except ValueError:
+            continue
+
+    def ns(cycles):
+        return 1e6 * cycles / khz if khz else float("nan")
+
+    if args.csv:
+        print("name,iterations,min_cycles,median_cycles,p99_cycles,max_cycles,median_ns")
+        for name, iters, lo, med, p99, hi in rows:
+            print("%s,%d,%d,%d,%d,%d,%.1f" % (name, iters, lo, med, p99, hi, ns(med)))
+    else:
+        print("%-16s %6s %9s %9s %9s %9s %11s" % (
+            "benchmark", "iters", "min", "median", "p99", "max", "median ns"))
+        for name, iters, lo, med, p99, hi in rows:
+            print("%-16s %6d %9d %9d %9d %9d %11.1f" % (name, iters, lo, med, p99, hi, ns(med)))
+        print("cycles, TSC at %d kHz" % khz)
+
+    if done is None:
+        sys.stderr.write("%s: no bench-done line, the run did not finish\n" % args.capture)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
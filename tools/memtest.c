@@ -0,0 +1,419 @@
+/* Host-side check of string.c against glibc (make memtest, make membench).
+ *
+ * The Makefile builds string.c for the host with tools/memtest.h in front
+ * of it and renames its public functions to k_*, so they can sit next to
+ * glibc's. Each variant init_memops can pick is then run:
+ *
+ *   memtest [iterations] [seed]   fuzzes every primitive against glibc
+ *                                 over random lengths, alignments and
+ *                                 overlaps, with buffers that end at an
+ *                                 unmapped guard page
+ *   memtest --bench               times them against glibc
+ *
+ * A segfault while fuzzing means a primitive read past its buffer.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t k_strlen(const char *s);
+size_t k_strnlen(const char *s, size_t max);
+int k_strcmp(const char *a, const char *b);
+char *k_strncpy(char *dst, const char *src, size_t n);
+void *k_memchr(const void *s, int c, size_t n);
+int k_memcmp(const void *a, const void *b, size_t n);
+void *k_memset(void *s, int c, size_t n);
+void *k_memcpy(void *dst, const void *src, size_t n);
+void *k_memmove(void *dst, const void *src, size_t n);
+void k_init_memops();
+
+bool memtest_sse2;
+bool memtest_erms;
+
+static bool quiet;
+
+void klog(uint32_t level, const char *format, ...) {
+  va_list ap;
+  (void)level;
+  if (quiet)
+    return;
+  va_start(ap, format);
+  vprintf(format, ap);
+  va_end(ap);
+  putchar('\n');
+}
+
+void fb_write(char *buf, unsigned int len) {
+  fwrite(buf, 1, len, stdout);
+}
+
+void fb_flush() {
+}
+
+/* The CPU features to pretend to have; between them they reach every
+ * mem_ops and str_ops variant. */
+static const struct variant {
+  const char *name;
+  bool sse2, erms;
+} variants[] = {
+  { "rep+word", false, false },
+  { "sse2", true, false },
+  { "erms+word", false, true },
+};
+#define NR_VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+static void use_variant(const struct variant *v) {
+  memtest_sse2 = v->sse2;
+  memtest_erms = v->erms;
+  k_init_memops();
+}
+
+// ---------------------------
+// Buffers
+// ---------------------------
+
+// The longest buffer the fuzzer uses: past a few SSE2 blocks (string.c
+// works MEM_SSE_BLOCK, 4 KiB, at a time).
+#define MAX_LEN     (3 * 4096 + 300)
+#define SLACK       64
+
+struct arena {
+  char *base;           // MAX_LEN + 2 * SLACK bytes, then a guard page
+  size_t size;
+};
+
+static size_t page_size;
+
+static void arena_init(struct arena *a) {
+  size_t size = (MAX_LEN + 2 * SLACK + page_size - 1) & ~(page_size - 1);
+  char *p = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED || mprotect(p + size, page_size, PROT_NONE)) {
+    perror("memtest: mmap");
+    exit(2);
+  }
+  a->base = p;
+  a->size = size;
+}
+
+static char *arena_end(struct arena *a) {
+  return a->base + a->size;
+}
+
+static struct arena arenas[4];
+
+// xorshift32: rand() is slow enough to dominate the run.
+static uint32_t rand_state = 1;
+
+static void rand_seed(uint32_t seed) {
+  rand_state = seed ? seed : 1;
+}
+
+static uint32_t rand32() {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+// Mostly short, sometimes past the SSE2 threshold and block size.
+static size_t rand_len() {
+  switch (rand32() % 8) {
+  case 0: return rand32() % 8;
+  case 1: case 2: case 3: return rand32() % 160;
+  case 4: case 5: return rand32() % 600;
+  default: return rand32() % MAX_LEN;
+  }
+}
+
+// Where len bytes go in arena a: either flush against the guard page, or
+// at a random alignment near the start.
+static char *place(struct arena *a, size_t len) {
+  if (rand32() & 1)
+    return arena_end(a) - len;
+  return a->base + SLACK + rand32() % SLACK;
+}
+
+// Bytes from a small alphabet, so that matches and mismatches both
+// happen. Never zero, unless zeros is set.
+static void fill(char *p, size_t len, bool zeros) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    char c = 'a' + rand32() % 4;
+    if (zeros && rand32() % 64 == 0)
+      c = 0;
+    p[i] = c;
+  }
+}
+
+static int sign(int v) {
+  return (v > 0) - (v < 0);
+}
+
+static const char *variant_name;
+static unsigned iteration;
+
+static void fail(const char *op, const char *fmt, ...) {
+  va_list ap;
+  fprintf(stderr, "memtest: %s (%s) wrong at iteration %u: ", op, variant_name, iteration);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+// ---------------------------
+// Fuzzing
+// ---------------------------
+
+static void fuzz_strlen() {
+  size_t len = rand_len();
+  char *s = place(&arenas[0], len + 1);
+  fill(s, len, false);
+  s[len] = 0;
+  size_t got = k_strlen(s), want = strlen(s);
+  if (got != want)
+    fail("strlen", "len %zu align %zu: got %zu", want, (size_t)((uintptr_t)s & 63), got);
+}
+
+static void fuzz_strnlen() {
+  size_t len = rand_len();
+  size_t max = rand_len();
+  char *s;
+  if (rand32() & 1) {
+    // No terminator within max: only max bytes may be read.
+    len = max;
+    s = place(&arenas[0], len);
+    fill(s, len, false);
+  } else {
+    s = place(&arenas[0], len + 1);
+    fill(s, len, false);
+    s[len] = 0;
+  }
+  size_t got = k_strnlen(s, max), want = strnlen(s, max);
+  if (got != want)
+    fail("strnlen", "len %zu max %zu: got %zu, want %zu", len, max, got, want);
+}
+
+static void fuzz_memchr() {
+  size_t n = rand_len();
+  char *s = place(&arenas[0], n);
+  fill(s, n, true);
+  int c = rand32() % 8 == 0 ? 0 : 'a' + rand32() % 5;
+  if (rand32() % 16 == 0)
+    c |= 0x100;     // only the low byte counts
+  void *got = k_memchr(s, c, n), *want = memchr(s, c, n);
+  if (got != want)
+    fail("memchr", "n %zu c %#x: got %td, want %td", n, c,
+         got ? (char *)got - s : -1, want ? (char *)want - s : -1);
+}
+
+static void fuzz_memcmp() {
+  size_t n = rand_len();
+  char *a = place(&arenas[0], n), *b = place(&arenas[1], n);
+  fill(a, n, true);
+  memcpy(b, a, n);
+  if (n && rand32() % 4) {
+    // One difference, with the high bit set half the time so that the
+    // comparison has to be unsigned.
+    b[rand32() % n] ^= rand32() & 1 ? 0x80 : 0x01;
+  }
+  int got = k_memcmp(a, b, n), want = memcmp(a, b, n);
+  if (sign(got) != sign(want))
+    fail("memcmp", "n %zu: got %d, want %d", n, got, want);
+}
+
+static void fuzz_strcmp() {
+  size_t la = rand_len(), lb = la;
+  if (rand32() % 4 == 0)
+    lb = rand_len();
+  char *a = place(&arenas[0], la + 1), *b = place(&arenas[1], lb + 1);
+  fill(a, la, false);
+  a[la] = 0;
+  memcpy(b, a, la < lb ? la : lb);
+  if (lb > la)
+    fill(b + la, lb - la, false);
+  b[lb] = 0;
+  if (lb && rand32() % 2)
+    b[rand32() % lb] ^= rand32() & 1 ? 0x80 : 0x01;
+  int got = k_strcmp(a, b), want = strcmp(a, b);
+  if (sign(got) != sign(want))
+    fail("strcmp", "lengths %zu, %zu: got %d, want %d", la, lb, got, want);
+}
+
+static void fuzz_strncpy() {
+  size_t len = rand_len(), n = rand_len();
+  char *src = place(&arenas[0], len + 1);
+  fill(src, len, false);
+  src[len] = 0;
+  size_t off = rand32() % SLACK;
+  char *got = arenas[1].base + off, *want = arenas[2].base + off;
+  memset(arenas[1].base, 0x5a, MAX_LEN + 2 * SLACK);
+  memset(arenas[2].base, 0x5a, MAX_LEN + 2 * SLACK);
+  if (k_strncpy(got, src, n) != got)
+    fail("strncpy", "wrong return value");
+  strncpy(want, src, n);
+  if (memcmp(arenas[1].base, arenas[2].base, MAX_LEN + 2 * SLACK))
+    fail("strncpy", "len %zu n %zu", len, n);
+}
+
+static void fuzz_memset() {
+  size_t n = rand_len(), off = rand32() % SLACK;
+  int c = rand32();
+  memset(arenas[1].base, 0x5a, MAX_LEN + 2 * SLACK);
+  memset(arenas[2].base, 0x5a, MAX_LEN + 2 * SLACK);
+  if (k_memset(arenas[1].base + off, c, n) != arenas[1].base + off)
+    fail("memset", "wrong return value");
+  memset(arenas[2].base + off, c, n);
+  if (memcmp(arenas[1].base, arenas[2].base, MAX_LEN + 2 * SLACK))
+    fail("memset", "n %zu c %#x align %zu", n, c, off);
+}
+
+static void fuzz_memcpy() {
+  size_t n = rand_len();
+  char *src = place(&arenas[0], n);
+  fill(src, n, true);
+  size_t off = rand32() % SLACK;
+  memset(arenas[1].base, 0x5a, MAX_LEN + 2 * SLACK);
+  memset(arenas[2].base, 0x5a, MAX_LEN + 2 * SLACK);
+  if (k_memcpy(arenas[1].base + off, src, n) != arenas[1].base + off)
+    fail("memcpy", "wrong return value");
+  memcpy(arenas[2].base + off, src, n);
+  if (memcmp(arenas[1].base, arenas[2].base, MAX_LEN + 2 * SLACK))
+    fail("memcpy", "n %zu src align %zu dst align %zu", n,
+         (size_t)((uintptr_t)src & 63), off);
+}
+
+static void fuzz_memmove() {
+  // Source and destination within one region, overlapping either way.
+  size_t n = rand_len() / 2;
+  size_t region = MAX_LEN + 2 * SLACK;
+  size_t src = rand32() % (region - n), dst;
+  if (rand32() % 4 == 0)
+    dst = rand32() % (region - n);
+  else
+    dst = src + (rand32() % 2 ? 1 : -1) * (ssize_t)(rand32() % (n + 8));
+  if (dst > region - n)
+    dst = src;
+  fill(arenas[1].base, region, true);
+  memcpy(arenas[2].base, arenas[1].base, region);
+  if (k_memmove(arenas[1].base + dst, arenas[1].base + src, n) != arenas[1].base + dst)
+    fail("memmove", "wrong return value");
+  memmove(arenas[2].base + dst, arenas[2].base + src, n);
+  if (memcmp(arenas[1].base, arenas[2].base, region))
+    fail("memmove", "n %zu src %zu dst %zu", n, src, dst);
+}
+
+static void (*const fuzzers[])() = {
+  fuzz_strlen, fuzz_strnlen, fuzz_memchr, fuzz_memcmp, fuzz_strcmp,
+  fuzz_strncpy, fuzz_memset, fuzz_memcpy, fuzz_memmove,
+};
+#define NR_FUZZERS (sizeof(fuzzers) / sizeof(fuzzers[0]))
+
+static void fuzz(unsigned iterations, unsigned seed) {
+  size_t v;
+  for (v = 0; v < NR_VARIANTS; v++) {
+    use_variant(&variants[v]);
+    variant_name = variants[v].name;
+    rand_seed(seed);
+    for (iteration = 0; iteration < iterations; iteration++)
+      fuzzers[iteration % NR_FUZZERS]();
+  }
+  printf("memtest: %u iterations on %zu variants, seed %u: ok\n",
+         iterations, NR_VARIANTS, seed);
+}
+
+// ---------------------------
+// Benchmark
+// ---------------------------
+
+// Through volatile pointers, so that the compiler can't inline glibc's.
+struct impls {
+  size_t (*volatile strlen)(const char *);
+  void *(*volatile memchr)(const void *, int, size_t);
+  int (*volatile memcmp)(const void *, const void *, size_t);
+  void *(*volatile memset)(void *, int, size_t);
+  void *(*volatile memcpy)(void *, const void *, size_t);
+  void *(*volatile memmove)(void *, const void *, size_t);
+};
+
+static const struct impls glibc = { strlen, memchr, memcmp, memset, memcpy, memmove };
+static const struct impls kernel = { k_strlen, k_memchr, k_memcmp, k_memset, k_memcpy, k_memmove };
+
+static const char *const bench_ops[] = { "strlen", "memchr", "memcmp", "memset", "memcpy", "memmove" };
+static const size_t bench_sizes[] = { 16, 64, 256, 1024, 4096, MAX_LEN - 300 };
+
+#define BENCH_BYTES (64 << 20)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns MB/s.
+static double bench_one(const struct impls *f, size_t op, size_t n) {
+  char *a = arenas[0].base + SLACK, *b = arenas[1].base + SLACK;
+  memset(a, 'a', n);
+  memset(b, 'a', n);
+  a[n - 1] = 0;     // for strlen
+  size_t reps = BENCH_BYTES / n, i;
+  volatile size_t sink = 0;
+  double start = now();
+  for (i = 0; i < reps; i++) {
+    switch (op) {
+    case 0: sink += f->strlen(a); break;
+    case 1: sink += (size_t)f->memchr(a, 'z', n); break;
+    case 2: sink += f->memcmp(a, b, n); break;
+    case 3: f->memset(b, i, n); break;
+    case 4: f->memcpy(b, a, n); break;
+    case 5: f->memmove(a + 1, a, n - 1); break;
+    }
+  }
+  (void)sink;
+  return (double)reps * n / (now() - start) / 1e6;
+}
+
+static void bench() {
+  size_t op, s, v;
+  printf("%-8s %7s %10s", "op", "bytes", "glibc");
+  for (v = 0; v < NR_VARIANTS; v++)
+    printf(" %10s", variants[v].name);
+  printf("   (MB/s)\n");
+  for (op = 0; op < sizeof(bench_ops) / sizeof(bench_ops[0]); op++) {
+    for (s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+      size_t n = bench_sizes[s];
+      printf("%-8s %7zu %10.0f", bench_ops[op], n, bench_one(&glibc, op, n));
+      for (v = 0; v < NR_VARIANTS; v++) {
+        use_variant(&variants[v]);
+        printf(" %10.0f", bench_one(&kernel, op, n));
+      }
+      printf("\n");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t i;
+  page_size = sysconf(_SC_PAGESIZE);
+  for (i = 0; i < sizeof(arenas) / sizeof(arenas[0]); i++)
+    arena_init(&arenas[i]);
+  quiet = true;
+
+  if (argc > 1 && !strcmp(argv[1], "--bench")) {
+    bench();
+    return 0;
+  }
+  unsigned iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+  unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 0) : (unsigned)time(NULL);
+  fuzz(iterations, seed);
+  return 0;
+}
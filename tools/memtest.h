@@ -0,0 +1,56 @@
+/* Forced ahead of string.c (gcc -include) when tools/memtest.c builds it
+ * for the host. It stands in for the kernel headers string.c uses, which
+ * are then skipped by their include guards, and lets memtest.c choose the
+ * CPU features init_memops sees, and so the variants it picks.
+ */
+#ifndef __MEMTEST_H__
+#define __MEMTEST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define __CPU_H__
+#define __KLOG_H__
+#define __FRAMEBUFFER_H__
+#define __COMPILER_H__
+
+#define __hot
+#define __cold
+#define __init
+
+#define CPUID_FEAT7_EBX_ERMS (1 << 9)
+
+extern bool memtest_sse2;
+extern bool memtest_erms;
+
+static inline bool cpu_enable_sse() {
+  return memtest_sse2;
+}
+
+static inline bool cpu_has_leaf7_ebx_feature(uint32_t feature) {
+  (void)feature;
+  return memtest_erms;
+}
+
+/* Interrupts are the kernel's business: nothing to save here. */
+static inline uint32_t irq_save() {
+  return 0;
+}
+
+static inline void irq_restore(uint32_t flags) {
+  (void)flags;
+}
+
+static inline uint64_t div64_32(uint64_t n, uint32_t base, uint32_t *rem) {
+  if (rem)
+    *rem = n % base;
+  return n / base;
+}
+
+#define KLOG_INFO 3
+void klog(uint32_t level, const char *format, ...);
+
+void fb_write(char *buf, unsigned int len);
+void fb_flush();
+
+#endif
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Packs a directory into an initrd image (see initrd.h for the format).
+
+    tools/mkinitrd.py -o iso/boot/initrd.img initrd/
+
+Files are named by their path below the directory, with / separators.
+"""
+
+import argparse
+import os
+import struct
+
+MAGIC = 0x31445249  # "IRD1"
+HEADER = struct.Struct("<4I")
+ENTRY = struct.Struct("<6I")
+DATA_ALIGN = 16
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def align(n, a):
+    return (n + a - 1) & ~(a - 1)
+
+
+def collect(root):
+    files = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for name in sorted(filenames):
+            path = os.path.join(dirpath, name)
+            rel = os.path.relpath(path, root).replace(os.sep, "/")
+            with open(path, "rb") as f:
+                files.append((rel.encode(), f.read()))
+    return files
+
+
+def build(files):
+    nfiles = len(files)
+    nbuckets = 1
+    while nbuckets < nfiles:
+        nbuckets *= 2
+
+    entries_at = HEADER.size + 4 * nbuckets
+    names_at = entries_at + ENTRY.size * nfiles
+    names = b""
+    name_offsets = []
+    for name, _ in files:
+        name_offsets.append(names_at + len(names))
+        names += name + b"\0"
+
+    data = b""
+    data_at = align(names_at + len(names), DATA_ALIGN)
+    data_offsets = []
+    for _, contents in files:
+        data += b"\0" * (align(len(data), DATA_ALIGN) - len(data))
+        data_offsets.append(data_at + len(data))
+        data += contents
+    size = data_at + len(data)
+
+    # Chain each bucket through the entries' next fields, newest first.
+    buckets = [0] * nbuckets
+    nexts = [0] * nfiles
+    hashes = [fnv1a(name) for name, _ in files]
+    for i, h in enumerate(hashes):
+        b = h & (nbuckets - 1)
+        nexts[i] = buckets[b]
+        buckets[b] = i + 1
+
+    out = HEADER.pack(MAGIC, nfiles, nbuckets, size)
+    out += struct.pack("<%dI" % nbuckets, *buckets)
+    for i, (name, contents) in enumerate(files):
+        out += ENTRY.pack(hashes[i], nexts[i], name_offsets[i], len(name),
+                          data_offsets[i], len(contents))
+    out += names
+    out += b"\0" * (data_at - len(out))
+    out += data
+    assert len(out) == size
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("directory")
+    parser.add_argument("-o", "--output", required=True)
+    args = parser.parse_args()
+
+    files = collect(args.directory)
+    with open(args.output, "wb") as f:
+        f.write(build(files))
+
+
+if __name__ == "__main__":
+    main()
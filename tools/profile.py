@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Symbolizes the samples profile_dump() streams over COM1 (see profile.h).
+
+    tools/profile.py com1.out                      # flat profile
+    tools/profile.py --folded com1.out > out.folded
+    flamegraph.pl out.folded > flame.svg
+    tools/profile.py --order com1.out > text_order.ld   # make text-order
+
+Symbols come from kernel.sym (make kernel.sym), which must match the
+kernel that produced the capture.
+"""
+
+import argparse
+import bisect
+import collections
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import tracedecode  # noqa: E402
+
+
+class Symbols:
+    def __init__(self, path):
+        entries = []
+        with open(path) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) >= 2:
+                    entries.append((int(fields[0], 16), fields[1]))
+        entries.sort()
+        self.addrs = [a for a, _ in entries]
+        self.names = [n for _, n in entries]
+
+    def lookup(self, pc):
+        i = bisect.bisect_right(self.addrs, pc) - 1
+        return self.names[i] if i >= 0 else "0x%x" % pc
+
+
+def samples(data, events):
+    """Yields each sample's call chain, outermost caller first."""
+    ids = {name: i for i, (name, _, _) in enumerate(events)}
+    info, sample = ids["TRACE_PROFILE_INFO"], ids["TRACE_PROFILE_SAMPLE"]
+    for event, _, _, args in tracedecode.frames(data):
+        if event == info:
+            count, hz, missed = (list(args) + [0, 0, 0])[:3]
+            sys.stderr.write("%d samples at %d Hz, %d missed\n" % (count, hz, missed))
+        elif event == sample:
+            pcs = [pc for pc in args if pc]
+            yield list(reversed(pcs))
+
+
+def symbolize(chain, syms):
+    # Callers are return addresses: step back into the call instruction so
+    # a call at the very end of a function is charged to that function.
+    innermost = len(chain) - 1
+    return [syms.lookup(pc if i == innermost else pc - 1) for i, pc in enumerate(chain)]
+
+
+def print_order(stacks, coverage):
+    """Prints input section patterns for the functions the samples landed
+    in, most samples first, until they cover the given share of samples.
+    With -ffunction-sections GCC puts function f in .text.f, or in
+    .text.hot.f if it is marked hot."""
+    self_counts = collections.Counter()
+    for stack, count in stacks.items():
+        self_counts[stack[-1]] += count
+    total = sum(self_counts.values())
+    print("/* Generated by tools/profile.py --order from %d samples. */" % total)
+    covered = 0
+    for name, count in self_counts.most_common():
+        if total and covered >= coverage * total:
+            break
+        if name.startswith("0x"):
+            continue
+        covered += count
+        print("*(.text.%s .text.hot.%s)" % (name, name))
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("capture", nargs="?", default="com1.out")
+    parser.add_argument("--symbols", default="kernel.sym")
+    parser.add_argument("--events", default=os.path.join(root, "trace_events.h"))
+    parser.add_argument("--folded", action="store_true",
+                        help="emit folded stacks for flamegraph.pl")
+    parser.add_argument("--order", action="store_true",
+                        help="emit a link.ld fragment laying functions out hottest first")
+    parser.add_argument("--coverage", type=float, default=0.99,
+                        help="with --order, the share of samples the listed functions cover")
+    args = parser.parse_args()
+
+    syms = Symbols(args.symbols)
+    events = tracedecode.load_events(args.events)
+    with open(args.capture, "rb") as f:
+        data = f.read()
+
+    stacks = collections.Counter()
+    for chain in samples(data, events):
+        if chain:
+            stacks[tuple(symbolize(chain, syms))] += 1
+
+    if args.folded:
+        for stack, count in sorted(stacks.items()):
+            print("%s %d" % (";".join(stack), count))
+        return
+
+    if args.order:
+        print_order(stacks, args.coverage)
+        return
+
+    total = sum(stacks.values())
+    if not total:
+        print("no samples")
+        return
+    self_counts = collections.Counter()
+    total_counts = collections.Counter()
+    for stack, count in stacks.items():
+        self_counts[stack[-1]] += count
+        for name in set(stack):
+            total_counts[name] += count
+
+    print("%8s %7s %8s %7s  %s" % ("self", "%", "total", "%", "function"))
+    names = sorted(total_counts, key=lambda n: (self_counts[n], total_counts[n]), reverse=True)
+    for name in names:
+        count = self_counts[name]
+        print("%8d %6.2f%% %8d %6.2f%%  %s" % (
+            count, 100.0 * count / total,
+            total_counts[name], 100.0 * total_counts[name] / total, name))
+
+
+if __name__ == "__main__":
+    main()
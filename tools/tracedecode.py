@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Decodes the binary trace the kernel streams over COM1 (see trace.h).
+
+    tools/tracedecode.py com1.out                   # one line per event
+    tools/tracedecode.py --chrome com1.out > t.json # chrome://tracing, Perfetto
+
+Event names, kinds and format strings come from trace_events.h, so this
+must be run against the same tree the kernel was built from.
+"""
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+
+TRACE_SYNC = 0xA5
+HEADER = struct.Struct("<BHBBQ")  # sync, event, cpu, nargs, tsc
+MAX_ARGS = 4
+
+EVENT_RE = re.compile(r'^\s*TRACE_EVENT\(\s*(\w+)\s*,\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', re.M)
+
+
+def load_events(path):
+    with open(path) as f:
+        return [(name, kind, fmt.replace("%u", "%d"))
+                for name, kind, fmt in EVENT_RE.findall(f.read())]
+
+
+def frames(data):
+    """Yields (event, cpu, tsc, args), skipping anything that isn't a valid frame."""
+    i = 0
+    while i + HEADER.size <= len(data):
+        if data[i] != TRACE_SYNC:
+            i += 1
+            continue
+        _, event, cpu, nargs, tsc = HEADER.unpack_from(data, i)
+        end = i + HEADER.size + 4 * nargs + 1
+        if nargs > MAX_ARGS or end > len(data) or sum(data[i:end]) & 0xFF:
+            i += 1
+            continue
+        args = struct.unpack_from("<%dI" % nargs, data, i + HEADER.size)
+        yield event, cpu, tsc, args
+        i = end
+
+
+def describe(events, event, args):
+    if event >= len(events):
+        return "unknown event %d %s" % (event, list(args)), "INSTANT"
+    name, kind, fmt = events[event]
+    try:
+        return fmt % args, kind
+    except (TypeError, ValueError):
+        return "%s %s" % (name, list(args)), kind
+
+
+def decode(data, events):
+    """Yields (cpu, microseconds or None, tsc, text, kind)."""
+    khz = None
+    start = None
+    for event, cpu, tsc, args in frames(data):
+        if event < len(events) and events[event][0] == "TRACE_CLOCK" and args:
+            khz = args[0]
+            start = tsc
+        text, kind = describe(events, event, args)
+        us = (tsc - start) * 1000.0 / khz if khz else None
+        yield cpu, us, tsc, text, kind
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("capture", nargs="?", default="com1.out")
+    parser.add_argument("--events", default=os.path.join(root, "trace_events.h"))
+    parser.add_argument("--chrome", action="store_true", help="emit Chrome trace JSON")
+    args = parser.parse_args()
+
+    events = load_events(args.events)
+    with open(args.capture, "rb") as f:
+        data = f.read()
+
+    if not args.chrome:
+        for cpu, us, tsc, text, _ in decode(data, events):
+            when = "%14.3f us" % us if us is not None else "tsc %14d" % tsc
+            print("cpu%d %s  %s" % (cpu, when, text))
+        return
+
+    out = []
+    for cpu, us, tsc, text, kind in decode(data, events):
+        if us is None:
+            continue  # no TRACE_CLOCK yet, so no time base
+        record = {"name": text, "ts": us, "pid": 0, "tid": cpu}
+        if kind == "BEGIN":
+            record["ph"] = "B"
+        elif kind == "END":
+            record["ph"] = "E"
+        else:
+            record["ph"] = "i"
+            record["s"] = "t"
+        out.append(record)
+    json.dump({"traceEvents": out, "displayTimeUnit": "ns"}, sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
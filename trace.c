@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "trace.h"
+#include "ring.h"
+#include "smp.h"
+#include "cpu.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "ktimer.h"
+#include "timer.h"
+#include "serial.h"
+#include "compiler.h"
+
+// Records taken off a ring at a time when draining.
+#define TRACE_DRAIN_BATCH 8
+// The largest frame: sync, event, cpu, nargs, tsc, args, checksum.
+#define TRACE_FRAME_MAX (1 + 2 + 1 + 1 + 8 + 4 * TRACE_MAX_ARGS + 1)
+
+// Serialises whole frames on COM1: the drain timer, trace_flush and
+// trace_emit.
+static spinlock_t drain_lock = SPINLOCK_INIT("trace drain");
+
+static uint8_t *put_bytes(uint8_t *p, uint64_t value, uint32_t n) {
+  while (n--) {
+    *p++ = value;
+    value >>= 8;
+  }
+  return p;
+}
+
+// Encodes one frame at p and returns the end of it.
+static uint8_t *encode(uint8_t *p, const struct trace_record *rec) {
+  uint8_t *start = p;
+  uint32_t i;
+  *p++ = TRACE_SYNC;
+  p = put_bytes(p, rec->event, 2);
+  *p++ = rec->cpu;
+  *p++ = rec->nargs;
+  p = put_bytes(p, rec->tsc, 8);
+  for (i = 0; i < rec->nargs; i++)
+    p = put_bytes(p, rec->args[i], 4);
+
+  uint8_t sum = 0;
+  while (start < p)
+    sum += *start++;
+  *p++ = -sum;
+  return p;
+}
+
+void trace_emit(const struct trace_record *rec) {
+  uint8_t frame[TRACE_FRAME_MAX];
+  uint32_t flags = spin_lock_irqsave(&drain_lock);
+  uint8_t *end = encode(frame, rec);
+  serial_write((char *)frame, end - frame);
+  spin_unlock_irqrestore(&drain_lock, flags);
+}
+
+#ifdef TRACE
+
+// One ring per CPU. Interrupts and the code they interrupt both trace, so
+// the producer side runs with interrupts disabled; that keeps each ring
+// single-producer without a lock.
+static struct ring trace_rings[MAX_CPUS];
+static struct trace_record trace_bufs[MAX_CPUS][TRACE_RING_SIZE];
+static volatile uint32_t trace_dropped[MAX_CPUS];
+static volatile bool trace_on = false;
+
+static struct ktimer drain_timer;
+
+void trace_event(uint32_t event, uint32_t nargs, uint32_t a0, uint32_t a1,
+                 uint32_t a2, uint32_t a3) {
+  if (!trace_on)
+    return;
+  // The drain timer fires every TRACE_DRAIN_MS, busy or not; tracing it
+  // would keep COM1 busy with the trace of the trace.
+  if (event == TRACE_KTIMER_EXPIRE && a0 == (uint32_t)&drain_timer)
+    return;
+
+  uint32_t flags = irq_save();
+  uint32_t cpu = this_cpu()->id;
+  struct trace_record *rec = ring_reserve(&trace_rings[cpu]);
+  if (!rec) {
+    atomic_inc(&trace_dropped[cpu]);
+    irq_restore(flags);
+    return;
+  }
+  rec->tsc = rdtsc();
+  rec->event = event;
+  rec->cpu = cpu;
+  rec->nargs = nargs;
+  rec->args[0] = a0;
+  rec->args[1] = a1;
+  rec->args[2] = a2;
+  rec->args[3] = a3;
+  ring_commit(&trace_rings[cpu]);
+  irq_restore(flags);
+}
+
+// Call with drain_lock held.
+static void drain_cpu(uint32_t cpu) {
+  struct trace_record batch[TRACE_DRAIN_BATCH];
+  uint8_t frames[TRACE_DRAIN_BATCH * TRACE_FRAME_MAX];
+  uint32_t n, i;
+
+  uint32_t dropped = atomic_xchg(&trace_dropped[cpu], 0);
+  if (dropped) {
+    struct trace_record rec = {
+      .tsc = rdtsc(), .event = TRACE_DROPPED, .cpu = cpu, .nargs = 1,
+      .args = { dropped },
+    };
+    uint8_t *end = encode(frames, &rec);
+    serial_write((char *)frames, end - frames);
+  }
+
+  while ((n = ring_dequeue_burst(&trace_rings[cpu], batch, TRACE_DRAIN_BATCH)) > 0) {
+    uint8_t *p = frames;
+    for (i = 0; i < n; i++)
+      p = encode(p, &batch[i]);
+    serial_write((char *)frames, p - frames);
+  }
+}
+
+static void drain_all() {
+  uint32_t cpu;
+  for (cpu = 0; cpu < cpus_online; cpu++)
+    drain_cpu(cpu);
+}
+
+void trace_flush() {
+  uint32_t flags = spin_lock_irqsave(&drain_lock);
+  drain_all();
+  spin_unlock_irqrestore(&drain_lock, flags);
+}
+
+static void drain_expired(struct ktimer *timer) {
+  // Whoever holds the lock is draining already.
+  if (spin_trylock(&drain_lock)) {
+    drain_all();
+    spin_unlock(&drain_lock);
+  }
+  ktimer_add(timer, jiffies + msecs_to_jiffies(TRACE_DRAIN_MS));
+}
+
+void __init init_trace() {
+  uint32_t cpu;
+  for (cpu = 0; cpu < MAX_CPUS; cpu++)
+    ring_init(&trace_rings[cpu], trace_bufs[cpu], TRACE_RING_SIZE,
+              sizeof(struct trace_record));
+  trace_on = true;
+  trace1(TRACE_CLOCK, timer_tsc_khz());
+
+  ktimer_init(&drain_timer, &drain_expired);
+  ktimer_add(&drain_timer, jiffies + msecs_to_jiffies(TRACE_DRAIN_MS));
+}
+
+#endif
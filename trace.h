@@ -0,0 +1,106 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/**
+ * Binary event tracing. trace0..trace4 append a record (TSC timestamp,
+ * event id, CPU and up to four 32-bit arguments) to the calling CPU's
+ * trace ring, which costs a few tens of cycles: there is no formatting in
+ * the kernel at all. A timer drains the rings to COM1 as framed records,
+ * and tools/tracedecode.py turns the capture back into text or a Chrome
+ * trace (chrome://tracing, Perfetto).
+ *
+ * Tracing is compiled in with make DEFINES=-DTRACE. Without it trace0..4
+ * are empty, and only trace_emit remains, for the profiler's dumps.
+ */
+
+#define TRACE_EVENT(id, kind, format) id,
+enum trace_event {
+#include "trace_events.h"
+  NR_TRACE_EVENTS
+};
+#undef TRACE_EVENT
+
+#define TRACE_MAX_ARGS 4
+
+struct trace_record {
+  uint64_t tsc;
+  uint16_t event;
+  uint8_t cpu;
+  uint8_t nargs;
+  uint32_t args[TRACE_MAX_ARGS];
+};
+
+/* Entries in each CPU's trace ring. Must be a power of two. */
+#define TRACE_RING_SIZE 512
+
+/* How often the rings are drained to COM1. */
+#define TRACE_DRAIN_MS 10
+
+/**
+ * Wire format on COM1, little endian:
+ *
+ *   TRACE_SYNC, event (u16), cpu (u8), nargs (u8), tsc (u64),
+ *   args (u32 * nargs), checksum (u8)
+ *
+ * The checksum makes the sum of all bytes of the frame zero mod 256. The
+ * decoder resynchronises on TRACE_SYNC if a frame doesn't check out, which
+ * also skips the klog text that shares the port.
+ */
+#define TRACE_SYNC 0xA5
+
+#ifdef TRACE
+
+/**
+ * init_trace:
+ * Sets up the per-CPU rings, emits a TRACE_CLOCK record so the decoder can
+ * turn TSC values into time, and starts the drain timer. Requires
+ * init_timer, init_ktimers and init_serial. Events before this are dropped.
+ */
+void init_trace();
+
+void trace_event(uint32_t event, uint32_t nargs, uint32_t a0, uint32_t a1,
+                 uint32_t a2, uint32_t a3);
+
+/* Sends everything recorded so far to COM1 (queued on the serial driver).
+ * Not from interrupt handlers. */
+void trace_flush();
+
+#else
+
+static inline void trace_event(uint32_t event, uint32_t nargs, uint32_t a0, uint32_t a1,
+                               uint32_t a2, uint32_t a3) {
+  (void)event; (void)nargs; (void)a0; (void)a1; (void)a2; (void)a3;
+}
+
+#endif
+
+static inline void trace0(uint32_t event) {
+  trace_event(event, 0, 0, 0, 0, 0);
+}
+
+static inline void trace1(uint32_t event, uint32_t a0) {
+  trace_event(event, 1, a0, 0, 0, 0);
+}
+
+static inline void trace2(uint32_t event, uint32_t a0, uint32_t a1) {
+  trace_event(event, 2, a0, a1, 0, 0);
+}
+
+static inline void trace3(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2) {
+  trace_event(event, 3, a0, a1, a2, 0);
+}
+
+static inline void trace4(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3) {
+  trace_event(event, 4, a0, a1, a2, a3);
+}
+
+/**
+ * trace_emit:
+ * Sends a record straight to COM1, bypassing the rings. For bulk dumps
+ * that would overflow them. Not from interrupt handlers.
+ */
+void trace_emit(const struct trace_record *rec);
+
+#endif
@@ -0,0 +1,24 @@
+// The trace event table. Each entry is
+//
+//   TRACE_EVENT(id, kind, format)
+//
+// The kernel only uses the ids (see trace.h); the kinds and format strings
+// are read by tools/tracedecode.py, so they never end up in the kernel
+// image. kind is BEGIN or END for events that open or close a span on
+// their CPU, INSTANT otherwise. Formats take %d, %u and %x, one per
+// argument. Add new events at the end: ids are positions in this table.
+//
+// No include guard: this file is meant to be included more than once.
+
+TRACE_EVENT(TRACE_CLOCK,           INSTANT, "TSC at %u kHz")
+TRACE_EVENT(TRACE_DROPPED,         INSTANT, "%u events dropped")
+TRACE_EVENT(TRACE_IRQ_ENTER,       BEGIN,   "irq %u")
+TRACE_EVENT(TRACE_IRQ_EXIT,        END,     "irq %u")
+TRACE_EVENT(TRACE_SOFTIRQ_ENTER,   BEGIN,   "softirqs %x")
+TRACE_EVENT(TRACE_SOFTIRQ_EXIT,    END,     "softirqs %x")
+TRACE_EVENT(TRACE_SCHED_SWITCH,    INSTANT, "switch from thread %u to %u")
+TRACE_EVENT(TRACE_KTIMER_EXPIRE,   INSTANT, "ktimer %x expired, callback %x")
+TRACE_EVENT(TRACE_TASK_BEGIN,      BEGIN,   "task %x(%x)")
+TRACE_EVENT(TRACE_TASK_END,        END,     "task %x")
+TRACE_EVENT(TRACE_PROFILE_INFO,    INSTANT, "profile: %u samples at %u Hz, %u missed")
+TRACE_EVENT(TRACE_PROFILE_SAMPLE,  INSTANT, "sample %x %x %x %x")
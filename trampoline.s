@@ -0,0 +1,82 @@
+; Startup code for the application processors. smp.c copies everything
+; between trampoline_start and trampoline_end to TRAMPOLINE_BASE, fills in
+; the data fields at the end, and points the startup IPI at it. An AP
+; starts here in real mode, switches to protected mode with paging on,
+; picks its CPU number and stack, and calls ap_entry(cpu).
+
+global trampoline_start
+global trampoline_end
+global trampoline_cr3
+global trampoline_stacks
+global trampoline_next_cpu
+global trampoline_max_cpus
+extern ap_entry
+
+TRAMPOLINE_BASE equ 0x8000
+
+; The address a trampoline label ends up at once copied.
+%define TRAMP(label) (TRAMPOLINE_BASE + (label - trampoline_start))
+
+; Only ever run from the copy, so the original goes with the rest of the
+; boot-only data (see compiler.h).
+section .init.data progbits alloc noexec write align=16
+[bits 16]
+trampoline_start:
+  cli
+  cld
+  xor ax, ax
+  mov ds, ax
+  lgdt [TRAMP(tramp_gdt_ptr)]
+  mov eax, cr0
+  or eax, 1                   ; protected mode enable
+  mov cr0, eax
+  jmp dword 0x08:TRAMP(tramp_protected_mode)
+
+[bits 32]
+tramp_protected_mode:
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+  mov fs, ax
+  mov gs, ax
+  mov ss, ax
+
+  mov eax, [TRAMP(trampoline_cr3)]
+  mov cr3, eax
+  mov eax, cr0
+  or eax, 0x80010000          ; paging enable, and write protect (CR0.WP)
+  mov cr0, eax
+
+  ; Claim a CPU number and the stack that goes with it.
+  mov eax, 1
+  lock xadd [TRAMP(trampoline_next_cpu)], eax
+  cmp eax, [TRAMP(trampoline_max_cpus)]
+  jae .halt
+  mov edx, [TRAMP(trampoline_stacks)]
+  mov esp, [edx + eax*4]
+
+  push eax
+  mov ebx, ap_entry           ; absolute: this code doesn't run where it was linked
+  call ebx
+.halt:
+  cli
+  hlt
+  jmp .halt
+
+align 8
+tramp_gdt:
+  dq 0x0000000000000000       ; null
+  dq 0x00CF9A000000FFFF       ; flat ring 0 code
+  dq 0x00CF92000000FFFF       ; flat ring 0 data
+tramp_gdt_end:
+
+tramp_gdt_ptr:
+  dw tramp_gdt_end - tramp_gdt - 1
+  dd TRAMP(tramp_gdt)
+
+align 4
+trampoline_cr3:       dd 0    ; kernel page directory
+trampoline_stacks:    dd 0    ; pointer to an array of stack tops, by CPU number
+trampoline_next_cpu:  dd 0    ; the next CPU number to hand out
+trampoline_max_cpus:  dd 0
+trampoline_end: